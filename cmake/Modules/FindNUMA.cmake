@@ -0,0 +1,31 @@
+# - Try to find NUMA
+#
+# The following variables are optionally searched for defaults
+#  NUMA_ROOT_DIR:            Base directory where all NUMA components are found
+#
+# The following are set after configuration is done:
+#  NUMA_FOUND
+#  NUMA_INCLUDE_DIRS
+#  NUMA_LIBRARIES
+
+include(FindPackageHandleStandardArgs)
+
+set(NUMA_ROOT_DIR "" CACHE PATH "Folder containing libnuma")
+
+find_path(NUMA_INCLUDE_DIR numa.h
+  PATHS ${NUMA_ROOT_DIR}
+  PATH_SUFFIXES
+  include)
+
+find_library(NUMA_LIBRARY numa
+  PATHS ${NUMA_ROOT_DIR}
+  PATH_SUFFIXES
+  lib)
+
+find_package_handle_standard_args(NUMA DEFAULT_MSG
+  NUMA_INCLUDE_DIR NUMA_LIBRARY)
+
+if(NUMA_FOUND)
+  set(NUMA_INCLUDE_DIRS ${NUMA_INCLUDE_DIR})
+  set(NUMA_LIBRARIES ${NUMA_LIBRARY})
+endif()
@@ -11,6 +11,17 @@ function monitor {
     nohup monitor-condor-job --pid=$3 --do="$VIS_CMD" --every=100 --on_exit="$EXIT_CMD" >/dev/null &
 }
 
+# 10-18-26 Check that block sampling learns like uniform sampling. Compare
+# the goal_perc curves of the two modes before using -sampling blocks.
+# values="uniform blocks"
+# for v in $values;
+# do
+#     JOB="Sampling_$v"
+#     SAVE="/scratch/cluster/mhauskn/dqn-hfo/$JOB"
+#     PID=`cluster --gpu --prefix $SAVE ./dqn -save=$SAVE -seed 1 -sampling $v`
+#     monitor $JOB $SAVE $PID
+# done
+
 # 7-9-16 Train against a defense chaser
 JOB="Chaser_2v0"
 SAVE="/scratch/cluster/mhauskn/dqn-hfo/$JOB"
@@ -0,0 +1,203 @@
+#include "caffe_backend.hpp"
+#include "fused_mlp.hpp"
+#include <algorithm>
+#include <glog/logging.h>
+
+namespace dqn {
+
+CaffeBackend::CaffeBackend(const BackendNets& nets, int minibatch_size) :
+    nets_(nets),
+    actor_(nets.actor_solver->net()),
+    critic_(nets.critic_solver->net()),
+    minibatch_size_(minibatch_size),
+    state_input_size_(critic_->blob_by_name(states_blob_name)->count(1)),
+    actor_batch_(0),
+    critic_batch_(0),
+    fused_actor_step_(CanFuseAdamStep(*nets.actor_solver)),
+    fused_critic_step_(CanFuseAdamStep(*nets.critic_solver)),
+    states_input_(minibatch_size * state_input_size_, 0.0f),
+    action_input_(minibatch_size * kActionSize, 0.0f),
+    action_params_input_(minibatch_size * kActionParamSize, 0.0f),
+    target_input_(minibatch_size, 0.0f) {
+  // With a state encoder, the actions are flattened to join the encoded
+  // states: the action inputs, their flattening and the layers from the
+  // concat depend on the actions.
+  if (critic_->has_layer("actions_flatten")) {
+    for (const char* name : {action_input_layer_name,
+            action_params_input_layer_name, "actions_flatten",
+            "action_params_flatten"}) {
+      candidate_layers_.push_back(GetLayerIndex(*critic_, name));
+    }
+    candidate_layers_.push_back(GetLayerIndex(*critic_, "concat"));
+  }
+}
+
+NetSp CaffeBackend::Net(BackendNet net) const {
+  switch (net) {
+    case ACTOR: return actor_;
+    case CRITIC: return critic_;
+    case ACTOR_TARGET: return nets_.actor_target;
+    case CRITIC_TARGET: return nets_.critic_target;
+  }
+  LOG(FATAL) << "Unknown net " << net;
+  return NetSp();
+}
+
+void CaffeBackend::Input(const float* rows, int batch, int size,
+                         std::vector<float>& buffer) {
+  CHECK_LE(batch, minibatch_size_);
+  std::copy(rows, rows + batch * size, buffer.begin());
+}
+
+void CaffeBackend::ActorForward(BackendNet net, const float* states, int batch,
+                                float* actions, float* action_params) {
+  caffe::Net<float>& actor = *Net(net);
+  Input(states, batch, state_input_size_, states_input_);
+  DQN::InputDataIntoLayers(actor, states_input_.data(), NULL, NULL, NULL, NULL);
+  actor.ForwardPrefilled(nullptr);
+  if (net == ACTOR) {
+    actor_batch_ = batch;
+  }
+  const float* actions_data = actor.blob_by_name(actions_blob_name)->cpu_data();
+  const float* params_data =
+      actor.blob_by_name(action_params_blob_name)->cpu_data();
+  std::copy(actions_data, actions_data + batch * kActionSize, actions);
+  std::copy(params_data, params_data + batch * kActionParamSize, action_params);
+}
+
+const float* CaffeBackend::CriticForward(BackendNet net, const float* states,
+                                         const float* actions,
+                                         const float* action_params, int batch) {
+  caffe::Net<float>& critic = *Net(net);
+  Input(states, batch, state_input_size_, states_input_);
+  Input(actions, batch, kActionSize, action_input_);
+  Input(action_params, batch, kActionParamSize, action_params_input_);
+  DQN::InputDataIntoLayers(critic, states_input_.data(), action_input_.data(),
+                           action_params_input_.data(), target_input_.data(),
+                           NULL);
+  critic.ForwardPrefilled(nullptr);
+  if (net == CRITIC) {
+    critic_batch_ = batch;
+  }
+  return critic.blob_by_name(q_values_blob_name)->cpu_data();
+}
+
+void CaffeBackend::CriticForwardActions(BackendNet net, const float* states,
+                                        const float* actions,
+                                        const float* action_params, int batch,
+                                        int candidates, int heads,
+                                        float* q_values) {
+  if (candidate_layers_.empty() || net == CRITIC) {
+    ComputeBackend::CriticForwardActions(net, states, actions, action_params,
+                                         batch, candidates, heads, q_values);
+    return;
+  }
+  caffe::Net<float>& critic = *Net(net);
+  const float* q = CriticForward(net, states, actions, action_params, batch);
+  std::copy(q, q + batch * heads, q_values);
+  for (int c = 1; c < candidates; ++c) {
+    Input(actions + c * batch * kActionSize, batch, kActionSize, action_input_);
+    Input(action_params + c * batch * kActionParamSize, batch, kActionParamSize,
+          action_params_input_);
+    DQN::InputDataIntoLayers(critic, states_input_.data(), action_input_.data(),
+                             action_params_input_.data(), target_input_.data(),
+                             NULL);
+    for (int i = 0; i + 1 < candidate_layers_.size(); ++i) {
+      critic.ForwardFromTo(candidate_layers_[i], candidate_layers_[i]);
+    }
+    critic.ForwardFrom(candidate_layers_.back());
+    std::copy(q, q + batch * heads, q_values + c * batch * heads);
+  }
+}
+
+void CaffeBackend::CriticBackward(const float* q_values_diff, float* action_diff,
+                                  float* action_params_diff, bool param_grads) {
+  // Parameter gradients are zeroed first so they are those of this
+  // backward only. Otherwise the layers skip them for the backward,
+  // leaving those kept for CriticStep untouched.
+  std::vector<std::vector<bool> > propagate;
+  if (param_grads) {
+    ZeroGradParameters(*critic_);
+  } else {
+    for (const auto& layer : critic_->layers()) {
+      propagate.emplace_back(layer->blobs().size());
+      for (int i = 0; i < layer->blobs().size(); ++i) {
+        propagate.back()[i] = layer->param_propagate_down(i);
+        layer->set_param_propagate_down(i, false);
+      }
+    }
+  }
+  const auto q_values_blob = critic_->blob_by_name(q_values_blob_name);
+  float* diff = q_values_blob->mutable_cpu_diff();
+  std::fill(diff, diff + q_values_blob->count(), 0.0f);
+  std::copy(q_values_diff, q_values_diff + critic_batch_ * q_values_blob->count(1),
+            diff);
+  critic_->BackwardFrom(GetLayerIndex(*critic_, q_values_layer_name));
+  for (int l = 0; l < propagate.size(); ++l) {
+    for (int i = 0; i < propagate[l].size(); ++i) {
+      critic_->layers()[l]->set_param_propagate_down(i, propagate[l][i]);
+    }
+  }
+  if (action_diff) {
+    const float* d = critic_->blob_by_name(actions_blob_name)->cpu_diff();
+    std::copy(d, d + critic_batch_ * kActionSize, action_diff);
+  }
+  if (action_params_diff) {
+    const float* d = critic_->blob_by_name(action_params_blob_name)->cpu_diff();
+    std::copy(d, d + critic_batch_ * kActionParamSize, action_params_diff);
+  }
+}
+
+void CaffeBackend::ActorBackward(const float* action_diff,
+                                 const float* action_params_diff) {
+  const auto actions_blob = actor_->blob_by_name(actions_blob_name);
+  const auto action_params_blob = actor_->blob_by_name(action_params_blob_name);
+  float* actions = actions_blob->mutable_cpu_diff();
+  float* action_params = action_params_blob->mutable_cpu_diff();
+  std::fill(actions, actions + actions_blob->count(), 0.0f);
+  std::fill(action_params, action_params + action_params_blob->count(), 0.0f);
+  std::copy(action_diff, action_diff + actor_batch_ * kActionSize, actions);
+  std::copy(action_params_diff,
+            action_params_diff + actor_batch_ * kActionParamSize, action_params);
+  ZeroGradParameters(*actor_);
+  actor_->BackwardFrom(GetLayerIndex(*actor_, "actionpara_layer"));
+}
+
+void CaffeBackend::Step(caffe::Solver<float>& solver, int iter, bool fused) {
+  CHECK_EQ(solver.iter(), iter);
+  if (fused) {
+    FusedAdamStep(solver);
+  } else {
+    solver.ApplyUpdate();
+  }
+}
+
+bool CaffeBackend::CriticStep(int iter) {
+  Step(*nets_.critic_solver, iter, fused_critic_step_);
+  return true;
+}
+
+void CaffeBackend::ActorStep(int iter) {
+  Step(*nets_.actor_solver, iter, fused_actor_step_);
+}
+
+void CaffeBackend::SoftUpdateTargets(float tau) {
+  DQN::SoftUpdateNet(critic_, nets_.critic_target, tau);
+  DQN::SoftUpdateNet(actor_, nets_.actor_target, tau);
+}
+
+std::vector<ParamView> CaffeBackend::Params(BackendNet net) {
+  caffe::Net<float>& caffe_net = *Net(net);
+  std::vector<ParamView> views;
+  for (int i = 0; i < caffe_net.layers().size(); ++i) {
+    auto& blobs = caffe_net.layers()[i]->blobs();
+    for (int j = 0; j < blobs.size(); ++j) {
+      views.push_back({caffe_net.layer_names()[i] + "/" + std::to_string(j),
+                       blobs[j]->mutable_cpu_data(), blobs[j]->mutable_cpu_diff(),
+                       blobs[j]->count()});
+    }
+  }
+  return views;
+}
+
+} // namespace dqn
@@ -0,0 +1,67 @@
+#ifndef CAFFE_BACKEND_HPP_
+#define CAFFE_BACKEND_HPP_
+
+#include "compute_backend.hpp"
+
+namespace dqn {
+
+/**
+ * Runs the updates on the Caffe nets and solvers of the DQN
+ * themselves. Inputs are copied into the MemoryDataLayers' buffers,
+ * padded to the nets' minibatch size. Adam steps on the CPU are made
+ * by FusedAdamStep rather than the solvers.
+ */
+class CaffeBackend : public ComputeBackend {
+public:
+  CaffeBackend(const BackendNets& nets, int minibatch_size);
+
+  const char* name() const override { return "caffe"; }
+  void ActorForward(BackendNet net, const float* states, int batch,
+                    float* actions, float* action_params) override;
+  const float* CriticForward(BackendNet net, const float* states,
+                             const float* actions, const float* action_params,
+                             int batch) override;
+  // Runs the state encoder of a critic only for the first candidate
+  void CriticForwardActions(BackendNet net, const float* states,
+                            const float* actions, const float* action_params,
+                            int batch, int candidates, int heads,
+                            float* q_values) override;
+  void CriticBackward(const float* q_values_diff, float* action_diff,
+                      float* action_params_diff, bool param_grads) override;
+  void ActorBackward(const float* action_diff,
+                     const float* action_params_diff) override;
+  bool CriticStep(int iter) override;
+  void ActorStep(int iter) override;
+  void SoftUpdateTargets(float tau) override;
+  std::vector<ParamView> Params(BackendNet net) override;
+  // The Caffe nets are the backend's state
+  void Import() override {}
+  void Export() override {}
+
+protected:
+  NetSp Net(BackendNet net) const;
+  static void Step(caffe::Solver<float>& solver, int iter, bool fused);
+  // Copies batch rows of size floats into the first rows of buffer
+  void Input(const float* rows, int batch, int size, std::vector<float>& buffer);
+
+protected:
+  BackendNets nets_;
+  NetSp actor_;
+  NetSp critic_;
+  const int minibatch_size_;
+  const int state_input_size_;
+  // Layers (re)run for each further candidate of CriticForwardActions,
+  // empty without a state encoder
+  std::vector<int> candidate_layers_;
+  int actor_batch_;  // Of the last forward of ACTOR
+  int critic_batch_; // Of the last forward of CRITIC
+  const bool fused_actor_step_, fused_critic_step_;
+  std::vector<float> states_input_;
+  std::vector<float> action_input_;
+  std::vector<float> action_params_input_;
+  std::vector<float> target_input_; // Unused by the updates, always zero
+};
+
+} // namespace dqn
+
+#endif /* CAFFE_BACKEND_HPP_ */
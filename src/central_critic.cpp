@@ -0,0 +1,436 @@
+#include "central_critic.hpp"
+#include "compute_backend.hpp"
+#include "memory_budget.hpp"
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iterator>
+#include <numeric>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <glog/logging.h>
+
+namespace dqn {
+
+DECLARE_int32(seed);
+DECLARE_double(tau);
+DECLARE_int32(soft_update_freq);
+DECLARE_double(gamma);
+DECLARE_int32(memory_threshold);
+DECLARE_int32(loss_display_iter);
+DECLARE_int32(snapshot_freq);
+DECLARE_double(beta);
+DECLARE_bool(remove_old_snapshots);
+DECLARE_bool(snapshot_memory);
+DECLARE_double(explore_uncertainty);
+
+// Trials older than this are dropped if some agent never added its
+// episode (e.g. because it was evaluating).
+constexpr int kMaxStagedTrials = 16;
+
+CentralCritic::CentralCritic(caffe::SolverParameter& critic_solver_param,
+                             const std::vector<DQN*>& agents) :
+    agents_(agents),
+    num_agents_(agents.size()),
+    state_size_(agents.front()->state_size()),
+    joint_state_size_(agents.size() * agents.front()->state_size()),
+    memory_capacity_(ReplayCapacity(
+        JointTransitionBytes(agents.front()->state_size(), agents.size()))),
+    random_engine(),
+    smoothed_critic_loss_(0),
+    smoothed_actor_loss_(0),
+    last_snapshot_iter_(0) {
+  for (DQN* agent : agents_) {
+    CHECK_EQ(agent->frames(), 1)
+        << "Joint transitions only hold the latest state of each agent";
+    CHECK_EQ(agent->n_step(), 1) << "The central critic uses 1-step targets";
+    CHECK_EQ(agent->minibatch_size(), kMinibatchSize)
+        << "The central critic uses minibatches of " << kMinibatchSize;
+    CHECK_EQ(std::string(agent->backend_->name()), "caffe")
+        << "The central critic updates the actors with Caffe";
+    CHECK(!agent->state_normalizer_)
+        << "The central critic does not normalize the agents' states";
+    CHECK_EQ(FLAGS_explore_uncertainty, 0)
+        << "The central critic does not rank actions by the agents' heads";
+  }
+  // Agents use the streams 0..num_agents-1 of the seed
+  if (FLAGS_seed <= 0) {
+    random_engine = Rng::Stream(
+        std::chrono::system_clock::now().time_since_epoch().count(), num_agents_);
+  } else {
+    random_engine = Rng::Stream(FLAGS_seed, num_agents_);
+  }
+  critic_solver_param.mutable_net_param()->CopyFrom(
+      CreateCriticNet(joint_state_size_, num_agents_));
+  critic_solver_.reset(caffe::SolverRegistry<float>::CreateSolver(critic_solver_param));
+  critic_net_ = critic_solver_->net();
+  DQN::CloneNet(critic_net_, critic_target_net_);
+  LOG(INFO) << "Central critic for " << num_agents_ << " agents with "
+            << joint_state_size_ << " joint state features and a replay capacity of "
+            << memory_capacity_ << " joint transitions";
+}
+
+size_t CentralCritic::JointTransitionBytes(int state_size, int num_agents) {
+  // States and next states are stored in full with every transition
+  size_t states_bytes = MallocBytes(num_agents * state_size * sizeof(float));
+  return sizeof(JointTransition) + 2 * states_bytes +
+      MallocBytes(num_agents * sizeof(ActorOutput));
+}
+
+int CentralCritic::memory_size() {
+  std::lock_guard<std::mutex> lock(memory_mutex_);
+  return replay_memory_.size();
+}
+
+void CentralCritic::AddEpisode(int agent, int trial,
+                               std::vector<Transition>&& episode) {
+  std::lock_guard<std::mutex> lock(memory_mutex_);
+  staged_episodes_.erase(staged_episodes_.begin(),
+                         staged_episodes_.lower_bound(trial - kMaxStagedTrials));
+  std::vector<std::vector<Transition> >& episodes = staged_episodes_[trial];
+  episodes.resize(num_agents_);
+  // Move the transitions, not the buffer, so the caller can reuse its
+  // capacity for the next episode
+  episodes[agent].assign(std::make_move_iterator(episode.begin()),
+                         std::make_move_iterator(episode.end()));
+  episode.clear();
+  for (const std::vector<Transition>& e : episodes) {
+    if (e.empty()) {
+      return;
+    }
+  }
+  const int steps = episodes.front().size();
+  for (const std::vector<Transition>& e : episodes) {
+    if (e.size() != steps) {
+      LOG(WARNING) << "Dropping trial " << trial << ": agents played "
+                   << e.size() << " and " << steps << " steps";
+      staged_episodes_.erase(trial);
+      return;
+    }
+  }
+  // A trial longer than the whole capacity keeps its latest steps
+  int overflow = int(replay_memory_.size()) + steps - memory_capacity_;
+  int dropped = 0;
+  if (overflow > 0) {
+    const int evicted = std::min(overflow, int(replay_memory_.size()));
+    replay_memory_.erase(replay_memory_.begin(),
+                         replay_memory_.begin() + evicted);
+    dropped = overflow - evicted;
+  }
+  for (int t = dropped; t < steps; ++t) {
+    JointTransition joint;
+    joint.states.reserve(joint_state_size_);
+    joint.reward = 0;
+    joint.on_policy_target = 0;
+    bool terminal = false;
+    for (int i = 0; i < num_agents_; ++i) {
+      const Transition& transition = episodes[i][t];
+      const StateData& state = *std::get<0>(transition);
+      joint.states.insert(joint.states.end(), state.begin(), state.end());
+      joint.actions.push_back(std::get<1>(transition));
+      joint.reward += std::get<2>(transition) / num_agents_;
+      joint.on_policy_target += std::get<3>(transition) / num_agents_;
+      terminal |= !std::get<4>(transition);
+    }
+    if (!terminal) {
+      joint.next_states.reserve(joint_state_size_);
+      for (int i = 0; i < num_agents_; ++i) {
+        const StateData& next_state = *std::get<4>(episodes[i][t]).get();
+        joint.next_states.insert(joint.next_states.end(),
+                                 next_state.begin(), next_state.end());
+      }
+    }
+    replay_memory_.push_back(std::move(joint));
+  }
+  staged_episodes_.erase(trial);
+}
+
+void CentralCritic::Update() {
+  if (memory_size() < FLAGS_memory_threshold) {
+    return;
+  }
+  std::pair<float,float> res = UpdateActorsCritic();
+  if (iter() % FLAGS_loss_display_iter == 0) {
+    LOG(INFO) << "[Central] Critic Iteration " << iter()
+              << ", loss = " << smoothed_critic_loss_
+              << ", avg_q_value = " << smoothed_actor_loss_;
+    smoothed_critic_loss_ = 0;
+    smoothed_actor_loss_ = 0;
+  }
+  smoothed_critic_loss_ += res.first / float(FLAGS_loss_display_iter);
+  smoothed_actor_loss_ += res.second / float(FLAGS_loss_display_iter);
+  if (iter() >= last_snapshot_iter_ + FLAGS_snapshot_freq) {
+    Snapshot();
+    last_snapshot_iter_ = iter();
+  }
+}
+
+void CentralCritic::Snapshot() {
+  const std::string& prefix = critic_solver_->param().snapshot_prefix();
+  critic_solver_->Snapshot();
+  if (FLAGS_snapshot_memory) {
+    SnapshotReplayMemory(prefix + "_iter_" + std::to_string(iter()) + ".replaymemory");
+  }
+  if (FLAGS_remove_old_snapshots) {
+    RemoveSnapshots(prefix + "_iter_[0-9]+\\.(caffemodel|solverstate|replaymemory)",
+                    iter() - 1);
+  }
+  // The agents' own critics and replay memories are unused
+  for (DQN* agent : agents_) {
+    agent->Snapshot(agent->save_path(), FLAGS_remove_old_snapshots, false, false);
+  }
+}
+
+void CentralCritic::Restore(const std::string& snapshot_prefix) {
+  using namespace boost::filesystem;
+  const int last_iter = FindGreatestIter(snapshot_prefix + "_iter_[0-9]+\\.solverstate");
+  if (last_iter <= 0) {
+    return;
+  }
+  const std::string fname = snapshot_prefix + "_iter_" + std::to_string(last_iter);
+  LOG(INFO) << "Central critic resuming from " << fname << ".solverstate";
+  critic_solver_->Restore((fname + ".solverstate").c_str());
+  DQN::CloneNet(critic_net_, critic_target_net_);
+  last_snapshot_iter_ = iter();
+  if (is_regular_file(fname + ".replaymemory")) {
+    LoadReplayMemory(fname + ".replaymemory");
+  } else {
+    LOG(WARNING) << "No joint replay memory " << fname << ".replaymemory, "
+                 << "it refills from scratch";
+  }
+}
+
+void CentralCritic::SnapshotReplayMemory(const std::string& filename) {
+  std::lock_guard<std::mutex> lock(memory_mutex_);
+  LOG(INFO) << "Snapshotting joint memory to " << filename;
+  std::ofstream ofile(filename.c_str(),
+                      std::ios_base::out | std::ofstream::binary);
+  boost::iostreams::filtering_ostream out;
+  out.push(boost::iostreams::gzip_compressor());
+  out.push(ofile);
+  out.write((char*)&num_agents_, sizeof(int));
+  out.write((char*)&state_size_, sizeof(int));
+  int num_transitions = replay_memory_.size();
+  out.write((char*)&num_transitions, sizeof(int));
+  for (const JointTransition& t : replay_memory_) {
+    out.write((char*)t.states.data(), joint_state_size_ * sizeof(float));
+    out.write((char*)t.actions.data(), num_agents_ * sizeof(ActorOutput));
+    out.write((char*)&t.reward, sizeof(float));
+    out.write((char*)&t.on_policy_target, sizeof(float));
+    bool terminal = t.next_states.empty();
+    out.write((char*)&terminal, sizeof(bool));
+    if (!terminal) {
+      out.write((char*)t.next_states.data(), joint_state_size_ * sizeof(float));
+    }
+  }
+}
+
+void CentralCritic::LoadReplayMemory(const std::string& filename) {
+  CHECK(boost::filesystem::is_regular_file(filename)) << "Invalid file: " << filename;
+  LOG(INFO) << "Loading joint memory from " << filename;
+  std::ifstream ifile(filename.c_str(),
+                      std::ios_base::in | std::ofstream::binary);
+  boost::iostreams::filtering_istream in;
+  in.push(boost::iostreams::gzip_decompressor());
+  in.push(ifile);
+  int num_agents, state_size, num_transitions;
+  in.read((char*)&num_agents, sizeof(int));
+  in.read((char*)&state_size, sizeof(int));
+  CHECK_EQ(num_agents, num_agents_) << filename << " holds another team size";
+  CHECK_EQ(state_size, state_size_) << filename << " holds another state size";
+  in.read((char*)&num_transitions, sizeof(int));
+  std::lock_guard<std::mutex> lock(memory_mutex_);
+  replay_memory_.clear();
+  for (int i = 0; i < num_transitions; ++i) {
+    JointTransition t;
+    t.states.resize(joint_state_size_);
+    in.read((char*)t.states.data(), joint_state_size_ * sizeof(float));
+    t.actions.resize(num_agents_);
+    in.read((char*)t.actions.data(), num_agents_ * sizeof(ActorOutput));
+    in.read((char*)&t.reward, sizeof(float));
+    in.read((char*)&t.on_policy_target, sizeof(float));
+    bool terminal;
+    in.read((char*)&terminal, sizeof(bool));
+    if (!terminal) {
+      t.next_states.resize(joint_state_size_);
+      in.read((char*)t.next_states.data(), joint_state_size_ * sizeof(float));
+    }
+    replay_memory_.push_back(std::move(t));
+  }
+  CHECK(in) << "Truncated joint memory " << filename;
+  // The capacity may have shrunk since
+  while (replay_memory_.size() > memory_capacity_) {
+    replay_memory_.pop_front();
+  }
+  LOG(INFO) << "Loaded joint memory of size " << replay_memory_.size();
+}
+
+std::vector<float> CentralCritic::AgentStates(
+    const std::vector<float>& joint_states, int agent) {
+  std::vector<float> states_input(kMinibatchSize * state_size_);
+  for (int n = 0; n < kMinibatchSize; ++n) {
+    auto begin = joint_states.begin() + n * joint_state_size_ + agent * state_size_;
+    std::copy(begin, begin + state_size_, states_input.begin() + n * state_size_);
+  }
+  return states_input;
+}
+
+void CentralCritic::InputAgentActions(const std::vector<ActorOutput>& actions,
+                                      int agent,
+                                      std::vector<float>& action_input,
+                                      std::vector<float>& action_params_input) {
+  for (int n = 0; n < actions.size(); ++n) {
+    const ActorOutput& actor_output = actions[n];
+    std::copy(actor_output.begin(), actor_output.begin() + kActionSize,
+              action_input.begin() + (n * num_agents_ + agent) * kActionSize);
+    std::copy(actor_output.begin() + kActionSize, actor_output.end(),
+              action_params_input.begin() +
+              (n * num_agents_ + agent) * kActionParamSize);
+  }
+}
+
+std::vector<float> CentralCritic::CriticForward(
+    caffe::Net<float>& critic,
+    std::vector<float>& states_input,
+    std::vector<float>& action_input,
+    std::vector<float>& action_params_input) {
+  DLOG(INFO) << "  [Forward] " << critic.name();
+  std::vector<float> target_input(kMinibatchSize, 0.0f);
+  DQN::InputDataIntoLayers(critic, states_input.data(), action_input.data(),
+                           action_params_input.data(), target_input.data(), NULL);
+  critic.ForwardPrefilled(nullptr);
+  const auto q_values_blob = critic.blob_by_name(q_values_blob_name);
+  std::vector<float> q_values(kMinibatchSize);
+  for (int n = 0; n < kMinibatchSize; ++n) {
+    q_values[n] = q_values_blob->data_at(n,0,0,0);
+  }
+  return q_values;
+}
+
+std::pair<float,float> CentralCritic::UpdateActorsCritic() {
+  const auto critic_action_blob = critic_net_->blob_by_name(actions_blob_name);
+  const auto critic_action_params_blob =
+      critic_net_->blob_by_name(action_params_blob_name);
+  const auto q_values_blob = critic_net_->blob_by_name(q_values_blob_name);
+  const auto loss_blob = critic_net_->blob_by_name(loss_blob_name);
+  const int action_input_size = kMinibatchSize * num_agents_ * kActionSize;
+  const int action_params_input_size = kMinibatchSize * num_agents_ * kActionParamSize;
+  std::vector<float> states_input(kMinibatchSize * joint_state_size_, 0.0f);
+  std::vector<float> next_states_input(kMinibatchSize * joint_state_size_, 0.0f);
+  std::vector<float> action_input(action_input_size, 0.0f);
+  std::vector<float> action_params_input(action_params_input_size, 0.0f);
+  std::vector<float> rewards_batch(kMinibatchSize);
+  std::vector<float> on_policy_targets(kMinibatchSize);
+  std::vector<bool> terminal(kMinibatchSize);
+  {
+    std::lock_guard<std::mutex> lock(memory_mutex_);
+    int transitions[kMinibatchSize];
+    random_engine.FillUniformInt(transitions, kMinibatchSize, replay_memory_.size());
+    for (int n = 0; n < kMinibatchSize; ++n) {
+      const JointTransition& transition = replay_memory_[transitions[n]];
+      std::copy(transition.states.begin(), transition.states.end(),
+                states_input.begin() + n * joint_state_size_);
+      for (int i = 0; i < num_agents_; ++i) {
+        const ActorOutput& actor_output = transition.actions[i];
+        std::copy(actor_output.begin(), actor_output.begin() + kActionSize,
+                  action_input.begin() + (n * num_agents_ + i) * kActionSize);
+        std::copy(actor_output.begin() + kActionSize, actor_output.end(),
+                  action_params_input.begin() +
+                  (n * num_agents_ + i) * kActionParamSize);
+      }
+      rewards_batch[n] = transition.reward;
+      on_policy_targets[n] = transition.on_policy_target;
+      terminal[n] = transition.next_states.empty();
+      std::copy(transition.next_states.begin(), transition.next_states.end(),
+                next_states_input.begin() + n * joint_state_size_);
+    }
+  }
+  // Generate targets from the target actors of every agent
+  std::vector<float> next_action_input(action_input_size, 0.0f);
+  std::vector<float> next_action_params_input(action_params_input_size, 0.0f);
+  for (int i = 0; i < num_agents_; ++i) {
+    DQN& agent = *agents_[i];
+    std::vector<float> agent_states = AgentStates(next_states_input, i);
+    InputAgentActions(agent.SelectActionGreedily(
+        *agent.actor_target_net_, agent_states, kMinibatchSize),
+                      i, next_action_input, next_action_params_input);
+  }
+  const std::vector<float> target_q_values =
+      CriticForward(*critic_target_net_, next_states_input,
+                    next_action_input, next_action_params_input);
+  std::vector<float> target_input(kMinibatchSize, 0.0f);
+  for (int n = 0; n < kMinibatchSize; ++n) {
+    float off_policy_target = terminal[n] ? rewards_batch[n] :
+        rewards_batch[n] + FLAGS_gamma * target_q_values[n];
+    float target = FLAGS_beta * on_policy_targets[n] +
+        (1 - FLAGS_beta) * off_policy_target;
+    CHECK(std::isfinite(target)) << "Target not finite!";
+    target_input[n] = target;
+  }
+  DQN::InputDataIntoLayers(*critic_net_, states_input.data(), action_input.data(),
+                           action_params_input.data(), target_input.data(), NULL);
+  DLOG(INFO) << " [Step] Central Critic";
+  critic_solver_->Step(1);
+  float critic_loss = loss_blob->data_at(0,0,0,0);
+  CHECK(std::isfinite(critic_loss)) << "Critic loss not finite!";
+  if (iter() <= agents_.front()->critic_warmup()) {
+    if (iter() % FLAGS_soft_update_freq == 0) {
+      DQN::SoftUpdateNet(critic_net_, critic_target_net_, FLAGS_tau);
+    }
+    return std::make_pair(critic_loss, 0.0f);
+  }
+  // Every actor acts on its own slice of the joint states. Their
+  // nets must stay untouched by the acting threads until the backward.
+  ZeroGradParameters(*critic_net_);
+  std::vector<std::unique_lock<std::mutex> > actor_locks;
+  std::vector<std::vector<ActorOutput> > actor_output_batches(num_agents_);
+  // The actors' input layers point into these until their backward
+  std::vector<std::vector<float> > agent_states(num_agents_);
+  for (int i = 0; i < num_agents_; ++i) {
+    DQN& agent = *agents_[i];
+    actor_locks.emplace_back(agent.actor_mutex_);
+    agent_states[i] = AgentStates(states_input, i);
+    actor_output_batches[i] = agent.SelectActionGreedily(
+        *agent.actor_net_, agent_states[i], kMinibatchSize);
+    InputAgentActions(actor_output_batches[i], i, action_input, action_params_input);
+  }
+  std::vector<float> q_values =
+      CriticForward(*critic_net_, states_input, action_input, action_params_input);
+  float avg_q = std::accumulate(q_values.begin(), q_values.end(), 0.0) /
+      float(q_values.size());
+  float* q_values_diff = q_values_blob->mutable_cpu_diff();
+  for (int n = 0; n < kMinibatchSize; n++) {
+    q_values_diff[q_values_blob->offset(n,0,0,0)] = -1.0;
+  }
+  DLOG(INFO) << " [Backwards] " << critic_net_->name();
+  critic_net_->BackwardFrom(GetLayerIndex(*critic_net_, q_values_layer_name));
+  // One backward pass gave the action gradients of all agents
+  const float* action_diff = critic_action_blob->cpu_diff();
+  const float* param_diff = critic_action_params_blob->cpu_diff();
+  for (int i = 0; i < num_agents_; ++i) {
+    DQN& agent = *agents_[i];
+    const auto actions_blob = agent.actor_net_->blob_by_name(actions_blob_name);
+    const auto action_params_blob =
+        agent.actor_net_->blob_by_name(action_params_blob_name);
+    float* agent_action_diff = actions_blob->mutable_cpu_diff();
+    float* agent_param_diff = action_params_blob->mutable_cpu_diff();
+    for (int n = 0; n < kMinibatchSize; ++n) {
+      std::copy_n(action_diff + (n * num_agents_ + i) * kActionSize, kActionSize,
+                  agent_action_diff + actions_blob->offset(n,0,0,0));
+      std::copy_n(param_diff + (n * num_agents_ + i) * kActionParamSize,
+                  kActionParamSize,
+                  agent_param_diff + action_params_blob->offset(n,0,0,0));
+    }
+    agent.UpdateActor(actor_output_batches[i]);
+    if (iter() % FLAGS_soft_update_freq == 0) {
+      DQN::SoftUpdateNet(agent.actor_net_, agent.actor_target_net_, FLAGS_tau);
+    }
+  }
+  if (iter() % FLAGS_soft_update_freq == 0) {
+    DQN::SoftUpdateNet(critic_net_, critic_target_net_, FLAGS_tau);
+  }
+  return std::make_pair(critic_loss, avg_q);
+}
+
+} // namespace dqn
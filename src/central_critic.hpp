@@ -0,0 +1,99 @@
+#ifndef CENTRAL_CRITIC_HPP_
+#define CENTRAL_CRITIC_HPP_
+
+#include <map>
+#include <mutex>
+#include "dqn.hpp"
+
+namespace dqn {
+
+/**
+ * A joint transition of every agent at the same step of an HFO trial.
+ * States and actions are concatenated in agent order. The reward and
+ * on-policy target are the team averages.
+ */
+struct JointTransition {
+  std::vector<float> states;
+  std::vector<ActorOutput> actions;
+  float reward;
+  float on_policy_target;
+  std::vector<float> next_states; // Empty if terminal
+};
+
+/**
+ * A single critic shared by cooperating agents. It is trained on the
+ * joint observations and actions of all agents, and one forward and
+ * backward pass per minibatch yields the action gradients of every
+ * agent's actor. The agents keep (and act with) their own actors.
+ */
+class CentralCritic {
+public:
+  CentralCritic(caffe::SolverParameter& critic_solver_param,
+                const std::vector<DQN*>& agents);
+
+  // Stages the labeled episode that agent played in the given
+  // trial. Once every agent's episode of a trial has arrived they are
+  // joined and added to the joint replay memory. Leaves episode empty,
+  // keeping its capacity.
+  void AddEpisode(int agent, int trial, std::vector<Transition>&& episode);
+
+  // Update the critic and all actors
+  void Update();
+
+  // Snapshot the critic, its joint replay memory and the actors of all
+  // agents. Produces snapshot_prefix_iter_N.[caffemodel|solverstate|
+  // replaymemory] with the prefix of the critic's solver.
+  void Snapshot();
+  // Resumes the critic and joint replay memory from the latest
+  // snapshot with snapshot_prefix, if there is one
+  void Restore(const std::string& snapshot_prefix);
+
+  // Save/load the joint replay memory as a gzipped file
+  void SnapshotReplayMemory(const std::string& filename);
+  void LoadReplayMemory(const std::string& filename);
+
+  int iter() const { return critic_solver_->iter(); }
+  int memory_size();
+
+  // Bytes held per joint transition of num_agents agents
+  static size_t JointTransitionBytes(int state_size, int num_agents);
+
+protected:
+  std::pair<float, float> UpdateActorsCritic();
+
+  // Slice the states of agent out of a batch of joint states, packed
+  // as input for the agent's actor
+  std::vector<float> AgentStates(const std::vector<float>& joint_states,
+                                 int agent);
+
+  // Packs a batch of actions of agent into the joint action inputs
+  void InputAgentActions(const std::vector<ActorOutput>& actions, int agent,
+                         std::vector<float>& action_input,
+                         std::vector<float>& action_params_input);
+
+  // Runs forward on critic to produce q-values for joint inputs
+  std::vector<float> CriticForward(caffe::Net<float>& critic,
+                                   std::vector<float>& states_input,
+                                   std::vector<float>& action_input,
+                                   std::vector<float>& action_params_input);
+
+protected:
+  std::vector<DQN*> agents_;
+  const int num_agents_;
+  const int state_size_; // Per agent
+  const int joint_state_size_;
+  const int memory_capacity_;
+  SolverSp critic_solver_;
+  NetSp critic_net_;
+  NetSp critic_target_net_;
+  std::deque<JointTransition> replay_memory_;
+  std::map<int, std::vector<std::vector<Transition> > > staged_episodes_;
+  std::mutex memory_mutex_; // Guards replay_memory_ and staged_episodes_
+  Rng random_engine;
+  float smoothed_critic_loss_, smoothed_actor_loss_;
+  int last_snapshot_iter_;
+};
+
+} // namespace dqn
+
+#endif /* CENTRAL_CRITIC_HPP_ */
@@ -0,0 +1,45 @@
+#include "compute_backend.hpp"
+#include "caffe_backend.hpp"
+#include "native_backend.hpp"
+#include <algorithm>
+#include <glog/logging.h>
+
+namespace dqn {
+
+void ComputeBackend::CriticForwardActions(BackendNet net, const float* states,
+                                          const float* actions,
+                                          const float* action_params, int batch,
+                                          int candidates, int heads,
+                                          float* q_values) {
+  for (int c = 0; c < candidates; ++c) {
+    const float* q = CriticForward(net, states, actions + c * batch * kActionSize,
+                                   action_params + c * batch * kActionParamSize,
+                                   batch);
+    std::copy(q, q + batch * heads, q_values + c * batch * heads);
+  }
+}
+
+std::vector<std::string> ComputeBackendNames() {
+  return {"caffe", "native", "native_bf16"};
+}
+
+ComputeBackend* CreateComputeBackend(const std::string& name,
+                                     const BackendNets& nets,
+                                     int minibatch_size,
+                                     std::string* unsupported) {
+  if (name == "caffe") {
+    return new CaffeBackend(nets, minibatch_size);
+  } else if (name == "native" || name == "native_bf16") {
+    const std::string why = NativeBackend::Unsupported(nets);
+    if (!why.empty()) {
+      CHECK(unsupported) << "Unable to use the " << name << " backend. " << why;
+      *unsupported = why;
+      return NULL;
+    }
+    return new NativeBackend(nets, minibatch_size, name == "native_bf16");
+  }
+  LOG(FATAL) << "Unknown backend " << name;
+  return NULL;
+}
+
+} // namespace dqn
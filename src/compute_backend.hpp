@@ -0,0 +1,101 @@
+#ifndef COMPUTE_BACKEND_HPP_
+#define COMPUTE_BACKEND_HPP_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "dqn.hpp"
+
+namespace dqn {
+
+// The nets a backend trains
+enum BackendNet { ACTOR, CRITIC, ACTOR_TARGET, CRITIC_TARGET };
+
+// A buffer of parameters in the backend's own layout, with the
+// gradients of the last backward
+struct ParamView {
+  std::string name;
+  float* data;
+  float* diff;
+  int count;
+};
+
+/**
+ * What DQN::UpdateActorCritic needs to train the actor and critic:
+ * forward and backward passes, optimizer steps and soft updates of the
+ * target nets. States are batches of rows of frames * state_size
+ * features, actions and action params batches of rows of kActionSize
+ * and kActionParamSize. Inputs must stay valid until the backward of
+ * the forward they were given to.
+ *
+ * The Caffe nets and solvers of the DQN remain the state that is acted
+ * with, snapshotted and restored. Backends keeping their own copy
+ * serialize it through them with Export and Import.
+ */
+class ComputeBackend {
+public:
+  virtual ~ComputeBackend() {}
+  virtual const char* name() const = 0;
+  // The relative difference of its updates from Caffe's to expect
+  virtual float tolerance() const { return 1e-3; }
+
+  // Writes the actions and action params the actor chooses for batch
+  // states
+  virtual void ActorForward(BackendNet net, const float* states, int batch,
+                            float* actions, float* action_params) = 0;
+  // Returns the q-values the critic gives to the state-actions, a row
+  // of one per head for each of batch
+  virtual const float* CriticForward(BackendNet net, const float* states,
+                                     const float* actions,
+                                     const float* action_params, int batch) = 0;
+  // Writes to q_values the q-values, rows of heads, of each of the
+  // candidates batches of actions and params for the batch states.
+  // Backends may run the critic's layers seeing only the states once.
+  virtual void CriticForwardActions(BackendNet net, const float* states,
+                                    const float* actions,
+                                    const float* action_params, int batch,
+                                    int candidates, int heads, float* q_values);
+  // Backpropagates the gradients of the q-values (rows of heads) of the
+  // last forward of CRITIC. Writes the gradients w.r.t. its actions and params unless
+  // null and keeps its parameter gradients for CriticStep if asked.
+  virtual void CriticBackward(const float* q_values_diff, float* action_diff,
+                              float* action_params_diff, bool param_grads) = 0;
+  // Backpropagates gradients of the outputs of the last forward of ACTOR
+  virtual void ActorBackward(const float* action_diff,
+                             const float* action_params_diff) = 0;
+  // Steps the optimizer of CRITIC/ACTOR, at solver iteration iter, with
+  // the parameter gradients of its last backward. CriticStep returns
+  // false if it skipped the step, which then does not count.
+  virtual bool CriticStep(int iter) = 0;
+  virtual void ActorStep(int iter) = 0;
+  // target = tau * net + (1 - tau) * target for both target nets
+  virtual void SoftUpdateTargets(float tau) = 0;
+
+  virtual std::vector<ParamView> Params(BackendNet net) = 0;
+
+  // Copies the parameters and optimizer state from the Caffe nets and
+  // solvers, and back
+  virtual void Import() = 0;
+  virtual void Export() = 0;
+};
+
+// The nets and solvers of a DQN a backend mirrors or runs
+struct BackendNets {
+  SolverSp actor_solver;
+  SolverSp critic_solver;
+  NetSp actor_target;
+  NetSp critic_target;
+};
+
+// Names of the backends CreateComputeBackend makes
+std::vector<std::string> ComputeBackendNames();
+// Makes the backend called name. If it cannot train nets, dies saying
+// why or, given unsupported, returns NULL with the reason there.
+ComputeBackend* CreateComputeBackend(const std::string& name,
+                                     const BackendNets& nets,
+                                     int minibatch_size,
+                                     std::string* unsupported=NULL);
+
+} // namespace dqn
+
+#endif /* COMPUTE_BACKEND_HPP_ */
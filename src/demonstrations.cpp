@@ -0,0 +1,101 @@
+#include "demonstrations.hpp"
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <glog/logging.h>
+
+namespace dqn {
+
+bool ParseAction(const std::string& name, hfo::action_t& action) {
+  for (hfo::action_t a : {hfo::DASH, hfo::TURN, hfo::TACKLE, hfo::KICK}) {
+    if (boost::algorithm::iequals(name, hfo::ActionToString(a))) {
+      action = a;
+      return true;
+    }
+  }
+  return false;
+}
+
+TraceWriter::TraceWriter(const std::string& filename) :
+    file_(filename.c_str(), std::ios_base::out | std::ios_base::binary),
+    episodes_(0) {
+  CHECK(file_) << "Unable to write " << filename;
+  if (boost::algorithm::ends_with(filename, ".gz")) {
+    out_.push(boost::iostreams::gzip_compressor());
+  }
+  out_.push(file_);
+  // Features are read back exactly
+  out_.precision(std::numeric_limits<float>::max_digits10);
+  out_ << "# " << filename << ": state features, action, arguments\n";
+  LOG(INFO) << "Recording traces to " << filename;
+}
+
+void TraceWriter::Step(const float* state, int state_size, const Action& action) {
+  for (int i = 0; i < state_size; ++i) {
+    out_ << state[i] << ' ';
+  }
+  out_ << hfo::ActionToString(action.action) << ' ' << action.arg1 << ' '
+       << action.arg2 << '\n';
+}
+
+void TraceWriter::EndEpisode() {
+  out_ << '\n';
+  out_.flush();
+  if (++episodes_ % 100 == 0) {
+    LOG(INFO) << "Recorded " << episodes_ << " episodes";
+  }
+}
+
+std::vector<Demonstration> LoadTrace(const std::string& filename,
+                                     int state_size, int frames) {
+  CHECK(boost::filesystem::is_regular_file(filename))
+      << "Invalid file: " << filename;
+  std::ifstream ifile(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+  boost::iostreams::filtering_istream in;
+  if (boost::algorithm::ends_with(filename, ".gz")) {
+    in.push(boost::iostreams::gzip_decompressor());
+  }
+  in.push(ifile);
+  std::vector<Demonstration> demonstrations;
+  InputStates episode_states; // The last frames states of the episode
+  int episodes = 0;
+  std::string line;
+  for (int line_num = 1; std::getline(in, line); ++line_num) {
+    if (!line.empty() && line[0] == '#') {
+      continue;
+    }
+    if (line.find_first_not_of(" \t\r") == std::string::npos) {
+      episodes += !episode_states.empty();
+      episode_states.clear();
+      continue;
+    }
+    std::istringstream ss(line);
+    StateDataSp state = AllocateState(state_size);
+    for (int i = 0; i < state_size; ++i) {
+      CHECK(ss >> (*state)[i]) << filename << ":" << line_num << ": expected "
+                               << state_size << " state features";
+    }
+    std::string name;
+    Action action = {hfo::NOOP, 0, 0};
+    CHECK(ss >> name && ParseAction(name, action.action))
+        << filename << ":" << line_num << ": expected an action after the state";
+    ss >> action.arg1 >> action.arg2;
+    if (episode_states.empty()) {
+      episode_states.assign(frames, state);
+    } else {
+      episode_states.erase(episode_states.begin());
+      episode_states.push_back(state);
+    }
+    demonstrations.push_back({episode_states, action.action, GetActorOutput(action)});
+  }
+  episodes += !episode_states.empty();
+  LOG(INFO) << "Loaded " << demonstrations.size() << " demonstrations in "
+            << episodes << " episodes from " << filename;
+  return demonstrations;
+}
+
+} // namespace dqn
@@ -0,0 +1,55 @@
+#ifndef DEMONSTRATIONS_HPP_
+#define DEMONSTRATIONS_HPP_
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <boost/iostreams/filtering_stream.hpp>
+#include "dqn.hpp"
+
+namespace dqn {
+
+/**
+ * Loads the demonstrations of a trace of an agent, e.g. one that
+ * chases the ball or shoots on goal, as recorded by TraceWriter
+ * (-record_traces). A trace is a text file,
+ * optionally gzipped (.gz), with one step per line: the state_size
+ * low-level state features the agent saw, then the HFO name of the
+ * action it took and its arguments, e.g.
+ *
+ *   0.12 -0.5 ... 1 DASH 100 0
+ *
+ * Empty lines end episodes and lines starting with # are
+ * ignored. Each demonstration stacks the last frames states of its
+ * episode, repeating the first state like replay memory does.
+ */
+std::vector<Demonstration> LoadTrace(const std::string& filename,
+                                     int state_size, int frames);
+
+/**
+ * Writes a trace that LoadTrace reads, gzipped if filename ends in
+ * .gz. Steps are written as played and episodes are closed by an
+ * empty line.
+ */
+class TraceWriter {
+public:
+  explicit TraceWriter(const std::string& filename);
+
+  // Appends the state_size features of the state an agent saw and the
+  // action it took in it
+  void Step(const float* state, int state_size, const Action& action);
+  void EndEpisode();
+
+protected:
+  std::ofstream file_;
+  boost::iostreams::filtering_ostream out_;
+  int episodes_;
+};
+
+// Parses an HFO action name (DASH, TURN, TACKLE or KICK, in any
+// case). Returns false for anything else.
+bool ParseAction(const std::string& name, hfo::action_t& action);
+
+} // namespace dqn
+
+#endif /* DEMONSTRATIONS_HPP_ */
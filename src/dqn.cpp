@@ -1,6 +1,15 @@
 #include "dqn.hpp"
+#include "shared_replay_memory.hpp"
+#include "numa_placement.hpp"
+#include "memory_budget.hpp"
+#include "compute_backend.hpp"
+#include "fused_mlp.hpp"
 #include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <numeric>
 #include <cassert>
 #include <sstream>
 #include <boost/regex.hpp>
@@ -29,6 +38,64 @@ DEFINE_int32(snapshot_freq, 10000, "Frequency (steps) snapshots");
 DEFINE_bool(remove_old_snapshots, true, "Remove old snapshots when writing more recent ones.");
 DEFINE_bool(snapshot_memory, true, "Snapshot the replay memory along with the network.");
 DEFINE_double(beta, .5, "Mix between off-policy and on-policy updates.");
+DEFINE_int32(frames, 1, "Number of consecutive states stacked as network input.");
+DEFINE_int32(minibatch_size, kMinibatchSize, "Transitions per update. Also sizes "
+             "the nets' batch dimension, so acting pads single states to it.");
+DEFINE_string(backend, "caffe", "Computes the actor and critic updates: caffe, "
+              "native for the fused CPU kernels, or native_bf16 for the same "
+              "with bf16 GEMMs and fp32 master weights. The native backends "
+              "need the CPU, Adam with a fixed lr and no weight decay, and a "
+              "single agent's critic: no -critic_encoder_layers or "
+              "-central_critic.");
+DEFINE_int32(critic_heads, 1, "Heads of the critic ensemble. Targets are the "
+             "minimum over the target critic's heads.");
+DEFINE_double(head_bootstrap, 0.5, "Probability that each head of a critic ensemble "
+              "trains on each transition of a minibatch. The heads fit different "
+              "subsamples, so they disagree where the data is sparse.");
+DEFINE_double(explore_uncertainty, 0, "When playing to train, greedy actions "
+              "are replaced by the candidate of highest mean + this * std over "
+              "the critic heads among them and random actions. 0 disables.");
+DEFINE_int32(critic_encoder_layers, 0, "Critic layers seeing only the states. "
+             "The actions join after them, so target actions beyond the first "
+             "only run the later layers.");
+DEFINE_int32(target_smoothing, 0, "Noisy copies of the target action whose "
+             "q-values are averaged into the off-policy targets.");
+DEFINE_double(target_noise, 0.1, "Std of the target smoothing noise, as a "
+              "fraction of each output's range. Clipped to twice that.");
+DEFINE_int32(n_step, 1, "Rewards summed before bootstrapping the off-policy target.");
+DEFINE_string(sampling, "uniform", "Minibatch sampling: uniform, sorted (uniform, "
+              "gathered in memory order) or blocks (-sample_blocks contiguous "
+              "runs of transitions). Check learning curves when using blocks.");
+DEFINE_int32(sample_blocks, 4, "Contiguous runs per minibatch with -sampling blocks.");
+DEFINE_bool(normalize_states, false, "Normalize the net inputs by running per-feature "
+            "mean and std of the states entering replay memory. The statistics "
+            "are saved with the actor snapshots and frozen during evaluation.");
+
+// Transitions ahead of the gather whose state objects are prefetched.
+// The deque entries pointing to them are prefetched twice as early, so
+// each hop of the pointer chase is in cache when it is taken.
+constexpr int kPrefetchDistance = 2;
+
+SamplingMode ParseSamplingMode(const std::string& mode) {
+  if (mode == "uniform") {
+    return UNIFORM_SAMPLING;
+  } else if (mode == "sorted") {
+    return SORTED_SAMPLING;
+  } else if (mode == "blocks") {
+    return BLOCK_SAMPLING;
+  }
+  LOG(FATAL) << "Unknown sampling mode: " << mode;
+  return UNIFORM_SAMPLING;
+}
+
+std::string SamplingModeName(SamplingMode mode) {
+  switch (mode) {
+    case UNIFORM_SAMPLING: return "uniform";
+    case SORTED_SAMPLING: return "sorted";
+    case BLOCK_SAMPLING: return "blocks";
+  }
+  return "unknown";
+}
 
 template <typename Dtype>
 void HasBlobSize(caffe::Net<Dtype>& net,
@@ -45,38 +112,6 @@ void HasBlobSize(caffe::Net<Dtype>& net,
       << "Blob \"" << blob_name << "\" failed dimension check.";
 }
 
-// Returns the index of the layer matching the given layer_name or -1
-// if no such layer exists.
-template <typename Dtype>
-int GetLayerIndex(caffe::Net<Dtype>& net, const std::string& layer_name) {
-  if (!net.has_layer(layer_name)) {
-    return -1;
-  }
-  const std::vector<std::string>& layer_names = net.layer_names();
-  int indx = std::distance(
-      layer_names.begin(),
-      std::find(layer_names.begin(), layer_names.end(), layer_name));
-  return indx;
-}
-
-// Zeros the gradients accumulated by each forward/backward pass.
-template <typename Dtype>
-void ZeroGradParameters(caffe::Net<Dtype>& net) {
-  for (int i = 0; i < net.params().size(); ++i) {
-    caffe::shared_ptr<caffe::Blob<Dtype> > blob = net.params()[i];
-    switch (caffe::Caffe::mode()) {
-      case caffe::Caffe::CPU:
-        caffe::caffe_set(blob->count(), static_cast<Dtype>(0),
-                         blob->mutable_cpu_diff());
-        break;
-      case caffe::Caffe::GPU:
-        caffe::caffe_gpu_set(blob->count(), static_cast<Dtype>(0),
-                             blob->mutable_gpu_diff());
-        break;
-    }
-  }
-}
-
 int ParseIterFromSnapshot(const std::string& snapshot) {
   unsigned start = snapshot.find_last_of("_");
   unsigned end = snapshot.find_last_of(".");
@@ -207,6 +242,20 @@ Action GetAction(const ActorOutput& actor_output) {
   return action;
 }
 
+ActorOutput GetActorOutput(const Action& action) {
+  ActorOutput actor_output;
+  actor_output.fill(0);
+  std::fill(actor_output.begin(), actor_output.begin() + kActionSize, -1);
+  actor_output[action.action] = 1;
+  int arg1_offset = GetParamOffset(action.action, 0); CHECK_GE(arg1_offset, 0);
+  actor_output[kActionSize + arg1_offset] = action.arg1;
+  int arg2_offset = GetParamOffset(action.action, 1);
+  if (arg2_offset >= 0) {
+    actor_output[kActionSize + arg2_offset] = action.arg2;
+  }
+  return actor_output;
+}
+
 std::string PrintActorOutput(const ActorOutput& actor_output) {
   return "Dash(" + std::to_string(actor_output[4]) + ", " + std::to_string(actor_output[5]) + ")="
       + std::to_string(actor_output[0]) + ", Turn(" + std::to_string(actor_output[6]) + ")="
@@ -397,15 +446,28 @@ void TileLayer(caffe::NetParameter& net_param,
 }
 
 
+void FlattenLayer(caffe::NetParameter& net_param,
+                  const std::string& name,
+                  const std::vector<std::string>& bottoms,
+                  const std::vector<std::string>& tops,
+                  const boost::optional<caffe::Phase>& include_phase) {
+  caffe::LayerParameter& layer = *net_param.add_layer();
+  PopulateLayer(layer, name, "Flatten", bottoms, tops, include_phase);
+}
+
+
+// Layers are numbered from first_layer
 std::string Tower(caffe::NetParameter& np,
                   const std::string& layer_prefix,
                   const std::string& input_blob_name,
-                  const std::vector<int>& layer_sizes) {
+                  const std::vector<int>& layer_sizes,
+                  int first_layer = 1) {
   std::string input_name = input_blob_name;
-  for (int i=1; i<layer_sizes.size()+1; ++i) {
+  for (int i=first_layer; i<first_layer+layer_sizes.size(); ++i) {
     std::string layer_name = layer_prefix + "ip" + std::to_string(i) + "_layer";
     std::string top_name = layer_prefix + "ip" + std::to_string(i);
-    IPLayer(np, layer_name, {input_name}, {top_name}, boost::none, layer_sizes[i-1]);
+    IPLayer(np, layer_name, {input_name}, {top_name}, boost::none,
+            layer_sizes[i-first_layer]);
     layer_name = layer_prefix + "ip" + std::to_string(i) + "_relu_layer";
     ReluLayer(np, layer_name, {top_name}, {top_name}, boost::none);
     // layer_name = layer_prefix + "bn" + std::to_string(i) + "_layer";
@@ -415,12 +477,12 @@ std::string Tower(caffe::NetParameter& np,
   return input_name;
 }
 
-caffe::NetParameter CreateActorNet(int state_size) {
+caffe::NetParameter CreateActorNet(int state_size, int frames, int batch_size) {
   caffe::NetParameter np;
   np.set_name("Actor");
   np.set_force_backward(true);
   MemoryDataLayer(np, state_input_layer_name, {states_blob_name,"dummy1"},
-                  boost::none, {kMinibatchSize, kStateInputCount, state_size, 1});
+                  boost::none, {batch_size, 1, frames * state_size, 1});
   SilenceLayer(np, "silence", {"dummy1"}, {}, boost::none);
   std::string tower_top = Tower(np, "", states_blob_name, {1024, 512, 256, 128});
   IPLayer(np, "action_layer", {tower_top}, {"actions"}, boost::none, 4);
@@ -428,27 +490,57 @@ caffe::NetParameter CreateActorNet(int state_size) {
   return np;
 }
 
-caffe::NetParameter CreateCriticNet(int state_size) {
+caffe::NetParameter CreateCriticNet(int state_size, int num_agents, int frames,
+                                    int batch_size, int heads, int encoder_layers) {
+  const std::vector<int> layer_sizes = {1024, 512, 256, 128};
+  CHECK_GE(heads, 1);
+  CHECK(encoder_layers >= 0 && encoder_layers < layer_sizes.size())
+      << "The critic needs layers after its state encoder";
   caffe::NetParameter np;
   np.set_name("Critic");
   np.set_force_backward(true);
   MemoryDataLayer(np, state_input_layer_name, {states_blob_name,"dummy1"},
-                  boost::none, {kMinibatchSize, kStateInputCount, state_size, 1});
+                  boost::none, {batch_size, 1, frames * state_size, 1});
   MemoryDataLayer(np, action_input_layer_name,
-                  {actions_blob_name,"dummy2"},
-                  boost::none, {kMinibatchSize, kStateInputCount, kActionSize, 1});
+                  {actions_blob_name,"dummy2"}, boost::none,
+                  {batch_size, 1, num_agents * kActionSize, 1});
   MemoryDataLayer(np, action_params_input_layer_name,
-                  {action_params_blob_name,"dummy3"},
-                  boost::none, {kMinibatchSize, kStateInputCount, kActionParamSize, 1});
+                  {action_params_blob_name,"dummy3"}, boost::none,
+                  {batch_size, 1, num_agents * kActionParamSize, 1});
   MemoryDataLayer(np, target_input_layer_name, {targets_blob_name,"dummy4"},
-                  boost::none, {kMinibatchSize, 1, 1, 1});
+                  boost::none, {batch_size, 1, 1, 1});
   SilenceLayer(np, "silence", {"dummy1","dummy2","dummy3","dummy4"}, {}, boost::none);
-  ConcatLayer(np, "concat",
-              {states_blob_name,actions_blob_name,action_params_blob_name},
-              {"state_actions"}, boost::none, 2);
-  std::string tower_top = Tower(np, "", "state_actions", {1024, 512, 256, 128});
-  IPLayer(np, q_values_layer_name, {tower_top}, {q_values_blob_name}, boost::none, 1);
-  EuclideanLossLayer(np, "loss", {q_values_blob_name, targets_blob_name},
+  std::string tower_top;
+  if (encoder_layers == 0) {
+    ConcatLayer(np, "concat",
+                {states_blob_name,actions_blob_name,action_params_blob_name},
+                {"state_actions"}, boost::none, 2);
+    tower_top = Tower(np, "", "state_actions", layer_sizes);
+  } else {
+    // The actions join the encoded states, after the layers seeing the
+    // states alone
+    const std::string encoded_states = Tower(
+        np, "", states_blob_name, std::vector<int>(
+            layer_sizes.begin(), layer_sizes.begin() + encoder_layers));
+    FlattenLayer(np, "actions_flatten", {actions_blob_name}, {"flat_actions"},
+                 boost::none);
+    FlattenLayer(np, "action_params_flatten", {action_params_blob_name},
+                 {"flat_action_params"}, boost::none);
+    ConcatLayer(np, "concat", {encoded_states,"flat_actions","flat_action_params"},
+                {"state_actions"}, boost::none, 1);
+    tower_top = Tower(np, "", "state_actions", std::vector<int>(
+        layer_sizes.begin() + encoder_layers, layer_sizes.end()),
+                      encoder_layers + 1);
+  }
+  IPLayer(np, q_values_layer_name, {tower_top}, {q_values_blob_name}, boost::none,
+          heads);
+  std::string targets = targets_blob_name;
+  if (heads > 1) {
+    targets = "head_targets";
+    TileLayer(np, "targets_tile", {targets_blob_name}, {targets}, boost::none, 1,
+              heads);
+  }
+  EuclideanLossLayer(np, "loss", {q_values_blob_name, targets},
                      {loss_blob_name}, boost::none);
   return np;
 }
@@ -459,25 +551,56 @@ DQN::DQN(caffe::SolverParameter& actor_solver_param,
          std::string save_path, int state_size, int tid) :
         actor_solver_param_(actor_solver_param),
         critic_solver_param_(critic_solver_param),
-        replay_memory_capacity_(FLAGS_memory),
+        replay_memory_capacity_(ReplayCapacity(TransitionBytes(state_size))),
         replay_memory_(new std::deque<Transition>),
         gamma_(FLAGS_gamma),
+        n_step_(FLAGS_n_step),
+        unlabeled_(0),
+        backend_stale_(false),
+        caffe_stale_(false),
         random_engine(),
         smoothed_critic_loss_(0),
         smoothed_actor_loss_(0),
         last_snapshot_iter_(0),
         save_path_(save_path),
         state_size_(state_size),
-        state_input_data_size_(kMinibatchSize * state_size * kStateInputCount),
+        frames_(FLAGS_frames),
+        minibatch_size_(FLAGS_minibatch_size),
+        state_input_data_size_(FLAGS_minibatch_size * state_size * FLAGS_frames),
+        critic_heads_(1),
+        critic_warmup_(0),
+        state_ops_(GetStateOps(state_size)),
         tid_(tid),
         unum_(0) {
+  CHECK_GE(n_step_, 1) << "-n_step must be positive";
+  CHECK_GE(FLAGS_target_smoothing, 0);
+  if (FLAGS_target_smoothing > 0) {
+    CHECK_GT(FLAGS_target_noise, 0) << "-target_smoothing needs a positive -target_noise";
+  }
+  for (int k = 0; k <= n_step_; ++k) {
+    discounts_.push_back(std::pow(gamma_, k));
+  }
+  sampling_mode_ = ParseSamplingMode(FLAGS_sampling);
+  if (sampling_mode_ != UNIFORM_SAMPLING) {
+    LOG(INFO) << "[Agent" << tid_ << "] Minibatch sampling: "
+              << SamplingModeName(sampling_mode_);
+  }
+  LOG(INFO) << "State layout: " << state_size_ << " features, "
+            << (state_ops_.specialized ? "specialized" : "generic") << " copies";
+  if (FLAGS_normalize_states) {
+    state_normalizer_.reset(new StateNormalizer(state_size_));
+  }
+  LOG(INFO) << "[Agent" << tid_ << "] Replay capacity: " << replay_memory_capacity_
+            << " transitions of " << TransitionBytes(state_size_) << " bytes ("
+            << FormatBytes(size_t(replay_memory_capacity_) * TransitionBytes(state_size_))
+            << ")";
   if (FLAGS_seed <= 0) {
     unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
     LOG(INFO) << "Seeding RNG to time (seed = " << seed << ")";
-    random_engine.seed(seed);
+    random_engine = Rng::Stream(seed, tid_);
   } else {
-    LOG(INFO) << "Seeding RNG with seed = " << FLAGS_seed;
-    random_engine.seed(FLAGS_seed);
+    LOG(INFO) << "Seeding RNG with seed = " << FLAGS_seed << ", stream " << tid_;
+    random_engine = Rng::Stream(FLAGS_seed, tid_);
   }
   Initialize();
 }
@@ -486,24 +609,313 @@ DQN::~DQN() {}
 
 void DQN::Benchmark(int iterations) {
   LOG(INFO) << "*** Benchmark begins ***";
-  caffe::Timer dual_timer;
-  dual_timer.Start();
-  for (int i=0; i< iterations; ++i) {
-    UpdateActorCritic();
-  }
-  dual_timer.Stop();
-  LOG(INFO) << "Average Update: "
-            << dual_timer.MilliSeconds()/iterations << " ms.";
+  SyncCaffe();
+  // Every backend starts from the same nets and solver state and
+  // updates on the same minibatches
+  std::vector<caffe::Blob<float>*> state_blobs = StateBlobs();
+  std::vector<std::vector<float> > start_state;
+  for (caffe::Blob<float>* blob : state_blobs) {
+    start_state.emplace_back(blob->cpu_data(), blob->cpu_data() + blob->count());
+  }
+  const int start_actor_iter = actor_iter();
+  const int start_critic_iter = critic_iter();
+  // Head masks and target noise are drawn again by each backend
+  const Rng start_rng = random_engine;
+  auto restore_state = [&]() {
+    random_engine = start_rng;
+    for (int i = 0; i < state_blobs.size(); ++i) {
+      std::copy(start_state[i].begin(), start_state[i].end(),
+                state_blobs[i]->mutable_cpu_data());
+    }
+    actor_solver_->set_iter(start_actor_iter);
+    critic_solver_->set_iter(start_critic_iter);
+  };
+  std::vector<Minibatch> workload(iterations);
+  for (Minibatch& batch : workload) {
+    PrepareMinibatch(SampleTransitionsFromMemory(minibatch_size_), batch);
+  }
+  // The first updates of each backend are checked against Caffe's
+  constexpr int kCheckUpdates = 10;
+  std::vector<std::pair<float,float> > caffe_results;
+  std::vector<std::vector<float> > caffe_state;
+  float caffe_ms = 0;
+  for (const std::string& name : ComputeBackendNames()) {
+    restore_state();
+    std::string unsupported;
+    std::unique_ptr<ComputeBackend> backend(CreateComputeBackend(
+        name, {actor_solver_, critic_solver_, actor_target_net_,
+               critic_target_net_}, minibatch_size_, &unsupported));
+    if (!backend) {
+      LOG(INFO) << unsupported << ", " << name << " skipped";
+      continue;
+    }
+    CheckCriticForwardActions(*backend, name, workload.front());
+    std::vector<std::pair<float,float> > results;
+    for (int i = 0; i < std::min(kCheckUpdates, iterations); ++i) {
+      results.push_back(UpdateActorCritic(*backend, workload[i]));
+    }
+    backend->Export();
+    if (name == "caffe") {
+      caffe_results = results;
+      for (caffe::Blob<float>* blob : state_blobs) {
+        caffe_state.emplace_back(blob->cpu_data(), blob->cpu_data() + blob->count());
+      }
+    } else {
+      auto relative_error = [](float x, float expected) {
+        return std::abs(x - expected) / std::max(std::abs(expected), 1e-6f);
+      };
+      float loss_error = 0, q_error = 0, state_error = 0;
+      for (int i = 0; i < results.size(); ++i) {
+        loss_error = std::max(loss_error,
+                              relative_error(results[i].first, caffe_results[i].first));
+        q_error = std::max(q_error,
+                           relative_error(results[i].second, caffe_results[i].second));
+      }
+      for (int i = 0; i < state_blobs.size(); ++i) {
+        const float* data = state_blobs[i]->cpu_data();
+        for (int j = 0; j < caffe_state[i].size(); ++j) {
+          state_error = std::max(state_error, std::abs(data[j] - caffe_state[i][j]));
+        }
+      }
+      LOG(INFO) << name << " vs caffe over " << results.size() << " updates: "
+                << "critic loss relative error " << loss_error
+                << ", avg_q relative error " << q_error
+                << ", max parameter/moment difference " << state_error;
+      if (std::max({loss_error, q_error, state_error}) > backend->tolerance()) {
+        LOG(ERROR) << "The " << name << " backend diverges from caffe by more than "
+                   << backend->tolerance();
+      }
+    }
+    restore_state();
+    backend->Import();
+    caffe::Timer timer;
+    timer.Start();
+    for (Minibatch& batch : workload) {
+      UpdateActorCritic(*backend, batch);
+    }
+    timer.Stop();
+    const float ms = timer.MilliSeconds() / iterations;
+    int params = 0;
+    for (const ParamView& view : backend->Params(ACTOR)) {
+      params += view.count;
+    }
+    for (const ParamView& view : backend->Params(CRITIC)) {
+      params += view.count;
+    }
+    LOG(INFO) << "Average " << name << " Update: " << ms << " ms ("
+              << params << " parameters)"
+              << (caffe_ms > 0 ? ", " + std::to_string(caffe_ms / ms) + "x caffe" : "");
+    if (name == "caffe") {
+      caffe_ms = ms;
+    }
+  }
+  restore_state();
+  BenchmarkAdamStep(*actor_solver_, iterations);
+  BenchmarkAdamStep(*critic_solver_, iterations);
+  backend_stale_ = true;
   LOG(INFO) << "*** Benchmark ends ***";
 }
 
+void DQN::CheckCriticForwardActions(ComputeBackend& backend,
+                                    const std::string& name, Minibatch& batch) {
+  constexpr int kCandidates = 4;
+  const int next = batch.num_next_states;
+  if (next == 0) {
+    return;
+  }
+  const int heads = critic_heads_;
+  std::vector<float> actions(kCandidates * next * kActionSize);
+  std::vector<float> action_params(kCandidates * next * kActionParamSize);
+  backend.ActorForward(ACTOR_TARGET, batch.next_states_input.data(), next,
+                       actions.data(), action_params.data());
+  // The updates that follow draw the same noise as on the other backends
+  const Rng rng = random_engine;
+  SmoothTargetActions(next, kCandidates, actions.data(), action_params.data());
+  random_engine = rng;
+  std::vector<float> q_values(kCandidates * next * heads);
+  std::vector<float> expected(kCandidates * next * heads);
+  backend.CriticForwardActions(CRITIC_TARGET, batch.next_states_input.data(),
+                               actions.data(), action_params.data(), next,
+                               kCandidates, heads, q_values.data());
+  backend.ComputeBackend::CriticForwardActions(
+      CRITIC_TARGET, batch.next_states_input.data(), actions.data(),
+      action_params.data(), next, kCandidates, heads, expected.data());
+  float error = 0;
+  for (int i = 0; i < q_values.size(); ++i) {
+    error = std::max(error, std::abs(q_values[i] - expected[i]) /
+                     std::max(std::abs(expected[i]), 1.0f));
+  }
+  LOG(INFO) << name << " target q-values of " << kCandidates << " candidates vs "
+            << "separate forwards: max relative error " << error;
+  if (error > backend.tolerance()) {
+    LOG(ERROR) << "The " << name << " backend's CriticForwardActions differs "
+               << "from separate critic forwards by more than " << backend.tolerance();
+  }
+}
+
+void DQN::BenchmarkAdamStep(caffe::Solver<float>& solver, int iterations) {
+  const std::string name = solver.net()->name();
+  if (!CanFuseAdamStep(solver)) {
+    LOG(INFO) << "The Adam step of " << name << " cannot be fused, skipped";
+    return;
+  }
+  const std::vector<caffe::Blob<float>*>& params = solver.net()->learnable_params();
+  std::vector<caffe::Blob<float>*> state_blobs(params);
+  for (const auto& blob : static_cast<caffe::SGDSolver<float>&>(solver).history()) {
+    state_blobs.push_back(blob.get());
+  }
+  std::vector<std::vector<float> > start_state;
+  for (caffe::Blob<float>* blob : state_blobs) {
+    start_state.emplace_back(blob->cpu_data(), blob->cpu_data() + blob->count());
+  }
+  // Gradients of the size of those of an update, large enough to clip
+  std::normal_distribution<float> gaussian(0, 1e-2);
+  std::vector<std::vector<float> > grads;
+  int num_params = 0;
+  for (caffe::Blob<float>* param : params) {
+    grads.emplace_back(param->count());
+    std::generate(grads.back().begin(), grads.back().end(),
+                  [&]() { return gaussian(random_engine); });
+    num_params += param->count();
+  }
+  std::vector<std::vector<float> > caffe_state;
+  float caffe_ms = 0;
+  for (bool fused : {false, true}) {
+    for (int i = 0; i < state_blobs.size(); ++i) {
+      std::copy(start_state[i].begin(), start_state[i].end(),
+                state_blobs[i]->mutable_cpu_data());
+    }
+    // Caffe's step overwrites the gradients with the updates
+    double us = 0;
+    for (int iter = 0; iter < iterations; ++iter) {
+      for (int i = 0; i < params.size(); ++i) {
+        std::copy(grads[i].begin(), grads[i].end(), params[i]->mutable_cpu_diff());
+      }
+      caffe::Timer timer;
+      timer.Start();
+      if (fused) {
+        FusedAdamStep(solver);
+      } else {
+        solver.ApplyUpdate();
+      }
+      timer.Stop();
+      us += timer.MicroSeconds();
+    }
+    const float ms = us / 1000 / iterations;
+    if (!fused) {
+      caffe_ms = ms;
+      for (caffe::Blob<float>* blob : state_blobs) {
+        caffe_state.emplace_back(blob->cpu_data(), blob->cpu_data() + blob->count());
+      }
+      LOG(INFO) << "Average caffe Adam step of " << name << ": " << ms << " ms ("
+                << num_params << " parameters)";
+      continue;
+    }
+    float max_difference = 0;
+    for (int i = 0; i < state_blobs.size(); ++i) {
+      const float* data = state_blobs[i]->cpu_data();
+      for (int j = 0; j < caffe_state[i].size(); ++j) {
+        max_difference = std::max(max_difference, std::abs(data[j] - caffe_state[i][j]));
+      }
+    }
+    LOG(INFO) << "Average fused Adam step of " << name << ": " << ms << " ms, "
+              << caffe_ms / ms << "x caffe, max parameter/moment difference "
+              << max_difference;
+  }
+  for (int i = 0; i < state_blobs.size(); ++i) {
+    std::copy(start_state[i].begin(), start_state[i].end(),
+              state_blobs[i]->mutable_cpu_data());
+  }
+}
+void DQN::BenchmarkGather(const std::vector<int>& memory_sizes, int iterations) {
+  CHECK(!shared_memory_) << "Gather benchmark needs a private replay memory.";
+  LOG(INFO) << "*** Gather benchmark begins (huge pages "
+            << (HugePagesEnabled() ? "on" : "off") << ") ***";
+  auto random_state = [&]() {
+    StateDataSp state = AllocateState(state_size_);
+    random_engine.FillUniform(state->data(), state_size_, -1, 1);
+    return state;
+  };
+  std::vector<float> states_input(state_input_data_size_, 0.0f);
+  std::vector<float> next_states_input(state_input_data_size_, 0.0f);
+  const SamplingMode sampling_mode = sampling_mode_;
+  for (int memory_size : memory_sizes) {
+    ClearReplayMemory();
+    // Synthetic episodes of 100 steps
+    while (replay_memory_->size() < memory_size) {
+      int steps = std::min<int>(100, memory_size - replay_memory_->size());
+      StateDataSp state = random_state();
+      for (int t = 0; t < steps; ++t) {
+        StateDataSp next_state = random_state();
+        if (t + 1 < steps) {
+          replay_memory_->emplace_back(state, GetRandomActorOutput(), 0, 0,
+                                       next_state);
+        } else {
+          replay_memory_->emplace_back(state, GetRandomActorOutput(), 0, 0,
+                                       boost::none);
+        }
+        state = next_state;
+      }
+    }
+    for (SamplingMode mode : {UNIFORM_SAMPLING, SORTED_SAMPLING, BLOCK_SAMPLING}) {
+      sampling_mode_ = mode;
+      caffe::Timer timer;
+      timer.Start();
+      for (int i = 0; i < iterations; ++i) {
+        std::vector<int> transitions = SampleTransitionsFromMemory(minibatch_size_);
+        GatherStates(transitions, false, states_input);
+        transitions.erase(std::remove_if(transitions.begin(), transitions.end(),
+                                         [this](int idx) {
+                                           return !std::get<4>((*replay_memory_)[idx]);
+                                         }), transitions.end());
+        GatherStates(transitions, true, next_states_input);
+      }
+      timer.Stop();
+      LOG(INFO) << "Memory " << memory_size << ", " << SamplingModeName(mode)
+                << " sampling: average gather "
+                << timer.MilliSeconds() / iterations << " ms, "
+                << minibatch_size_ * iterations / (timer.MilliSeconds() / 1000)
+                << " transitions/s.";
+    }
+  }
+  sampling_mode_ = sampling_mode;
+  ClearReplayMemory();
+  if (HugePagesEnabled()) {
+    LOG(INFO) << "Huge pages: " << DescribeHugePages();
+  }
+  LOG(INFO) << "*** Gather benchmark ends ***";
+}
+
+int DQN::sampleable_size() const {
+  // Without on-policy targets in the mix, a streamed transition only
+  // waits for the rest of its n-step window
+  const int pending = FLAGS_beta > 0 ? unlabeled_ : std::min(unlabeled_, n_step_ - 1);
+  return memory_size() - pending;
+}
+
 // Randomly sample the replay memory n times, returning the indexes
 std::vector<int> DQN::SampleTransitionsFromMemory(int n) {
+  return SampleTransitionsFromMemory(n, random_engine);
+}
+
+std::vector<int> DQN::SampleTransitionsFromMemory(int n, Rng& rng) const {
   std::vector<int> transitions(n);
-  for (int i = 0; i < n; ++i) {
-    transitions[i] =
-        std::uniform_int_distribution<int>(0, replay_memory_->size() - 1)(
-            random_engine);
+  const int size = sampleable_size();
+  if (sampling_mode_ == BLOCK_SAMPLING) {
+    const int blocks = std::max(1, std::min(FLAGS_sample_blocks, n));
+    const int block_size = (n + blocks - 1) / blocks;
+    const int num_starts = std::max(1, size - block_size + 1);
+    std::vector<int> starts(blocks);
+    rng.FillUniformInt(starts.data(), blocks, num_starts);
+    for (int i = 0; i < n; ++i) {
+      transitions[i] = std::min(starts[i / block_size] + i % block_size,
+                                size - 1);
+    }
+  } else {
+    rng.FillUniformInt(transitions.data(), n, size);
+  }
+  if (sampling_mode_ != UNIFORM_SAMPLING) {
+    std::sort(transitions.begin(), transitions.end());
   }
   return transitions;
 }
@@ -512,25 +924,149 @@ std::vector<InputStates> DQN::SampleStatesFromMemory(int n) {
   std::vector<InputStates> states_batch(n);
   std::vector<int> transitions = SampleTransitionsFromMemory(n);
   for (int i = 0; i < n; ++i) {
-    const auto& transition = (*replay_memory_)[transitions[i]];
-    InputStates last_states;
-    for (int j = 0; j < kStateInputCount; ++j) {
-      last_states[j] = std::get<0>(transition)[j];
+    states_batch[i].resize(frames_);
+    for (int j = 0; j < frames_; ++j) {
+      const float* state = StateAt(transitions[i], j);
+      states_batch[i][j] = AllocateState(state, state + state_size_);
     }
-    states_batch[i] = last_states;
   }
   return states_batch;
 }
 
+int DQN::memory_size() const {
+  return shared_memory_ ? shared_memory_->size() : replay_memory_->size();
+}
+
+int DQN::EpisodeStart(int idx, int max_lookback) const {
+  if (shared_memory_) {
+    return shared_memory_->EpisodeStart(idx, max_lookback);
+  }
+  int start = idx;
+  while (start > 0 && idx - start < max_lookback &&
+         std::get<4>((*replay_memory_)[start - 1])) {
+    --start;
+  }
+  return start;
+}
+
+const float* DQN::StateAt(int idx, int c) const {
+  int frame = idx - frames_ + 1 + c;
+  if (frame < idx) {
+    frame = std::max(frame, EpisodeStart(idx, frames_ - 1));
+  }
+  if (!shared_memory_) {
+    return std::get<0>((*replay_memory_)[frame])->data();
+  }
+  return shared_memory_->state(frame);
+}
+
+const float* DQN::NextStateAt(int idx, int c) const {
+  if (c < frames_ - 1) {
+    return StateAt(idx, c + 1);
+  }
+  if (!shared_memory_) {
+    return std::get<4>((*replay_memory_)[idx]).get()->data();
+  }
+  return shared_memory_->state(idx + 1);
+}
+
+void DQN::GetTransitionInfo(int idx, ActorOutput& actor_output, float& reward,
+                            float& on_policy_target, bool& terminal) const {
+  if (!shared_memory_) {
+    const Transition& t = (*replay_memory_)[idx];
+    actor_output = std::get<1>(t);
+    reward = std::get<2>(t);
+    on_policy_target = std::get<3>(t);
+    terminal = !std::get<4>(t);
+    return;
+  }
+  const float* output = shared_memory_->actor_output(idx);
+  std::copy(output, output + actor_output.size(), actor_output.begin());
+  reward = shared_memory_->reward(idx);
+  on_policy_target = shared_memory_->on_policy_target(idx);
+  terminal = shared_memory_->terminal(idx) || idx + 1 == shared_memory_->size();
+}
+
+int DQN::NStepTransition(int idx, float& reward, bool& terminal) const {
+  ActorOutput actor_output;
+  float on_policy_target, next_reward;
+  GetTransitionInfo(idx, actor_output, reward, on_policy_target, terminal);
+  int last = idx;
+  while (!terminal && last - idx + 1 < n_step_ && last + 1 < memory_size()) {
+    GetTransitionInfo(++last, actor_output, next_reward, on_policy_target, terminal);
+    reward += discounts_[last - idx] * next_reward;
+  }
+  return last;
+}
+
+void DQN::GatherStates(const std::vector<int>& transitions, bool next_states,
+                       std::vector<float>& states_input) const {
+  CHECK_LE(transitions.size(), minibatch_size_);
+  const int size = transitions.size();
+  // Resolve the states first, then copy them in one batch
+  std::vector<const float*> states(size * frames_);
+  for (int n = 0; n < size; ++n) {
+    if (!shared_memory_ && n + 2 * kPrefetchDistance < size) {
+      // Indexing computes the entry's address without loading it
+      __builtin_prefetch(&(*replay_memory_)[transitions[n + 2 * kPrefetchDistance]]);
+    }
+    if (!shared_memory_ && n + kPrefetchDistance < size) {
+      // Its entry was prefetched, so reading the pointer does not stall
+      const Transition& ahead = (*replay_memory_)[transitions[n + kPrefetchDistance]];
+      if (!next_states) {
+        __builtin_prefetch(std::get<0>(ahead).get());
+      } else if (std::get<4>(ahead)) {
+        __builtin_prefetch(std::get<4>(ahead)->get());
+      }
+    }
+    for (int c = 0; c < frames_; ++c) {
+      states[n * frames_ + c] = next_states ? NextStateAt(transitions[n], c) :
+          StateAt(transitions[n], c);
+    }
+  }
+  CopyInputStates(states.data(), states.size(), states_input.data());
+}
+
+void DQN::CopyInputStates(const float* const* states, int count, float* input) const {
+  if (!state_normalizer_) {
+    state_ops_.copy_states(states, count, input, state_size_);
+    return;
+  }
+  for (int n = 0; n < count; ++n) {
+    if (n + kPrefetchStates < count) {
+      PrefetchState(states[n + kPrefetchStates], state_size_);
+    }
+    state_normalizer_->Normalize(states[n], input + n * state_size_);
+  }
+}
+
+void DQN::PackStates(const std::vector<InputStates>& states_batch,
+                     std::vector<float>& states_input) const {
+  CHECK_LE(states_batch.size(), minibatch_size_);
+  std::vector<const float*> states(states_batch.size() * frames_);
+  for (int n = 0; n < states_batch.size(); ++n) {
+    CHECK_EQ(states_batch[n].size(), frames_);
+    for (int c = 0; c < frames_; ++c) {
+      states[n * frames_ + c] = states_batch[n][c]->data();
+    }
+  }
+  CopyInputStates(states.data(), states.size(), states_input.data());
+}
+
 void DQN::LoadActorWeights(const std::string& actor_weights) {
+  SyncCaffe();
+  backend_stale_ = true;
   CHECK(boost::filesystem::is_regular_file(actor_weights))
       << "Invalid file: " << actor_weights;
   LOG(INFO) << "Actor weights finetuning from " << actor_weights;
   actor_net_->CopyTrainedLayersFrom(actor_weights);
   CloneNet(actor_net_, actor_target_net_);
+  LoadStateStats(actor_weights);
 }
 
 void DQN::LoadCriticWeights(const std::string& critic_weights) {
+  SyncCaffe();
+  backend_stale_ = true;
   CHECK(boost::filesystem::is_regular_file(critic_weights))
       << "Invalid file: " << critic_weights;
   LOG(INFO) << "Critic weights finetuning from " << critic_weights;
@@ -539,15 +1075,46 @@ void DQN::LoadCriticWeights(const std::string& critic_weights) {
 }
 
 void DQN::RestoreActorSolver(const std::string& actor_solver) {
+  SyncCaffe();
+  backend_stale_ = true;
   CHECK(boost::filesystem::is_regular_file(actor_solver))
       << "Invalid file: " << actor_solver;
   LOG(INFO) << "Actor solver state resuming from " << actor_solver;
   actor_solver_->Restore(actor_solver.c_str());
   CloneNet(actor_net_, actor_target_net_);
   last_snapshot_iter_ = max_iter();
+  LoadStateStats(actor_solver);
+}
+
+void DQN::LoadStateStats(const std::string& actor_file) {
+  if (!state_normalizer_) {
+    return;
+  }
+  const std::string filename = boost::filesystem::path(actor_file)
+      .replace_extension(".statestats").native();
+  if (!boost::filesystem::is_regular_file(filename)) {
+    LOG(WARNING) << "No state statistics " << filename << " for " << actor_file
+                 << ", the input normalization restarts";
+    return;
+  }
+  state_normalizer_->Load(filename);
+  LOG(INFO) << "State statistics of " << state_normalizer_->count()
+            << " states resuming from " << filename;
+}
+
+bool DQN::state_stats_frozen() const {
+  return state_normalizer_ && state_normalizer_->frozen();
+}
+
+void DQN::set_state_stats_frozen(bool frozen) {
+  if (state_normalizer_) {
+    state_normalizer_->set_frozen(frozen);
+  }
 }
 
 void DQN::RestoreCriticSolver(const std::string& critic_solver) {
+  SyncCaffe();
+  backend_stale_ = true;
   CHECK(boost::filesystem::is_regular_file(critic_solver))
       << "Invalid file: " << critic_solver;
   LOG(INFO) << "Critic solver state resuming from " << critic_solver;
@@ -584,10 +1151,12 @@ void DQN::Snapshot() {
 }
 
 void DQN::Snapshot(const std::string& snapshot_prefix,
-                   bool remove_old, bool snapshot_memory) {
+                   bool remove_old, bool snapshot_memory,
+                   bool snapshot_critic) {
   using namespace boost::filesystem;
+  SyncCaffe();
+  std::lock_guard<std::mutex> lock(actor_mutex_);
   actor_solver_->Snapshot();
-  critic_solver_->Snapshot();
   int actor_iter = actor_solver_->iter();
   std::string actor_fname = save_path_+"_actor_iter_"+std::to_string(actor_iter);
   CHECK(is_regular_file(actor_fname + ".caffemodel"));
@@ -595,14 +1164,22 @@ void DQN::Snapshot(const std::string& snapshot_prefix,
   std::string target_actor_fname = snapshot_prefix+"_actor_iter_"+std::to_string(actor_iter);
   rename(actor_fname + ".caffemodel", target_actor_fname + ".caffemodel");
   rename(actor_fname + ".solverstate", target_actor_fname + ".solverstate");
+  if (state_normalizer_) {
+    // The actor's inputs are normalized by these statistics
+    state_normalizer_->Flush();
+    state_normalizer_->Save(target_actor_fname + ".statestats");
+  }
   int critic_iter = critic_solver_->iter();
-  std::string critic_fname = save_path_+"_critic_iter_"+std::to_string(critic_iter);
-  CHECK(is_regular_file(critic_fname + ".caffemodel"));
-  CHECK(is_regular_file(critic_fname + ".solverstate"));
-  std::string target_critic_fname = snapshot_prefix+"_critic_iter_"+std::to_string(critic_iter);
-  rename(critic_fname + ".caffemodel", target_critic_fname + ".caffemodel");
-  rename(critic_fname + ".solverstate", target_critic_fname + ".solverstate");
-  if (snapshot_memory) {
+  if (snapshot_critic) {
+    critic_solver_->Snapshot();
+    std::string critic_fname = save_path_+"_critic_iter_"+std::to_string(critic_iter);
+    CHECK(is_regular_file(critic_fname + ".caffemodel"));
+    CHECK(is_regular_file(critic_fname + ".solverstate"));
+    std::string target_critic_fname = snapshot_prefix+"_critic_iter_"+std::to_string(critic_iter);
+    rename(critic_fname + ".caffemodel", target_critic_fname + ".caffemodel");
+    rename(critic_fname + ".solverstate", target_critic_fname + ".solverstate");
+  }
+  if (snapshot_memory && !shared_memory_) {
     std::string mem_fname = snapshot_prefix + "_iter_" +
         std::to_string(max_iter()) + ".replaymemory";
     LOG(INFO) << "Snapshotting memory to " << mem_fname;
@@ -611,9 +1188,11 @@ void DQN::Snapshot(const std::string& snapshot_prefix,
   }
   if (remove_old) {
     RemoveSnapshots(snapshot_prefix + "_actor_iter_[0-9]+"
-                    "\\.(caffemodel|solverstate)", actor_iter - 1);
-    RemoveSnapshots(snapshot_prefix + "_critic_iter_[0-9]+"
-                    "\\.(caffemodel|solverstate)", critic_iter - 1);
+                    "\\.(caffemodel|solverstate|statestats)", actor_iter - 1);
+    if (snapshot_critic) {
+      RemoveSnapshots(snapshot_prefix + "_critic_iter_[0-9]+"
+                      "\\.(caffemodel|solverstate)", critic_iter - 1);
+    }
     RemoveSnapshots(snapshot_prefix + "_iter_[0-9]+\\.replaymemory", critic_iter - 1);
   }
   LOG(INFO) << "Snapshotting Finished!";
@@ -635,21 +1214,30 @@ void DQN::Initialize() {
 #endif
   // Check that nets have the necessary layers and blobs
   HasBlobSize(*actor_net_, states_blob_name,
-              {kMinibatchSize, kStateInputCount, state_size_, 1});
+              {minibatch_size_, 1, frames_ * state_size_, 1});
   HasBlobSize(*actor_net_, actions_blob_name,
-              {kMinibatchSize, kActionSize});
+              {minibatch_size_, kActionSize});
   HasBlobSize(*actor_net_, action_params_blob_name,
-              {kMinibatchSize, kActionParamSize});
+              {minibatch_size_, kActionParamSize});
   HasBlobSize(*critic_net_, states_blob_name,
-              {kMinibatchSize, kStateInputCount, state_size_, 1});
+              {minibatch_size_, 1, frames_ * state_size_, 1});
   HasBlobSize(*critic_net_, actions_blob_name,
-              {kMinibatchSize, 1, kActionSize, 1});
+              {minibatch_size_, 1, kActionSize, 1});
   HasBlobSize(*critic_net_, action_params_blob_name,
-              {kMinibatchSize, 1, kActionParamSize, 1});
+              {minibatch_size_, 1, kActionParamSize, 1});
   HasBlobSize(*critic_net_, targets_blob_name,
-              {kMinibatchSize, 1, 1, 1});
+              {minibatch_size_, 1, 1, 1});
+  critic_heads_ = critic_net_->blob_by_name(q_values_blob_name)->shape(1);
   HasBlobSize(*critic_net_, q_values_blob_name,
-              {kMinibatchSize, 1});
+              {minibatch_size_, critic_heads_});
+  if (critic_heads_ > 1) {
+    LOG(INFO) << "[Agent" << tid_ << "] Critic ensemble of " << critic_heads_
+              << " heads";
+  }
+  CHECK(FLAGS_explore_uncertainty == 0 || critic_heads_ > 1)
+      << "-explore_uncertainty needs -critic_heads > 1";
+  CHECK(FLAGS_head_bootstrap > 0 && FLAGS_head_bootstrap <= 1)
+      << "-head_bootstrap must be in (0, 1]";
   // HasBlobSize(*critic_net_, loss_blob_name, {1});
   CHECK(actor_net_->has_layer(state_input_layer_name));
   CHECK(critic_net_->has_layer(state_input_layer_name));
@@ -659,45 +1247,62 @@ void DQN::Initialize() {
   CHECK(critic_net_->has_layer(q_values_layer_name));
   CloneNet(critic_net_, critic_target_net_);
   CloneNet(actor_net_, actor_target_net_);
+  backend_.reset(CreateComputeBackend(
+      FLAGS_backend, {actor_solver_, critic_solver_, actor_target_net_,
+                      critic_target_net_}, minibatch_size_));
+  LOG(INFO) << "[Agent" << tid_ << "] Updates computed by the "
+            << backend_->name() << " backend";
+  if (HugePagesEnabled() && caffe::Caffe::mode() == caffe::Caffe::CPU) {
+    size_t advised = 0;
+    for (NetSp net : {actor_net_, critic_net_, actor_target_net_, critic_target_net_}) {
+      advised += AdviseNetHugePages(*net);
+    }
+    LOG(INFO) << "[Agent" << tid_ << "] Huge pages advised for "
+              << advised / (1024 * 1024) << " MB of network blobs";
+  }
 }
 
 ActorOutput DQN::GetRandomActorOutput() {
+  // Draw all fields in one bulk call, then scale them to their ranges
   ActorOutput actor_output;
-  for (int i = 0; i < kActionSize; ++i) {
-    actor_output[i] = std::uniform_real_distribution<float>(-1.0,1.0)(random_engine);
-  }
-  actor_output[kActionSize + 0] = // Dash Power
-      std::uniform_real_distribution<float>(-100.0, 100.0)(random_engine);
-  actor_output[kActionSize + 1] = // Dash Angle
-      std::uniform_real_distribution<float>(-180.0, 180.0)(random_engine);
-  actor_output[kActionSize + 2] = // Turn Angle
-      std::uniform_real_distribution<float>(-180.0, 180.0)(random_engine);
-  actor_output[kActionSize + 3] = // Tackle Angle
-      std::uniform_real_distribution<float>(-180.0, 180.0)(random_engine);
-  actor_output[kActionSize + 4] = // Kick Power
-      std::uniform_real_distribution<float>(0.0, 100.0)(random_engine);
-  actor_output[kActionSize + 5] = // Kick Angle
-      std::uniform_real_distribution<float>(-180.0, 180.0)(random_engine);
+  random_engine.FillUniform(actor_output.data(), actor_output.size(), 0, 1);
+  static const float kMin[] = {-1, -1, -1, -1, // Actions
+                               -100, // Dash Power
+                               -180, // Dash Angle
+                               -180, // Turn Angle
+                               -180, // Tackle Angle
+                               0,    // Kick Power
+                               -180}; // Kick Angle
+  static const float kMax[] = {1, 1, 1, 1, 100, 180, 180, 180, 100, 180};
+  for (int i = 0; i < actor_output.size(); ++i) {
+    actor_output[i] = kMin[i] + (kMax[i] - kMin[i]) * actor_output[i];
+  }
   return actor_output;
 }
 
-ActorOutput DQN::SelectAction(const InputStates& last_states, const double epsilon) {
-  return SelectActions(std::vector<InputStates>{{last_states}}, epsilon)[0];
+ActorOutput DQN::SelectAction(const InputStates& last_states, const double epsilon,
+                              bool explore) {
+  return SelectActions(std::vector<InputStates>(1, last_states), epsilon,
+                       explore)[0];
 }
 
 float DQN::EvaluateAction(const InputStates& input_states,
                           const ActorOutput& actor_output) {
+  SyncCaffe();
   return CriticForward(*critic_net_,
-                       std::vector<InputStates>{{input_states}},
+                       std::vector<InputStates>(1, input_states),
                        std::vector<ActorOutput>{{actor_output}})[0];
 }
 
 std::vector<ActorOutput>
 DQN::SelectActions(const std::vector<InputStates>& states_batch,
-                   const double epsilon) {
+                   const double epsilon, bool explore) {
   CHECK(epsilon >= 0.0 && epsilon <= 1.0);
-  CHECK_LE(states_batch.size(), kMinibatchSize);
-  if (std::uniform_real_distribution<double>(0.0, 1.0)(random_engine) < epsilon) {
+  CHECK_LE(states_batch.size(), minibatch_size_);
+  // The actor is not trusted with inputs normalized by no statistics
+  const bool cold_stats = state_normalizer_ && state_normalizer_->count() == 0;
+  if ((explore && cold_stats) ||
+      std::uniform_real_distribution<double>(0.0, 1.0)(random_engine) < epsilon) {
     // Select randomly
     std::vector<ActorOutput> actor_outputs(states_batch.size());
     for (int i = 0; i < actor_outputs.size(); ++i) {
@@ -706,14 +1311,65 @@ DQN::SelectActions(const std::vector<InputStates>& states_batch,
     return actor_outputs;
   } else {
     // Select greedily
-    return SelectActionGreedily(*actor_net_, states_batch);
+    SyncCaffe();
+    std::vector<ActorOutput> actor_outputs;
+    {
+      std::lock_guard<std::mutex> lock(actor_mutex_);
+      actor_outputs = SelectActionGreedily(*actor_net_, states_batch);
+    }
+    if (explore && FLAGS_explore_uncertainty > 0) {
+      return ExploreUncertainActions(states_batch, actor_outputs);
+    }
+    return actor_outputs;
   }
 }
 
+std::vector<ActorOutput>
+DQN::ExploreUncertainActions(const std::vector<InputStates>& states_batch,
+                             const std::vector<ActorOutput>& greedy_actions) {
+  // Each state gets an equal share of the critic's minibatch
+  const int candidates = minibatch_size_ / states_batch.size();
+  if (candidates < 2) {
+    return greedy_actions;
+  }
+  std::vector<InputStates> candidate_states;
+  std::vector<ActorOutput> candidate_actions;
+  for (int i = 0; i < states_batch.size(); ++i) {
+    for (int c = 0; c < candidates; ++c) {
+      candidate_states.push_back(states_batch[i]);
+      candidate_actions.push_back(c == 0 ? greedy_actions[i] : GetRandomActorOutput());
+    }
+  }
+  std::vector<float> states_input(state_input_data_size_, 0.0f);
+  PackStates(candidate_states, states_input);
+  const std::vector<float> q_values =
+      CriticHeadsForward(*critic_net_, states_input, candidate_actions);
+  std::vector<ActorOutput> actor_outputs(greedy_actions);
+  for (int i = 0; i < states_batch.size(); ++i) {
+    float best_bound = -std::numeric_limits<float>::infinity();
+    for (int c = 0; c < candidates; ++c) {
+      const int n = i * candidates + c;
+      const float* q = q_values.data() + n * critic_heads_;
+      const float mean = std::accumulate(q, q + critic_heads_, 0.0f) / critic_heads_;
+      float var = 0;
+      for (int k = 0; k < critic_heads_; ++k) {
+        var += (q[k] - mean) * (q[k] - mean);
+      }
+      const float bound = mean + FLAGS_explore_uncertainty *
+          std::sqrt(var / (critic_heads_ - 1));
+      if (bound > best_bound) {
+        best_bound = bound;
+        actor_outputs[i] = candidate_actions[n];
+      }
+    }
+  }
+  return actor_outputs;
+}
+
 ActorOutput DQN::SelectActionGreedily(caffe::Net<float>& actor,
                                       const InputStates& last_states) {
   return SelectActionGreedily(
-      actor, std::vector<InputStates>{{last_states}}).front();
+      actor, std::vector<InputStates>(1, last_states)).front();
 }
 
 std::vector<ActorOutput> getActorOutput(caffe::Net<float>& actor,
@@ -734,25 +1390,26 @@ std::vector<ActorOutput> getActorOutput(caffe::Net<float>& actor,
 std::vector<ActorOutput>
 DQN::SelectActionGreedily(caffe::Net<float>& actor,
                           const std::vector<InputStates>& states_batch) {
+  std::vector<float> states_input(state_input_data_size_, 0.0f);
+  PackStates(states_batch, states_input);
+  return SelectActionGreedily(actor, states_input, states_batch.size());
+}
+
+std::vector<ActorOutput>
+DQN::SelectActionGreedily(caffe::Net<float>& actor,
+                          std::vector<float>& states_input,
+                          int batch_size) {
   DLOG(INFO) << "  [Forward] Actor";
   CHECK(actor.has_blob(actions_blob_name));
   CHECK(actor.has_blob(action_params_blob_name));
-  CHECK_LE(states_batch.size(), kMinibatchSize);
-  std::vector<float> states_input(state_input_data_size_, 0.0f);
-  const auto states_blob = actor.blob_by_name(states_blob_name);
-  for (int n = 0; n < states_batch.size(); ++n) {
-    for (int c = 0; c < kStateInputCount; ++c) {
-      const auto& state_data = states_batch[n][c];
-      std::copy(state_data->begin(), state_data->end(),
-                states_input.begin() + states_blob->offset(n,c,0,0));
-    }
-  }
+  CHECK_LE(batch_size, minibatch_size_);
+  CHECK_EQ(states_input.size(), state_input_data_size_);
   InputDataIntoLayers(actor, states_input.data(), NULL, NULL, NULL, NULL);
   actor.ForwardPrefilled(nullptr);
-  std::vector<ActorOutput> actor_outputs(states_batch.size());
+  std::vector<ActorOutput> actor_outputs(batch_size);
   const auto actions_blob = actor.blob_by_name(actions_blob_name);
   const auto action_params_blob = actor.blob_by_name(action_params_blob_name);
-  for (int n = 0; n < states_batch.size(); ++n) {
+  for (int n = 0; n < batch_size; ++n) {
     ActorOutput actor_output;
     for (int c = 0; c < kActionSize; ++c) {
       actor_output[c] = actions_blob->data_at(n,c,0,0);
@@ -766,18 +1423,66 @@ DQN::SelectActionGreedily(caffe::Net<float>& actor,
 }
 
 void DQN::AddTransition(const Transition& transition) {
+  CHECK(!shared_memory_) << "Shared replay memory is read-only.";
   if (replay_memory_->size() == replay_memory_capacity_) {
     replay_memory_->pop_front();
   }
   replay_memory_->push_back(transition);
+  ObserveState(std::get<0>(transition));
 }
 
-void DQN::AddTransitions(const std::vector<Transition>& transitions) {
-  while (replay_memory_->size() + transitions.size() >= replay_memory_capacity_) {
+void DQN::StreamTransition(Transition&& transition) {
+  CHECK(!shared_memory_) << "Shared replay memory is read-only.";
+  DCHECK(unlabeled_ == 0 || !std::get<4>(replay_memory_->back()) ||
+         *std::get<4>(replay_memory_->back()) == std::get<0>(transition))
+      << "Next states must share the state of the following transition";
+  if (replay_memory_->size() == replay_memory_capacity_) {
     replay_memory_->pop_front();
   }
-  std::deque<Transition>::iterator it = replay_memory_->end();
-  replay_memory_->insert(it, transitions.begin(), transitions.end());
+  ObserveState(std::get<0>(transition));
+  replay_memory_->push_back(std::move(transition));
+  unlabeled_ = std::min(unlabeled_ + 1, int(replay_memory_->size()));
+}
+
+void DQN::LabelStreamedEpisode() {
+  CHECK_GT(unlabeled_, 0) << "Need at least one transition to label.";
+  CHECK(!std::get<4>(replay_memory_->back()))
+      << "Streamed episode must end with a terminal transition.";
+  // Same targets as LabelTransitions, written in place from the back
+  float target = 0;
+  for (int i = replay_memory_->size() - 1; unlabeled_ > 0; --i, --unlabeled_) {
+    Transition& t = (*replay_memory_)[i];
+    target = std::get<2>(t) + gamma_ * target;
+    std::get<3>(t) = target;
+  }
+  FlushStateStats();
+}
+
+void DQN::AddTransitions(std::vector<Transition>&& transitions) {
+  CHECK(!shared_memory_) << "Shared replay memory is read-only.";
+  CHECK_EQ(unlabeled_, 0) << "Finish the streamed episode first.";
+  int overflow = int(replay_memory_->size() + transitions.size())
+      - replay_memory_capacity_;
+  // An episode longer than the whole capacity keeps its latest
+  // transitions
+  int dropped = 0;
+  if (overflow > 0) {
+    const int evicted = std::min(overflow, int(replay_memory_->size()));
+    replay_memory_->erase(replay_memory_->begin(),
+                          replay_memory_->begin() + evicted);
+    dropped = overflow - evicted;
+  }
+  for (int i = dropped; i < transitions.size(); ++i) {
+    DCHECK(i == dropped || !std::get<4>(transitions[i - 1]) ||
+           *std::get<4>(transitions[i - 1]) == std::get<0>(transitions[i]))
+        << "Next states must share the state of the following transition";
+    ObserveState(std::get<0>(transitions[i]));
+  }
+  replay_memory_->insert(replay_memory_->end(),
+                         std::make_move_iterator(transitions.begin() + dropped),
+                         std::make_move_iterator(transitions.end()));
+  transitions.clear();
+  FlushStateStats();
 }
 
 void DQN::LabelTransitions(std::vector<Transition>& transitions) {
@@ -797,24 +1502,32 @@ void DQN::LabelTransitions(std::vector<Transition>& transitions) {
 }
 
 void DQN::Update() {
-  if (memory_size() < FLAGS_memory_threshold) {
+  if (sampleable_size() < FLAGS_memory_threshold) {
     return;
   }
-  std::pair<float,float> res = UpdateActorCritic();
+  PrepareMinibatch(SampleTransitionsFromMemory(minibatch_size_), minibatch_);
+  Update(minibatch_);
+}
+
+void DQN::Update(Minibatch& batch) {
+  std::pair<float,float> res = UpdateActorCritic(batch);
   float critic_loss = res.first;
   float avg_q = res.second;
   if (critic_iter() % FLAGS_loss_display_iter == 0) {
     LOG(INFO) << "[Agent" << tid_ << "] Critic Iteration " << critic_iter()
               << ", loss = " << smoothed_critic_loss_;
+    LOG(INFO) << "[Agent" << tid_ << "] State pool: " << DescribeStatePool();
     smoothed_critic_loss_ = 0;
   }
   smoothed_critic_loss_ += critic_loss / float(FLAGS_loss_display_iter);
-  if (actor_iter() % FLAGS_loss_display_iter == 0) {
-    LOG(INFO) << "[Agent" << tid_ << "] Actor Iteration " << actor_iter()
-              << ", avg_q_value = " << smoothed_actor_loss_;
-    smoothed_actor_loss_ = 0;
+  if (critic_iter() > critic_warmup_) {
+    if (actor_iter() % FLAGS_loss_display_iter == 0) {
+      LOG(INFO) << "[Agent" << tid_ << "] Actor Iteration " << actor_iter()
+                << ", avg_q_value = " << smoothed_actor_loss_;
+      smoothed_actor_loss_ = 0;
+    }
+    smoothed_actor_loss_ += avg_q / float(FLAGS_loss_display_iter);
   }
-  smoothed_actor_loss_ += avg_q / float(FLAGS_loss_display_iter);
   bool critic_needs_snapshot =
       critic_iter() >= last_snapshot_iter_ + FLAGS_snapshot_freq;
   bool actor_needs_snapshot =
@@ -826,182 +1539,398 @@ void DQN::Update() {
 }
 
 std::pair<float,float> DQN::UpdateActorCritic() {
-  CHECK(critic_net_->has_blob(states_blob_name));
-  CHECK(critic_net_->has_blob(actions_blob_name));
-  CHECK(critic_net_->has_blob(action_params_blob_name));
-  CHECK(critic_net_->has_blob(targets_blob_name));
-  CHECK(critic_net_->has_blob(loss_blob_name));
-  const auto actor_states_blob = actor_net_->blob_by_name(states_blob_name);
-  const auto actor_actions_blob = actor_net_->blob_by_name(actions_blob_name);
-  const auto actor_action_params_blob = actor_net_->
-      blob_by_name(action_params_blob_name);
-  const auto critic_states_blob = critic_net_->blob_by_name(states_blob_name);
-  const auto critic_action_blob = critic_net_->blob_by_name(actions_blob_name);
-  const auto critic_action_params_blob =
-      critic_net_->blob_by_name(action_params_blob_name);
-  const auto target_blob = critic_net_->blob_by_name(targets_blob_name);
-  const auto q_values_blob = critic_net_->blob_by_name(q_values_blob_name);
-  const auto loss_blob = critic_net_->blob_by_name(loss_blob_name);
-  // Collect a batch of next-states used to generate target_q_values
-  std::vector<int> transitions = SampleTransitionsFromMemory(kMinibatchSize);
-  std::vector<InputStates> states_batch(kMinibatchSize);
-  std::vector<ActorOutput> actions_batch(kMinibatchSize);
-  std::vector<float> rewards_batch(kMinibatchSize);
-  std::vector<float> on_policy_targets(kMinibatchSize);
-  std::vector<bool> terminal(kMinibatchSize);
-  std::vector<InputStates> next_states_batch;
-  next_states_batch.reserve(kMinibatchSize);
-  // Raw data used for input to networks
-  std::vector<float> states_input(state_input_data_size_, 0.0f);
-  std::vector<float> action_input(kActionInputDataSize, 0.0f);
-  std::vector<float> action_params_input(kActionParamsInputDataSize, 0.0f);
-  std::vector<float> target_input(kTargetInputDataSize, 0.0f);
-  for (int n = 0; n < kMinibatchSize; ++n) {
-    const auto& transition = (*replay_memory_)[transitions[n]];
-    InputStates last_states;
-    for (int c = 0; c < kStateInputCount; ++c) {
-      const auto& state_data = std::get<0>(transition)[c];
-      std::copy(state_data->begin(), state_data->end(),
-                states_input.begin() + critic_states_blob->offset(n,c,0,0));
-      last_states[c] = state_data;
-    }
-    states_batch[n] = last_states;
-    const ActorOutput& actor_output = std::get<1>(transition);
+  PrepareMinibatch(SampleTransitionsFromMemory(minibatch_size_), minibatch_);
+  return UpdateActorCritic(minibatch_);
+}
+
+void DQN::PrepareMinibatch(const std::vector<int>& transitions,
+                           Minibatch& batch) const {
+  CHECK_EQ(transitions.size(), minibatch_size_);
+  // Sized once; recycled batches keep their buffers
+  batch.transitions = transitions;
+  batch.states_input.resize(state_input_data_size_);
+  batch.next_states_input.resize(state_input_data_size_);
+  batch.action_input.resize(minibatch_size_ * kActionSize);
+  batch.action_params_input.resize(minibatch_size_ * kActionParamSize);
+  batch.rewards.resize(minibatch_size_);
+  batch.on_policy_targets.resize(minibatch_size_);
+  batch.bootstrap_discounts.resize(minibatch_size_);
+  batch.terminal.resize(minibatch_size_);
+  std::vector<int> next_transitions;
+  next_transitions.reserve(minibatch_size_);
+  // Minibatches are indices into replay storage. States are gathered
+  // from there straight into the input buffers.
+  GatherStates(transitions, false, batch.states_input);
+  for (int n = 0; n < minibatch_size_; ++n) {
+    ActorOutput actor_output;
+    bool is_terminal;
+    GetTransitionInfo(transitions[n], actor_output, batch.rewards[n],
+                      batch.on_policy_targets[n], is_terminal);
     std::copy(actor_output.begin(), actor_output.begin() + kActionSize,
-              action_input.begin() + critic_action_blob->offset(n,0,0,0));
+              batch.action_input.begin() + n * kActionSize);
     std::copy(actor_output.begin() + kActionSize, actor_output.end(),
-              action_params_input.begin() + critic_action_params_blob->offset(n,0,0,0));
-    actions_batch[n] = actor_output;
-    const float reward = std::get<2>(transition);
-    on_policy_targets[n] = std::get<3>(transition);
-    rewards_batch[n] = reward;
-    terminal[n] = !std::get<4>(transition);
-    if (!terminal[n]) {
-      InputStates next_states;
-      for (int i = 0; i < kStateInputCount - 1; ++i) {
-        next_states[i] = std::get<0>(transition)[i + 1];
-      }
-      next_states[kStateInputCount-1] = std::get<4>(transition).get();
-      next_states_batch.push_back(next_states);
+              batch.action_params_input.begin() + n * kActionParamSize);
+    int last = transitions[n];
+    if (n_step_ > 1) {
+      last = NStepTransition(transitions[n], batch.rewards[n], is_terminal);
+    }
+    batch.terminal[n] = is_terminal;
+    if (!is_terminal) {
+      next_transitions.push_back(last);
+      batch.bootstrap_discounts[n] = discounts_[last - transitions[n] + 1];
     }
   }
-  // Generate targets using the target nets
-  const std::vector<float> target_q_values =
-      CriticForwardThroughActor(
-          *critic_target_net_, *actor_target_net_, next_states_batch);
+  // Collect a batch of next-states used to generate target_q_values
+  GatherStates(next_transitions, true, batch.next_states_input);
+  batch.num_next_states = next_transitions.size();
+}
+
+std::pair<float,float> DQN::UpdateActorCritic(Minibatch& batch) {
+  SyncBackend();
+  std::pair<float,float> res = UpdateActorCritic(*backend_, batch);
+  caffe_stale_ = true;
+  return res;
+}
+std::pair<float,float> DQN::UpdateActorCritic(ComputeBackend& backend,
+                                              Minibatch& batch) {
+  const int n = minibatch_size_;
+  const int heads = critic_heads_;
+  // Generate targets using the target nets. An ensemble's target is its
+  // most pessimistic head, averaged over the target action and its
+  // noisy copies.
+  const int next = batch.num_next_states;
+  const int candidates = 1 + FLAGS_target_smoothing;
+  std::vector<float> next_actions(candidates * n * kActionSize);
+  std::vector<float> next_action_params(candidates * n * kActionParamSize);
+  backend.ActorForward(ACTOR_TARGET, batch.next_states_input.data(), next,
+                       next_actions.data(), next_action_params.data());
+  SmoothTargetActions(next, candidates, next_actions.data(),
+                      next_action_params.data());
+  std::vector<float> target_q_values(candidates * next * heads);
+  backend.CriticForwardActions(CRITIC_TARGET, batch.next_states_input.data(),
+                               next_actions.data(), next_action_params.data(),
+                               next, candidates, heads, target_q_values.data());
+  std::vector<float> targets(n);
   int target_value_idx = 0;
-  for (int n = 0; n < kMinibatchSize; ++n) {
-    float off_policy_target = terminal[n] ? rewards_batch[n] :
-        rewards_batch[n] + gamma_ * target_q_values[target_value_idx++];
-    float on_policy_target = on_policy_targets[n];
+  for (int i = 0; i < n; ++i) {
+    float off_policy_target = batch.rewards[i];
+    if (!batch.terminal[i]) {
+      float next_q = 0;
+      for (int c = 0; c < candidates; ++c) {
+        const float* q = target_q_values.data() +
+            heads * (c * next + target_value_idx);
+        next_q += *std::min_element(q, q + heads);
+      }
+      ++target_value_idx;
+      off_policy_target += batch.bootstrap_discounts[i] * next_q / candidates;
+    }
+    float on_policy_target = batch.on_policy_targets[i];
     float target = FLAGS_beta * on_policy_target + (1 - FLAGS_beta) * off_policy_target;
     CHECK(std::isfinite(target)) << "Target not finite!";
-    target_input[target_blob->offset(n,0,0,0)] = target;
+    targets[i] = target;
   }
-  InputDataIntoLayers(*critic_net_, states_input.data(), action_input.data(),
-                      action_params_input.data(), target_input.data(), NULL);
+  // Update the critic on the Euclidean loss of each head to the targets
   DLOG(INFO) << " [Step] Critic";
-  critic_solver_->Step(1);
-  float critic_loss = loss_blob->data_at(0,0,0,0);
+  const float* q_values =
+      backend.CriticForward(CRITIC, batch.states_input.data(),
+                            batch.action_input.data(),
+                            batch.action_params_input.data(), n);
+  // Each head of an ensemble only learns from its bootstrap subsample
+  // of the minibatch
+  std::vector<float> head_masks(n * heads, 1.0f);
+  if (heads > 1 && FLAGS_head_bootstrap < 1) {
+    random_engine.FillUniform(head_masks.data(), n * heads, 0, 1);
+    for (float& mask : head_masks) {
+      mask = mask < FLAGS_head_bootstrap ? 1 : 0;
+    }
+  }
+  // The loss reported is over the entries the heads learn from
+  std::vector<float> q_values_diff(n * heads);
+  double critic_loss = 0;
+  int unmasked = 0;
+  for (int i = 0; i < n * heads; ++i) {
+    const float error = q_values[i] - targets[i / heads];
+    critic_loss += head_masks[i] * error * error;
+    unmasked += head_masks[i] != 0;
+    q_values_diff[i] = head_masks[i] * error / n;
+  }
+  critic_loss /= 2 * std::max(unmasked, 1);
   CHECK(std::isfinite(critic_loss)) << "Critic loss not finite!";
-  // Update the actor
-  ZeroGradParameters(*critic_net_);
-  ZeroGradParameters(*actor_net_);
-  std::vector<ActorOutput> actor_output_batch =
-      SelectActionGreedily(*actor_net_, states_batch);
-  DLOG(INFO) << "ActorOutput:  " << PrintActorOutput(actor_output_batch[0]);
-  std::vector<float> q_values =
-      CriticForward(*critic_net_, states_batch, actor_output_batch);
-  float avg_q = std::accumulate(q_values.begin(), q_values.end(), 0.0) /
-      float(q_values.size());
-  // Set the critic diff and run backward
-  float* q_values_diff = q_values_blob->mutable_cpu_diff();
-  for (int n = 0; n < kMinibatchSize; n++) {
-    q_values_diff[q_values_blob->offset(n,0,0,0)] = -1.0;
-  }
-  DLOG(INFO) << " [Backwards] " << critic_net_->name();
-  critic_net_->BackwardFrom(GetLayerIndex(*critic_net_, q_values_layer_name));
-  float* action_diff = critic_action_blob->mutable_cpu_diff();
-  float* param_diff = critic_action_params_blob->mutable_cpu_diff();
-  DLOG(INFO) << "Diff: " << PrintActorOutput(action_diff, param_diff);
-  for (int n = 0; n < kMinibatchSize; ++n) {
-    for (int h = 0; h < kActionSize; ++h) {
-      int offset = critic_action_blob->offset(n,0,h,0);
-      float diff = action_diff[offset];
-      float output = actor_output_batch[n][h];
-      float min = -1.0; float max = 1.0;
-      if (diff < 0) {
-        diff *= (max - output) / (max - min);
-      } else if (diff > 0) {
-        diff *= (output - min) / (max - min);
+  backend.CriticBackward(q_values_diff.data(), NULL, NULL, true);
+  // A skipped step leaves Adam's bias correction and the schedules alone
+  const bool critic_stepped = backend.CriticStep(critic_iter());
+  if (critic_stepped) {
+    critic_solver_->set_iter(critic_iter() + 1);
+  }
+  // Update the actor, once the critic warmed up to a pretrained actor
+  std::lock_guard<std::mutex> lock(actor_mutex_);
+  float avg_q = 0;
+  if (critic_iter() > critic_warmup_) {
+    std::vector<float> actions(n * kActionSize);
+    std::vector<float> action_params(n * kActionParamSize);
+    backend.ActorForward(ACTOR, batch.states_input.data(), n, actions.data(),
+                         action_params.data());
+    q_values = backend.CriticForward(CRITIC, batch.states_input.data(),
+                                     actions.data(), action_params.data(), n);
+    avg_q = std::accumulate(q_values, q_values + n * heads, 0.0) /
+        float(n * heads);
+    // Ascend the q-values (their mean over heads): their gradients w.r.t.
+    // the actor's outputs, inverted towards the bounds, are the actor's
+    // output gradients
+    std::fill(q_values_diff.begin(), q_values_diff.end(), -1.0f / heads);
+    std::vector<float> action_diff(n * kActionSize);
+    std::vector<float> action_params_diff(n * kActionParamSize);
+    DLOG(INFO) << " [Backwards] " << critic_net_->name();
+    backend.CriticBackward(q_values_diff.data(), action_diff.data(),
+                           action_params_diff.data(), false);
+    for (int i = 0; i < n; ++i) {
+      InvertGradients(actions.data() + i * kActionSize,
+                      action_params.data() + i * kActionParamSize,
+                      action_diff.data() + i * kActionSize,
+                      action_params_diff.data() + i * kActionParamSize);
+    }
+    DLOG(INFO) << " [Backwards] " << actor_net_->name();
+    backend.ActorBackward(action_diff.data(), action_params_diff.data());
+    backend.ActorStep(actor_iter());
+    actor_solver_->set_iter(actor_iter() + 1);
+  }
+  // Soft update the target networks
+  if (critic_stepped && critic_iter() % FLAGS_soft_update_freq == 0) {
+    backend.SoftUpdateTargets(FLAGS_tau);
+  }
+  return std::make_pair(float(critic_loss), avg_q);
+}
+void DQN::SmoothTargetActions(int batch, int candidates, float* actions,
+                              float* action_params) {
+  for (int c = 1; c < candidates; ++c) {
+    float* a = actions + c * batch * kActionSize;
+    float* p = action_params + c * batch * kActionParamSize;
+    std::copy(actions, actions + batch * kActionSize, a);
+    std::copy(action_params, action_params + batch * kActionParamSize, p);
+    for (int n = 0; n < batch; ++n) {
+      for (int h = 0; h < kActionSize; ++h) {
+        a[n * kActionSize + h] = SmoothedOutput(a[n * kActionSize + h], -1, 1);
+      }
+      for (int h = 0; h < kActionParamSize; ++h) {
+        float min, max;
+        ActionParamBounds(h, &min, &max);
+        p[n * kActionParamSize + h] =
+            SmoothedOutput(p[n * kActionParamSize + h], min, max);
       }
-      action_diff[offset] = diff;
     }
-    for (int h = 0; h < kActionParamSize; ++h) {
-      int offset = critic_action_params_blob->offset(n,0,h,0);
-      float diff = param_diff[offset];
-      float output = actor_output_batch[n][h+kActionSize];
-      float min, max;
-      if (h == 0 || h == 4) {
-        min = 0; max = 100;
-      } else if (h == 1 || h == 2 || h == 3 || h == 5) {
-        min = -180; max = 180;
+  }
+}
+float DQN::SmoothedOutput(float output, float min, float max) {
+  const float std = FLAGS_target_noise * (max - min);
+  if (std <= 0) {
+    return output;
+  }
+  std::normal_distribution<float> noise(0, std);
+  const float clipped = std::min(std::max(noise(random_engine), -2 * std), 2 * std);
+  return std::min(std::max(output + clipped, min), max);
+}
+void DQN::SyncBackend() {
+  if (backend_stale_) {
+    CHECK(!caffe_stale_);
+    backend_->Import();
+    backend_stale_ = false;
+  }
+}
+void DQN::SyncCaffe() {
+  if (caffe_stale_) {
+    CHECK(!backend_stale_);
+    backend_->Export();
+    caffe_stale_ = false;
+  }
+}
+std::vector<caffe::Blob<float>*> DQN::StateBlobs() {
+  std::vector<caffe::Blob<float>*> blobs;
+  for (NetSp net : {actor_net_, critic_net_, actor_target_net_, critic_target_net_}) {
+    for (const auto& blob : net->params()) {
+      blobs.push_back(blob.get());
+    }
+  }
+  for (SolverSp solver : {actor_solver_, critic_solver_}) {
+    auto sgd_solver = dynamic_cast<caffe::SGDSolver<float>*>(solver.get());
+    CHECK(sgd_solver) << "Solver " << solver->type() << " keeps no history";
+    for (const auto& blob : sgd_solver->history()) {
+      blobs.push_back(blob.get());
+    }
+  }
+  return blobs;
+}
+
+void DQN::PretrainActor(const std::vector<Demonstration>& demonstrations,
+                        int iterations) {
+  CHECK(!demonstrations.empty()) << "Nothing to pretrain on.";
+  SyncCaffe();
+  backend_stale_ = true;
+  const auto actions_blob = actor_net_->blob_by_name(actions_blob_name);
+  const auto action_params_blob = actor_net_->blob_by_name(action_params_blob_name);
+  // Parameters are regressed relative to their range
+  static const float kParamRange[] = {200, 360, 360, 360, 100, 360};
+  std::vector<float> states_input(state_input_data_size_, 0.0f);
+  std::vector<InputStates> states_batch(minibatch_size_);
+  std::vector<int> sample(minibatch_size_);
+  double smoothed_loss = 0, smoothed_accuracy = 0;
+  LOG(INFO) << "[Agent" << tid_ << "] Pretraining actor on "
+            << demonstrations.size() << " demonstrations";
+  // The actor is cloned on the inputs it will act on
+  if (state_normalizer_) {
+    for (const Demonstration& demo : demonstrations) {
+      ObserveState(demo.states.back());
+    }
+    state_normalizer_->Flush();
+  }
+  for (int iter = 1; iter <= iterations; ++iter) {
+    random_engine.FillUniformInt(sample.data(), minibatch_size_,
+                                 demonstrations.size());
+    for (int n = 0; n < minibatch_size_; ++n) {
+      states_batch[n] = demonstrations[sample[n]].states;
+    }
+    PackStates(states_batch, states_input);
+    std::vector<ActorOutput> outputs =
+        SelectActionGreedily(*actor_net_, states_input, minibatch_size_);
+    float* action_diff = actions_blob->mutable_cpu_diff();
+    float* param_diff = action_params_blob->mutable_cpu_diff();
+    caffe::caffe_set(actions_blob->count(), 0.0f, action_diff);
+    caffe::caffe_set(action_params_blob->count(), 0.0f, param_diff);
+    float loss = 0;
+    int correct = 0;
+    for (int n = 0; n < minibatch_size_; ++n) {
+      const Demonstration& demo = demonstrations[sample[n]];
+      const ActorOutput& target = demo.actor_output;
+      for (int h = 0; h < kActionSize; ++h) {
+        float diff = outputs[n][h] - target[h];
+        action_diff[actions_blob->offset(n,h,0,0)] = diff / minibatch_size_;
+        loss += 0.5 * diff * diff;
       }
-      if (diff < 0) {
-        diff *= (max - output) / (max - min);
-      } else if (diff > 0) {
-        diff *= (output - min) / (max - min);
+      // Only the parameters of the demonstrated action are supervised
+      for (int arg = 0; arg < 2; ++arg) {
+        int h = GetParamOffset(demo.action, arg);
+        if (h < 0) {
+          continue;
+        }
+        float diff = (outputs[n][kActionSize + h] - target[kActionSize + h])
+            / kParamRange[h];
+        param_diff[action_params_blob->offset(n,h,0,0)] =
+            diff / (kParamRange[h] * minibatch_size_);
+        loss += 0.5 * diff * diff;
       }
-      param_diff[offset] = diff;
+      correct += GetAction(outputs[n]).action == demo.action;
+    }
+    ZeroGradParameters(*actor_net_);
+    actor_net_->BackwardFrom(GetLayerIndex(*actor_net_, "actionpara_layer"));
+    actor_solver_->ApplyUpdate();
+    actor_solver_->set_iter(actor_solver_->iter() + 1);
+    smoothed_loss += loss / minibatch_size_ / FLAGS_loss_display_iter;
+    smoothed_accuracy += float(correct) / minibatch_size_ / FLAGS_loss_display_iter;
+    if (iter % FLAGS_loss_display_iter == 0) {
+      LOG(INFO) << "[Agent" << tid_ << "] Pretrain Iteration " << iter
+                << ", loss = " << smoothed_loss
+                << ", action_accuracy = " << smoothed_accuracy;
+      smoothed_loss = smoothed_accuracy = 0;
     }
   }
+  CloneNet(actor_net_, actor_target_net_);
+}
+
+void ActionParamBounds(int h, float* min, float* max) {
+  if (h == 0 || h == 4) {
+    *min = 0; *max = 100;
+  } else {
+    *min = -180; *max = 180;
+  }
+}
+
+void InvertGradients(const float* actions, const float* action_params,
+                     float* action_diff, float* param_diff) {
+  for (int h = 0; h < kActionSize; ++h) {
+    float diff = action_diff[h];
+    float output = actions[h];
+    float min = -1.0; float max = 1.0;
+    if (diff < 0) {
+      diff *= (max - output) / (max - min);
+    } else if (diff > 0) {
+      diff *= (output - min) / (max - min);
+    }
+    action_diff[h] = diff;
+  }
+  for (int h = 0; h < kActionParamSize; ++h) {
+    float diff = param_diff[h];
+    float output = action_params[h];
+    float min, max;
+    ActionParamBounds(h, &min, &max);
+    if (diff < 0) {
+      diff *= (max - output) / (max - min);
+    } else if (diff > 0) {
+      diff *= (output - min) / (max - min);
+    }
+    param_diff[h] = diff;
+  }
+}
+void DQN::UpdateActor(const std::vector<ActorOutput>& actor_output_batch) {
+  const auto actions_blob = actor_net_->blob_by_name(actions_blob_name);
+  const auto action_params_blob = actor_net_->blob_by_name(action_params_blob_name);
+  float* action_diff = actions_blob->mutable_cpu_diff();
+  float* param_diff = action_params_blob->mutable_cpu_diff();
+  DLOG(INFO) << "Diff: " << PrintActorOutput(action_diff, param_diff);
+  for (int n = 0; n < minibatch_size_; ++n) {
+    InvertGradients(actor_output_batch[n].data(),
+                    actor_output_batch[n].data() + kActionSize,
+                    action_diff + actions_blob->offset(n),
+                    param_diff + action_params_blob->offset(n));
+  }
   DLOG(INFO) << "Diff2 " << PrintActorOutput(action_diff, param_diff);
-  // Transfer input-level diffs from Critic to Actor
-  actor_actions_blob->ShareDiff(*critic_action_blob);
-  actor_action_params_blob->ShareDiff(*critic_action_params_blob);
+  ZeroGradParameters(*actor_net_);
   DLOG(INFO) << " [Backwards] " << actor_net_->name();
   actor_net_->BackwardFrom(GetLayerIndex(*actor_net_, "actionpara_layer"));
-  actor_solver_->ApplyUpdate();
-  actor_solver_->set_iter(actor_solver_->iter() + 1);
-  // Soft update the target networks
-  if (max_iter() % FLAGS_soft_update_freq == 0) {
-    SoftUpdateNet(critic_net_, critic_target_net_, FLAGS_tau);
-    SoftUpdateNet(actor_net_, actor_target_net_, FLAGS_tau);
+  if (CanFuseAdamStep(*actor_solver_)) {
+    FusedAdamStep(*actor_solver_);
+  } else {
+    actor_solver_->ApplyUpdate();
   }
-  return std::make_pair(critic_loss, avg_q);
+  actor_solver_->set_iter(actor_solver_->iter() + 1);
 }
 
-std::vector<float> DQN::CriticForwardThroughActor(
-    caffe::Net<float>& critic, caffe::Net<float>& actor,
-    const std::vector<InputStates>& states_batch) {
-  DLOG(INFO) << " [Forward] " << critic.name() << " Through " << actor_net_->name();
-  return CriticForward(critic, states_batch,
-                       SelectActionGreedily(actor, states_batch));
+std::vector<float> DQN::CriticForward(caffe::Net<float>& critic,
+                                      const std::vector<InputStates>& states_batch,
+                                      const std::vector<ActorOutput>& action_batch) {
+  std::vector<float> states_input(state_input_data_size_, 0.0f);
+  PackStates(states_batch, states_input);
+  return CriticForward(critic, states_input, action_batch);
 }
 
 std::vector<float> DQN::CriticForward(caffe::Net<float>& critic,
-                                      const std::vector<InputStates>& states_batch,
+                                      std::vector<float>& states_input,
                                       const std::vector<ActorOutput>& action_batch) {
+  const std::vector<float> heads_q_values =
+      CriticHeadsForward(critic, states_input, action_batch);
+  const int heads = heads_q_values.size() / std::max<int>(action_batch.size(), 1);
+  std::vector<float> q_values(action_batch.size());
+  for (int n = 0; n < action_batch.size(); ++n) {
+    const float* q = heads_q_values.data() + n * heads;
+    q_values[n] = std::accumulate(q, q + heads, 0.0f) / heads;
+  }
+  return q_values;
+}
+
+std::vector<float> DQN::CriticHeadsForward(caffe::Net<float>& critic,
+                                           std::vector<float>& states_input,
+                                           const std::vector<ActorOutput>& action_batch) {
   DLOG(INFO) << "  [Forward] " << critic.name();
   CHECK(critic.has_blob(states_blob_name));
   CHECK(critic.has_blob(actions_blob_name));
   CHECK(critic.has_blob(action_params_blob_name));
   CHECK(critic.has_blob(q_values_blob_name));
-  CHECK_LE(states_batch.size(), kMinibatchSize);
-  CHECK_EQ(states_batch.size(), action_batch.size());
-  const auto states_blob = critic.blob_by_name(states_blob_name);
+  CHECK_LE(action_batch.size(), minibatch_size_);
+  CHECK_EQ(states_input.size(), state_input_data_size_);
   const auto actions_blob = critic.blob_by_name(actions_blob_name);
   const auto action_params_blob = critic.blob_by_name(action_params_blob_name);
-  std::vector<float> states_input(state_input_data_size_, 0.0f);
-  std::vector<float> action_input(kActionInputDataSize, 0.0f);
-  std::vector<float> action_params_input(kActionParamsInputDataSize, 0.0f);
-  std::vector<float> target_input(kTargetInputDataSize, 0.0f);
-  for (int n = 0; n < states_batch.size(); ++n) {
-    for (int c = 0; c < kStateInputCount; ++c) {
-      const auto& state_data = states_batch[n][c];
-      std::copy(state_data->begin(), state_data->end(),
-                states_input.begin() + states_blob->offset(n,c,0,0));
-    }
+  std::vector<float> action_input(minibatch_size_ * kActionSize, 0.0f);
+  std::vector<float> action_params_input(minibatch_size_ * kActionParamSize, 0.0f);
+  std::vector<float> target_input(minibatch_size_, 0.0f);
+  for (int n = 0; n < action_batch.size(); ++n) {
     const ActorOutput& actor_output = action_batch[n];
     std::copy(actor_output.begin(), actor_output.begin() + kActionSize,
               action_input.begin() + actions_blob->offset(n,0,0,0));
@@ -1012,11 +1941,9 @@ std::vector<float> DQN::CriticForward(caffe::Net<float>& critic,
                       action_params_input.data(), target_input.data(), NULL);
   critic.ForwardPrefilled(nullptr);
   const auto q_values_blob = critic.blob_by_name(q_values_blob_name);
-  std::vector<float> q_values(states_batch.size());
-  for (int n = 0; n < states_batch.size(); ++n) {
-    q_values[n] = q_values_blob->data_at(n,0,0,0);
-  }
-  return q_values;
+  const float* q_values = q_values_blob->cpu_data();
+  return std::vector<float>(q_values, q_values + action_batch.size() *
+                            q_values_blob->count(1));
 }
 
 void DQN::CloneNet(NetSp& net_from, NetSp& net_to) {
@@ -1048,6 +1975,12 @@ void DQN::ShareLayer(caffe::Layer<float>& param_owner,
 void DQN::ShareParameters(DQN& other,
                           int num_actor_layers_to_share,
                           int num_critic_layers_to_share) {
+  CHECK(std::string(backend_->name()) == "caffe" &&
+        std::string(other.backend_->name()) == "caffe")
+      << "Only the caffe backend shares layers";
+  // Each agent's states would be scaled by its own statistics
+  CHECK(!state_normalizer_ && !other.state_normalizer_)
+      << "Layers fed normalized states cannot be shared";
   auto& actor_layers = actor_net_->layers();
   auto& other_actor_layers = other.actor_net_->layers();
   auto& critic_layers = critic_net_->layers();
@@ -1082,6 +2015,23 @@ void DQN::ShareReplayMemory(DQN& other) {
   other.replay_memory_ = replay_memory_;
 }
 
+void DQN::LogMemoryPlacement() {
+  auto net_node = [](const NetSp& net) {
+    return NumaNodeOfAddress(net->params().front()->cpu_data());
+  };
+  int memory_node = -1;
+  if (shared_memory_ && shared_memory_->size() > 0) {
+    memory_node = NumaNodeOfAddress(shared_memory_->state(0));
+  } else if (!replay_memory_->empty()) {
+    memory_node = NumaNodeOfAddress(std::get<0>(replay_memory_->back())->data());
+  }
+  LOG(INFO) << "[Agent" << tid_ << "] NUMA placement: actor = "
+            << net_node(actor_net_) << ", critic = " << net_node(critic_net_)
+            << ", actor_target = " << net_node(actor_target_net_)
+            << ", critic_target = " << net_node(critic_target_net_)
+            << ", replay_memory = " << memory_node << " (-1 = not yet allocated)";
+}
+
 void DQN::SoftUpdateNet(NetSp& net_from, NetSp& net_to, float tau) {
   // TODO: Test if learnable_params() is sufficient for soft update
   const auto& from_params = net_from->params();
@@ -1154,14 +2104,7 @@ void DQN::SnapshotReplayMemory(const std::string& filename) {
   int episodes = 0;
   bool terminal = true;
   for (const Transition& t : (*replay_memory_)) {
-    const InputStates& states = std::get<0>(t);
-    if (terminal) { // Save the history of states
-      for (int i = 0; i < kStateInputCount - 1; ++i) {
-        const StateDataSp state = states[i];
-        out.write((char*)state->data(), state_size_ * sizeof(float));
-      }
-    }
-    const StateDataSp curr_state = states.back();
+    const StateDataSp& curr_state = std::get<0>(t);
     out.write((char*)curr_state->data(), state_size_ * sizeof(float));
     const ActorOutput& actor_output = std::get<1>(t);
     out.write((char*)&actor_output, sizeof(ActorOutput));
@@ -1189,28 +2132,14 @@ void DQN::LoadReplayMemory(const std::string& filename) {
   int num_transitions;
   in.read((char*)&num_transitions, sizeof(int));
   replay_memory_->resize(num_transitions);
-  std::deque<dqn::StateDataSp> past_states;
+  const bool rebuild_stats = state_normalizer_ && state_normalizer_->count() == 0;
   int episodes = 0;
   bool terminal = true;
   for (int i = 0; i < num_transitions; ++i) {
     Transition& t = (*replay_memory_)[i];
-    if (terminal) {
-      past_states.clear();
-      for (int i = 0; i < kStateInputCount - 1; ++i) {
-        StateDataSp state = std::make_shared<StateData>(state_size_);
-        in.read((char*)state->data(), state_size_ * sizeof(float));
-        past_states.push_back(state);
-      }
-    }
-    StateDataSp state = std::make_shared<StateData>(state_size_);
+    StateDataSp state = AllocateState(state_size_);
     in.read((char*)state->data(), state_size_ * sizeof(float));
-    past_states.push_back(state);
-    while (past_states.size() > kStateInputCount) {
-      past_states.pop_front();
-    }
-    CHECK_EQ(past_states.size(), kStateInputCount);
-    InputStates& states = std::get<0>(t);
-    std::copy(past_states.begin(), past_states.end(), states.begin());
+    std::get<0>(t) = state;
     in.read((char*)&std::get<1>(t), sizeof(ActorOutput));
     in.read((char*)&std::get<2>(t), sizeof(float));
     in.read((char*)&std::get<3>(t), sizeof(float));
@@ -1220,9 +2149,24 @@ void DQN::LoadReplayMemory(const std::string& filename) {
     }
     in.read((char*)&terminal, sizeof(bool));
     if (terminal) { episodes++; };
+    // Unless restored with the actor, the statistics are those of the memory
+    if (rebuild_stats) {
+      state_normalizer_->Add(state->data());
+    }
+  }
+  if (rebuild_stats) {
+    state_normalizer_->Flush();
   }
   LOG(INFO) << "replay_mem_size = " << memory_size() << " with "
             << episodes << " episodes";
 }
 
+void DQN::AttachSharedReplayMemory(const std::string& name,
+                                   const std::string& filename) {
+  ClearReplayMemory();
+  shared_memory_.reset(new SharedReplayMemory(name, filename, state_size_));
+  LOG(INFO) << "[Agent" << tid_ << "] Sampling from shared replay memory "
+            << name << " of size " << memory_size();
+}
+
 } // namespace dqn
@@ -1,6 +1,7 @@
 #ifndef DQN_HPP_
 #define DQN_HPP_
 
+#include <algorithm>
 #include <memory>
 #include <random>
 #include <tuple>
@@ -12,10 +13,13 @@
 #include <boost/optional.hpp>
 #include <mutex>
 #include "hfo_game.hpp"
+#include "state_layout.hpp"
+#include "state_normalizer.hpp"
+#include "state_pool.hpp"
+#include "random.hpp"
 
 namespace dqn {
 
-constexpr auto kStateInputCount = 1;
 constexpr auto kMinibatchSize = 32;
 constexpr auto kActionSize = 4;
 constexpr auto kActionParamSize = 6;
@@ -26,11 +30,35 @@ constexpr auto kTargetInputDataSize = kMinibatchSize * kActionSize;
 constexpr auto kFilterInputDataSize = kMinibatchSize * kActionSize;
 
 using ActorOutput = std::array<float, kActionSize + kActionParamSize>;
-using StateData   = std::vector<float>;
-using StateDataSp = std::shared_ptr<StateData>;
-using InputStates = std::array<StateDataSp, kStateInputCount>;
-using Transition  = std::tuple<InputStates, ActorOutput, float,
+// The last frames() states, oldest first
+using InputStates = std::vector<StateDataSp>;
+// Replay memory holds one state per transition. Stacks of frames are
+// assembled from the preceding transitions of the same episode.
+using Transition  = std::tuple<StateDataSp, ActorOutput, float,
                                float, boost::optional<StateDataSp>>;
+// A demonstrated action and the states it was chosen in. The actor
+// output is the one GetActorOutput makes for the action.
+struct Demonstration {
+  InputStates states;
+  hfo::action_t action;
+  ActorOutput actor_output;
+};
+
+// A sampled minibatch gathered into the layouts of the critic's input
+// blobs. Everything that does not need the nets, so it can be
+// prepared off the learner thread.
+struct Minibatch {
+  std::vector<int> transitions;
+  std::vector<float> states_input;
+  std::vector<float> next_states_input; // Of non-terminal transitions only
+  int num_next_states;
+  std::vector<float> action_input;
+  std::vector<float> action_params_input;
+  std::vector<float> rewards; // n-step discounted
+  std::vector<float> on_policy_targets;
+  std::vector<float> bootstrap_discounts; // Of the next state's q-value
+  std::vector<bool> terminal;
+};
 using SolverSp    = std::shared_ptr<caffe::Solver<float>>;
 using NetSp       = boost::shared_ptr<caffe::Net<float>>;
 
@@ -50,18 +78,69 @@ constexpr auto filter_blob_name        = "filter";
 constexpr auto q_values_blob_name      = "q_values";
 constexpr auto loss_blob_name          = "loss";
 
+class SharedReplayMemory;
+class CentralCritic;
+class ComputeBackend;
+
+// How minibatch indices are drawn from replay memory. SORTED draws
+// uniformly but gathers in memory order. BLOCKS draws a few contiguous
+// runs, trading sample independence for far fewer cache and TLB misses.
+enum SamplingMode { UNIFORM_SAMPLING, SORTED_SAMPLING, BLOCK_SAMPLING };
+SamplingMode ParseSamplingMode(const std::string& mode);
+std::string SamplingModeName(SamplingMode mode);
+
+// Returns the index of the layer matching the given layer_name or -1
+// if no such layer exists.
+template <typename Dtype>
+int GetLayerIndex(caffe::Net<Dtype>& net, const std::string& layer_name) {
+  if (!net.has_layer(layer_name)) {
+    return -1;
+  }
+  const std::vector<std::string>& layer_names = net.layer_names();
+  int indx = std::distance(
+      layer_names.begin(),
+      std::find(layer_names.begin(), layer_names.end(), layer_name));
+  return indx;
+}
+
+// Zeros the gradients accumulated by each forward/backward pass.
+template <typename Dtype>
+void ZeroGradParameters(caffe::Net<Dtype>& net) {
+  for (int i = 0; i < net.params().size(); ++i) {
+    caffe::shared_ptr<caffe::Blob<Dtype> > blob = net.params()[i];
+    switch (caffe::Caffe::mode()) {
+      case caffe::Caffe::CPU:
+        caffe::caffe_set(blob->count(), static_cast<Dtype>(0),
+                         blob->mutable_cpu_diff());
+        break;
+      case caffe::Caffe::GPU:
+        caffe::caffe_gpu_set(blob->count(), static_cast<Dtype>(0),
+                             blob->mutable_gpu_diff());
+        break;
+    }
+  }
+}
+
 /**
  * Deep Q-Network
  */
 class DQN {
+  friend class CentralCritic;
+  friend class CaffeBackend;
 public:
   DQN(caffe::SolverParameter& actor_solver_param,
       caffe::SolverParameter& critic_solver_param,
       std::string save_path, int state_size, int tid);
   ~DQN();
 
-  // Benchmark the speed of updates
+  // Benchmark the speed of updates with each backend on the same
+  // minibatches from the same nets, checking that their updates match
+  // Caffe's. Leaves the nets and solvers as they were.
   void Benchmark(int iterations=1000);
+  // Benchmark gathering minibatch states with every sampling mode from
+  // synthetic replay memories of the given sizes. Clears the replay memory.
+  void BenchmarkGather(const std::vector<int>& memory_sizes,
+                       int iterations=10000);
 
   // Loading methods
   void RestoreActorSolver(const std::string& actor_solver);
@@ -69,22 +148,34 @@ public:
   void LoadActorWeights(const std::string& actor_model_file);
   void LoadCriticWeights(const std::string& critic_weights);
   void LoadReplayMemory(const std::string& filename);
+  // Sample from a read-only replay memory held in the named POSIX
+  // shared memory segment. If no other process has created it yet,
+  // it is loaded from filename first.
+  void AttachSharedReplayMemory(const std::string& name,
+                                const std::string& filename);
 
   // Snapshot the model/solver/replay memory. Produces files:
   // snapshot_prefix_iter_N.[caffemodel|solverstate|replaymem]. Optionally
-  // removes snapshots with same prefix but lower iteration.
+  // removes snapshots with same prefix but lower iteration. Agents
+  // trained by a central critic snapshot only their actors.
   void Snapshot();
   void Snapshot(const std::string& snapshot_prefix, bool remove_old=false,
-                bool snapshot_memory=true);
+                bool snapshot_memory=true, bool snapshot_critic=true);
 
   ActorOutput GetRandomActorOutput();
+  // Splits an independent stream off this agent's random engine
+  Rng SplitRng() { return random_engine.Split(); }
 
-  // Select an action using epsilon-greedy action selection.
-  ActorOutput SelectAction(const InputStates& input_states, double epsilon);
+  // Select an action using epsilon-greedy action selection. With
+  // explore, as when playing to train, greedy actions may be replaced
+  // as -explore_uncertainty directs, and actions are random until
+  // there are input statistics.
+  ActorOutput SelectAction(const InputStates& input_states, double epsilon,
+                           bool explore=false);
 
   // Select a batch of actions using epsilon-greedy action selection.
   std::vector<ActorOutput> SelectActions(const std::vector<InputStates>& states_batch,
-                                         double epsilon);
+                                         double epsilon, bool explore=false);
 
   // Converts an ActorOutput into an action by samping over discrete actions
   Action SampleAction(const ActorOutput& actor_output);
@@ -94,22 +185,54 @@ public:
 
   // Add a transition to replay memory
   void AddTransition(const Transition& transition);
-  void AddTransitions(const std::vector<Transition>& transitions);
+  // Moves an episode into replay memory, evicting the oldest
+  // transitions in one go. transitions is left empty but keeps its
+  // capacity for the next episode.
+  void AddTransitions(std::vector<Transition>&& transitions);
+
+  // Trains the actor to imitate demonstrations with supervised
+  // updates. The iterations count as actor iterations.
+  void PretrainActor(const std::vector<Demonstration>& demonstrations,
+                     int iterations);
 
   // Computes a tabular Q-Value for each transition
   void LabelTransitions(std::vector<Transition>& transitions);
 
+  // Appends a transition of the episode being played to replay memory,
+  // evicting the oldest transition when full. With -beta 0 a streamed
+  // transition can be sampled once the rest of its n-step window has
+  // been streamed. Otherwise it waits for LabelStreamedEpisode to
+  // back-fill its on-policy target.
+  void StreamTransition(Transition&& transition);
+  // Labels the streamed episode, which must have ended, in place
+  void LabelStreamedEpisode();
+
   // Update the model(s)
   void Update();
+  // Same with a minibatch made by PrepareMinibatch
+  void Update(Minibatch& batch);
+
+  // Randomly sample the replay memory n times using rng, returning
+  // transition indexes. Safe to call from several threads as long as
+  // nothing is added to replay memory.
+  std::vector<int> SampleTransitionsFromMemory(int n, Rng& rng) const;
+  // Gathers the states, actions and rewards of minibatch_size()
+  // transitions into batch. Has the same thread safety.
+  void PrepareMinibatch(const std::vector<int>& transitions,
+                        Minibatch& batch) const;
 
   // Clear the replay memory
-  void ClearReplayMemory() { replay_memory_->clear(); }
+  void ClearReplayMemory() { replay_memory_->clear(); unlabeled_ = 0; }
 
   // Save the replay memory to a gzipped compressed file
   void SnapshotReplayMemory(const std::string& filename);
 
   // Get the current size of the replay memory
-  int memory_size() const { return replay_memory_->size(); }
+  int memory_size() const;
+  int memory_capacity() const { return replay_memory_capacity_; }
+  // Transitions that can be sampled: all but the streamed ones still
+  // waiting for their on-policy target or the rest of their n-step window
+  int sampleable_size() const;
 
   // Share the parameters in a layer. Owner keeps the params, slave loses them
   void ShareLayer(caffe::Layer<float>& param_owner,
@@ -123,15 +246,30 @@ public:
   // Free's the replay memory of other, which now points to our own replay mem
   void ShareReplayMemory(DQN& other);
 
+  // Logs the NUMA node holding the nets and the replay memory
+  void LogMemoryPlacement();
+
   // Return the current iteration of the solvers
   int min_iter() const { return std::min(actor_iter(), critic_iter()); }
   int max_iter() const { return std::max(actor_iter(), critic_iter()); }
   int critic_iter() const { return critic_solver_->iter(); }
   int actor_iter() const { return actor_solver_->iter(); }
   int state_size() const { return state_size_; }
+  int frames() const { return frames_; }
+  int minibatch_size() const { return minibatch_size_; }
+  int n_step() const { return n_step_; }
+  int critic_heads() const { return critic_heads_; }
+  // The actor is not updated until the critic's iteration passes
+  // critic_warmup, so a pretrained actor follows a trained critic
+  int critic_warmup() const { return critic_warmup_; }
+  void set_critic_warmup(int critic_warmup) { critic_warmup_ = critic_warmup; }
   const std::string& save_path() const { return save_path_; }
   int unum() const { return unum_; }
   void set_unum(int unum) { unum_ = unum; }
+  // With -normalize_states, whether the input statistics are frozen, as
+  // they are for evaluation
+  bool state_stats_frozen() const;
+  void set_state_stats_frozen(bool frozen);
 
 protected:
   // Initialize DQN. Called by the constructor
@@ -139,17 +277,90 @@ protected:
 
   // Update both the actor and critic.
   std::pair<float, float> UpdateActorCritic();
+  std::pair<float, float> UpdateActorCritic(Minibatch& batch);
+  // Same with the given backend
+  std::pair<float, float> UpdateActorCritic(ComputeBackend& backend,
+                                            Minibatch& batch);
+  // Fills candidates - 1 copies of the batch target actions and params
+  // following them with clipped gaussian noise (FLAGS_target_noise)
+  void SmoothTargetActions(int batch, int candidates, float* actions,
+                           float* action_params);
+  float SmoothedOutput(float output, float min, float max);
+  // Imports the Caffe nets and solvers into backend_ if they changed
+  // since, and exports them back if backend_ updated since
+  void SyncBackend();
+  void SyncCaffe();
+  // The data of the parameters of the four nets and the optimizer
+  // state of the solvers
+  std::vector<caffe::Blob<float>*> StateBlobs();
+  // Times Caffe's Adam step of solver against FusedAdamStep on the same
+  // gradients and checks they agree. Leaves the solver as it was.
+  void BenchmarkAdamStep(caffe::Solver<float>& solver, int iterations);
+  // Checks the target q-values backend gives noisy copies of the target
+  // actions of batch against the generic per-candidate forwards
+  void CheckCriticForwardActions(ComputeBackend& backend,
+                                 const std::string& name, Minibatch& batch);
 
   // Randomly sample the replay memory n-times, returning transition indexes
   std::vector<int> SampleTransitionsFromMemory(int n);
   // Randomly sample the replay memory n-times returning input_states
   std::vector<InputStates> SampleStatesFromMemory(int n);
+  // Index of the first transition of the episode containing idx,
+  // looking back at most max_lookback transitions
+  int EpisodeStart(int idx, int max_lookback) const;
+  // Returns frame c of the stacked state of transition idx, pointing
+  // into replay storage. Stacks reaching before the episode repeat
+  // its first state.
+  const float* StateAt(int idx, int c) const;
+  // Same for the next states of non-terminal transition idx
+  const float* NextStateAt(int idx, int c) const;
+  // Reads the fields of transition idx other than its states
+  void GetTransitionInfo(int idx, ActorOutput& actor_output, float& reward,
+                         float& on_policy_target, bool& terminal) const;
+  // Replaces reward with the discounted reward of up to n_step_
+  // transitions starting at idx. Needs only their rewards, so it works
+  // on streamed transitions not yet labeled. Returns the last
+  // transition summed, whose next state the target bootstraps from
+  // unless terminal is set.
+  int NStepTransition(int idx, float& reward, bool& terminal) const;
+  // Gathers the (next) states of the given transitions straight from
+  // replay storage into the layout of a states input blob.
+  void GatherStates(const std::vector<int>& transitions, bool next_states,
+                    std::vector<float>& states_input) const;
+  // Writes count states into consecutive rows of a states input,
+  // normalized with -normalize_states. States a few rows ahead are
+  // prefetched.
+  void CopyInputStates(const float* const* states, int count, float* input) const;
+  // Adds a state entering replay memory to the input statistics
+  void ObserveState(const StateDataSp& state) {
+    if (state_normalizer_) {
+      state_normalizer_->Add(state->data());
+    }
+  }
+  // Merges the states staged since the last episode into the input
+  // statistics
+  void FlushStateStats() {
+    if (state_normalizer_) {
+      state_normalizer_->Flush();
+    }
+  }
+  // Loads the input statistics saved along the actor snapshot or
+  // weights actor_file, if any
+  void LoadStateStats(const std::string& actor_file);
+  // Packs a batch of input states into the layout of a states blob
+  void PackStates(const std::vector<InputStates>& states_batch,
+                  std::vector<float>& states_input) const;
+
+  // Scales the critic's gradients w.r.t. the actions (already in the
+  // diffs of the actor's output blobs) to respect the action bounds,
+  // then backpropagates them through the actor and updates it.
+  void UpdateActor(const std::vector<ActorOutput>& actor_output_batch);
 
   // Clone the network and store the result in clone_net_
-  void CloneNet(NetSp& net_from, NetSp& net_to);
+  static void CloneNet(NetSp& net_from, NetSp& net_to);
   // Update the parameters of net_to towards net_from.
   // net_to = tau * net_from + (1 - tau) * net_to
-  void SoftUpdateNet(NetSp& net_from, NetSp& net_to, float tau);
+  static void SoftUpdateNet(NetSp& net_from, NetSp& net_to, float tau);
 
   // Given input states, use the actor network to select an action.
   ActorOutput SelectActionGreedily(caffe::Net<float>& actor,
@@ -159,56 +370,111 @@ protected:
   std::vector<ActorOutput> SelectActionGreedily(
       caffe::Net<float>& actor,
       const std::vector<InputStates>& states_batch);
-
-  // Runs forward on critic to produce q-values. Actions inferred by actor.
-  std::vector<float> CriticForwardThroughActor(
-      caffe::Net<float>& critic, caffe::Net<float>& actor,
-      const std::vector<InputStates>& states_batch);
+  // Same for batch_size states already packed by PackStates/GatherStates
+  std::vector<ActorOutput> SelectActionGreedily(
+      caffe::Net<float>& actor, std::vector<float>& states_input,
+      int batch_size);
 
   // Runs forward on critic to produce q-values.
   std::vector<float> CriticForward(caffe::Net<float>& critic,
                                    const std::vector<InputStates>& states_batch,
                                    const std::vector<ActorOutput>& action_batch);
+  // Same for states already packed by PackStates/GatherStates
+  std::vector<float> CriticForward(caffe::Net<float>& critic,
+                                   std::vector<float>& states_input,
+                                   const std::vector<ActorOutput>& action_batch);
+  // The q-values of every head of the critic, a row per action. Those
+  // of CriticForward are the means of the rows.
+  std::vector<float> CriticHeadsForward(caffe::Net<float>& critic,
+                                        std::vector<float>& states_input,
+                                        const std::vector<ActorOutput>& action_batch);
+  // Replaces each greedy action by the candidate of highest upper
+  // confidence bound (mean + FLAGS_explore_uncertainty * std of the
+  // critic heads) among it and random actions, scored in one forward
+  std::vector<ActorOutput> ExploreUncertainActions(
+      const std::vector<InputStates>& states_batch,
+      const std::vector<ActorOutput>& greedy_actions);
 
   // Input data into the State/Target/Filter layers of the given
   // net. This must be done before forward is called.
-  void InputDataIntoLayers(caffe::Net<float>& net,
-                           float* states_input,
-                           float* actions_input,
-                           float* action_params_input,
-                           float* target_input,
-                           float* filter_input);
+  static void InputDataIntoLayers(caffe::Net<float>& net,
+                                  float* states_input,
+                                  float* actions_input,
+                                  float* action_params_input,
+                                  float* target_input,
+                                  float* filter_input);
 
 protected:
   caffe::SolverParameter actor_solver_param_;
   caffe::SolverParameter critic_solver_param_;
   const int replay_memory_capacity_;
   const double gamma_;
+  const int n_step_;
+  std::vector<double> discounts_; // gamma_^k for k in [0, n_step_]
+  int unlabeled_; // Streamed transitions at the back of replay_memory_
   std::shared_ptr<std::deque<Transition> > replay_memory_;
+  std::shared_ptr<SharedReplayMemory> shared_memory_; // Replaces replay_memory_
   SolverSp actor_solver_;
   NetSp actor_net_; // The actor network used for continuous action evaluation.
   SolverSp critic_solver_;
   NetSp critic_net_;  // The critic network used for giving q-value of a continuous action;
   NetSp critic_target_net_; // Clone of critic net. Used to generate targets.
   NetSp actor_target_net_; // Clone of the actor net. Used to generate targets.
-  std::mt19937 random_engine;
+  std::mutex actor_mutex_; // Held while actor_net_ runs. See CentralCritic.
+  std::unique_ptr<ComputeBackend> backend_; // Makes the updates
+  bool backend_stale_; // The Caffe nets changed since backend_ imported them
+  bool caffe_stale_;   // backend_ updated since it exported
+  Rng random_engine; // Stream tid_ of -seed
+  Minibatch minibatch_; // Reused by Update
+  SamplingMode sampling_mode_;
   float smoothed_critic_loss_, smoothed_actor_loss_;
   int last_snapshot_iter_;
   std::string save_path_;
   const int state_size_; // Number of state features
+  const int frames_; // Number of stacked states in network inputs
+  const int minibatch_size_;
   const int state_input_data_size_;
+  int critic_heads_; // q-value heads of the critic, read from its net
+  int critic_warmup_;
+  const StateOps state_ops_; // Copies specialized for state_size_
+  std::unique_ptr<StateNormalizer> state_normalizer_; // With -normalize_states
   int tid_;
   int unum_;
 };
 
-caffe::NetParameter CreateActorNet(int state_size);
-caffe::NetParameter CreateCriticNet(int state_size);
+// Nets take batch_size stacks of frames states of state_size features,
+// stacked along the feature axis.
+caffe::NetParameter CreateActorNet(int state_size, int frames=1,
+                                   int batch_size=kMinibatchSize);
+// A critic with num_agents > 1 takes the concatenated states and
+// actions of all agents. A critic with heads > 1 is an ensemble of
+// linear q-value heads on one tower, computed by a single inner product
+// layer. Each head is independently initialized and regressed on the
+// targets of its own bootstrap subsample (-head_bootstrap).
+// With encoder_layers > 0 the actions join after that many layers
+// seeing only the states.
+caffe::NetParameter CreateCriticNet(int state_size, int num_agents=1,
+                                    int frames=1,
+                                    int batch_size=kMinibatchSize,
+                                    int heads=1, int encoder_layers=0);
 
 /**
  * Converts an ActorOutput into an action by maxing over discrete actions
  */
 Action GetAction(const ActorOutput& actor_output);
 
+// The actor output that GetAction turns into action. Parameters of
+// other actions are zero.
+ActorOutput GetActorOutput(const Action& action);
+
+// Scales the critic's gradients w.r.t. the actions and params of an
+// actor output by the room left towards the bound they push to
+// (inverting gradients).
+void InvertGradients(const float* actions, const float* action_params,
+                     float* action_diff, float* param_diff);
+// The range the actor's action param h is kept in
+void ActionParamBounds(int h, float* min, float* max);
+
 /**
  * Returns a vector of filenames matching a given regular expression.
  */
@@ -223,6 +489,9 @@ void RemoveFilesMatchingRegexp(const std::string& regexp);
  */
 void RemoveSnapshots(const std::string& regexp, int min_iter);
 
+// Greatest iteration of the snapshots matching regexp, or -1
+int FindGreatestIter(const std::string& regexp);
+
 /**
  * Look for the latest snapshot to resume from. Returns a string
  * containing the path to the .solverstate. Returns empty string if
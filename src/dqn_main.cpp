@@ -4,9 +4,17 @@
 #include <gflags/gflags.h>
 #include "dqn.hpp"
 #include "hfo_game.hpp"
+#include "numa_placement.hpp"
+#include "central_critic.hpp"
+#include "scheduling.hpp"
+#include "memory_budget.hpp"
+#include "offline_trainer.hpp"
+#include "demonstrations.hpp"
+#include "hfo_records.hpp"
 #include <boost/filesystem.hpp>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <algorithm>
 #include <chrono>
 #include <limits>
@@ -17,7 +25,10 @@ using namespace hfo;
 
 DEFINE_bool(gpu, true, "Use GPU to brew Caffe");
 DEFINE_bool(benchmark, false, "Benchmark the network and exit");
-DEFINE_bool(learn_offline, false, "Just do updates on a fixed replaymemory.");
+DEFINE_string(benchmark_memory, "", "Comma separated replay memory sizes at "
+              "which -benchmark also times minibatch gathers.");
+DEFINE_bool(learn_offline, false, "Just do updates on a fixed replaymemory, "
+            "without starting an HFO server.");
 // Load/Save Args
 DEFINE_string(save, "", "Prefix for saving snapshots");
 DEFINE_string(resume, "", "Prefix for resuming from. Default=save_path");
@@ -26,6 +37,24 @@ DEFINE_string(critic_weights, "", "The critic pretrained weights load (*.caffemo
 DEFINE_string(actor_snapshot, "", "The actor solver state to load (*.solverstate).");
 DEFINE_string(critic_snapshot, "", "The critic solver state to load (*.solverstate).");
 DEFINE_string(memory_snapshot, "", "The replay memory to load (*.replaymemory).");
+DEFINE_string(memory_shm, "", "Name of a shared memory segment (e.g. /hfo_mem) "
+              "holding a read-only replay memory for -learn_offline. The first "
+              "process loads the replay memory into it, later ones attach. The loader "
+              "removes it on exit; a segment holding another -memory_snapshot "
+              "or left by a loader that died is loaded again.");
+DEFINE_string(pretrain_traces, "", "Comma separated traces of scripted agents. "
+              "A new actor is first trained to imitate them.");
+DEFINE_int32(pretrain_iter, 10000, "Supervised actor updates on -pretrain_traces.");
+DEFINE_string(record_traces, "", "Record the evaluation episodes of each agent in "
+              "[this]_agent[tid].trace.gz, in the format of -pretrain_traces. "
+              "E.g. with -evaluate, clones a trained actor into a new net.");
+DEFINE_int32(critic_warmup, 1000, "With -pretrain_traces, critic updates before "
+             "the pretrained actor is updated by the critic's gradients.");
+DEFINE_string(records, "", "Comma separated HFO recordings (files or directories "
+              "of them) loaded into a new replay memory.");
+DEFINE_int32(record_workers, 0, "Threads parsing -records. Default: one per core.");
+DEFINE_bool(convert_records, false, "Write the -records as a replay memory file "
+            "[save].replaymemory and exit.");
 // Solver Args
 DEFINE_string(solver, "Adam", "Solver Type.");
 DEFINE_double(momentum, .95, "Solver momentum.");
@@ -45,10 +74,14 @@ DEFINE_int32(evaluate_freq, 10000, "Frequency (steps) between evaluations");
 DEFINE_int32(repeat_games, 100, "Number of games played in evaluation mode");
 // Misc Args
 DEFINE_double(update_ratio, 0.1, "Ratio of new experiences to updates.");
+DEFINE_int32(cycle_ms, 100, "Server cycle length in ms. Steps where choosing "
+             "the action takes longer are counted as missed cycles.");
 // Sharing
 DEFINE_int32(share_actor_layers, 0, "Share layers between actor networks.");
 DEFINE_int32(share_critic_layers, 0, "Share layers between critic networks.");
 DEFINE_bool(share_replay_memory, false, "Shares replay memory between agents.");
+DEFINE_bool(central_critic, false, "Train one critic on the joint states and "
+            "actions of all offense agents instead of one critic per agent.");
 // Game configuration
 DEFINE_int32(offense_agents, 1, "Number of agents playing offense");
 DEFINE_int32(offense_npcs, 0, "Number of npcs playing offense");
@@ -58,10 +91,26 @@ DEFINE_int32(offense_dummies, 0, "Number of dummy npcs playing offense");
 DEFINE_int32(defense_dummies, 0, "Number of dummy npcs playing defense");
 DEFINE_int32(defense_chasers, 0, "Number of chasers playing defense");
 
+namespace dqn {
+DECLARE_int32(frames);
+DECLARE_int32(minibatch_size);
+DECLARE_int32(critic_heads);
+DECLARE_int32(critic_encoder_layers);
+}
+
 // Global Variables Shared Between Threads
 dqn::DQN* DQNS[12]; // Pointers to all DQNs. We will never have >12 players
+dqn::CentralCritic* CENTRAL = NULL; // Shared critic, owned by agent 0
+std::atomic<int> FINISHED(0); // Agents done playing with a central critic
+std::atomic<bool> SHARED(false); // Agent 0 has shared among all DQNs
 std::mutex MTX;
 
+// Online updates so far, the iteration of the exploration schedule.
+// Pretraining only advances the actors.
+int OnlineIter(const dqn::DQN& dqn) {
+  return FLAGS_central_critic ? CENTRAL->iter() : dqn.critic_iter();
+}
+
 double CalculateEpsilon(const int iter) {
   if (iter < FLAGS_explore) {
     return 1.0 - (1.0 - FLAGS_epsilon) * (static_cast<double>(iter) / FLAGS_explore);
@@ -70,6 +119,13 @@ double CalculateEpsilon(const int iter) {
   }
 }
 
+// Number of players on the field, which determines the state size
+int NumPlayers() {
+  return FLAGS_offense_agents + FLAGS_offense_npcs + FLAGS_offense_dummies
+      + FLAGS_defense_agents + FLAGS_defense_npcs + FLAGS_defense_dummies
+      + FLAGS_defense_chasers;
+}
+
 std::string GetArg(std::string input, int indx) {
   std::istringstream ss(input);
   std::string token;
@@ -92,64 +148,104 @@ void little_sleep(std::chrono::microseconds us) {
 }
 
 /**
- * Play one episode and return the total score and number of steps
+ * Play one episode and return the total score, number of steps and
+ * number of server cycles missed while choosing actions
  */
-std::tuple<double, int, status_t, double> PlayOneEpisode(HFOEnvironment& hfo,
-                                                         dqn::DQN& dqn,
-                                                         const double epsilon,
-                                                         const bool update,
-                                                         const int tid) {
-  std::vector<dqn::Transition> episode;
+std::tuple<double, int, status_t, double, int> PlayOneEpisode(
+    HFOEnvironment& hfo, dqn::DQN& dqn, const double epsilon,
+    const bool update, const int tid, dqn::TraceWriter* trace = NULL) {
+  // Every agent plays every HFO trial, so this counts the same trials
+  // in each thread. Used to pair up the episodes of a trial.
+  thread_local int trial = 0;
+  trial++;
+  // Reused across episodes so it stays sized for the longest episode
+  thread_local std::vector<dqn::Transition> episode;
+  episode.clear();
+  // Transitions go straight into an unshared replay memory and are
+  // labeled there once the episode ends. Shared and joint memories need
+  // each episode to arrive whole.
+  const bool stream = update && !FLAGS_central_critic &&
+      !FLAGS_share_replay_memory;
   HFOGameState game(dqn.unum());
   hfo.act(DASH, 0, 0);
   game.update(hfo);
   CHECK(!game.episode_over) << "Episode should not be over at beginning!";
-  std::deque<dqn::StateDataSp> past_states;
+  int missed_cycles = 0;
+  auto step_end = std::chrono::steady_clock::now();
+  dqn::InputStates input_states; // The last dqn.frames() states
+  dqn::StateDataSp current_state_sp; // The next state of the last step
   while (!game.episode_over) {
-    const std::vector<float>& current_state = hfo.getState();
-    CHECK_EQ(current_state.size(), dqn.state_size());
-    dqn::StateDataSp current_state_sp
-        = std::make_shared<dqn::StateData>(dqn.state_size());
-    std::copy(current_state.begin(), current_state.end(), current_state_sp->begin());
-    past_states.push_back(current_state_sp);
-    if (past_states.size() < dqn::kStateInputCount) {
-      hfo.act(DASH, 0, 0);
+    if (!current_state_sp) {
+      const std::vector<float>& current_state = hfo.getState();
+      CHECK_EQ(current_state.size(), dqn.state_size());
+      current_state_sp
+          = dqn::AllocateState(current_state.begin(), current_state.end());
+    }
+    if (input_states.empty()) {
+      // Like stacks sampled from replay, repeat the episode's first state
+      input_states.assign(dqn.frames(), current_state_sp);
     } else {
-      while (past_states.size() > dqn::kStateInputCount) {
-        past_states.pop_front();
-      }
-      dqn::InputStates input_states;
-      std::copy(past_states.begin(), past_states.end(), input_states.begin());
-      dqn::ActorOutput actor_output = dqn.SelectAction(input_states, epsilon);
-      VLOG(1) << "Step " << game.steps;
-      VLOG(1) << "Actor_output: " << dqn::PrintActorOutput(actor_output);
-      Action action = dqn::GetAction(actor_output);
-      VLOG(1) << "q_value: " << dqn.EvaluateAction(input_states, actor_output)
-              << " Action: " << hfo::ActionToString(action.action);
-      hfo.act(action.action, action.arg1, action.arg2);
-      game.update(hfo);
-      float reward = game.reward();
-      if (update) {
+      input_states.erase(input_states.begin());
+      input_states.push_back(current_state_sp);
+    }
+    // Only training episodes explore beyond epsilon
+    dqn::ActorOutput actor_output =
+        dqn.SelectAction(input_states, epsilon, update);
+    VLOG(1) << "Step " << game.steps;
+    VLOG(1) << "Actor_output: " << dqn::PrintActorOutput(actor_output);
+    Action action = dqn::GetAction(actor_output);
+    if (trace) {
+      trace->Step(current_state_sp->data(), dqn.state_size(), action);
+    }
+    VLOG(1) << "q_value: " << dqn.EvaluateAction(input_states, actor_output)
+            << " Action: " << hfo::ActionToString(action.action);
+    if (std::chrono::steady_clock::now() - step_end >
+        std::chrono::milliseconds(FLAGS_cycle_ms)) {
+      missed_cycles++;
+    }
+    hfo.act(action.action, action.arg1, action.arg2);
+    game.update(hfo);
+    step_end = std::chrono::steady_clock::now();
+    float reward = game.reward();
+    // Replay holds one state per transition. The next state is the
+    // state of the following transition.
+    if (update) {
+      boost::optional<dqn::StateDataSp> next_state_sp;
+      if (game.status == IN_GAME) {
         const std::vector<float>& next_state = hfo.getState();
         CHECK_EQ(next_state.size(), dqn.state_size());
-        dqn::StateDataSp next_state_sp
-            = std::make_shared<dqn::StateData>(dqn.state_size());
-        std::copy(next_state.begin(), next_state.end(), next_state_sp->begin());
-        const auto transition = (game.status == IN_GAME) ?
-            dqn::Transition(input_states, actor_output, reward, 0, next_state_sp):
-            dqn::Transition(input_states, actor_output, reward, 0, boost::none);
-        episode.push_back(transition);
+        next_state_sp = dqn::AllocateState(next_state.begin(), next_state.end());
+      }
+      dqn::Transition transition(std::move(current_state_sp), actor_output,
+                                 reward, 0, next_state_sp);
+      if (stream) {
+        dqn.StreamTransition(std::move(transition));
+      } else {
+        episode.push_back(std::move(transition));
       }
+      if (next_state_sp) {
+        current_state_sp = std::move(*next_state_sp);
+      }
+    } else {
+      current_state_sp.reset();
     }
   }
-  if (update) {
+  if (trace) {
+    trace->EndEpisode();
+  }
+  if (stream) {
+    dqn.LabelStreamedEpisode();
+  } else if (update && FLAGS_central_critic) {
+    dqn.LabelTransitions(episode);
+    CENTRAL->AddEpisode(tid, trial, std::move(episode));
+  } else if (update) {
     if (FLAGS_share_replay_memory) { MTX.lock(); }
     dqn.LabelTransitions(episode);
-    dqn.AddTransitions(episode);
+    dqn.AddTransitions(std::move(episode));
     if (FLAGS_share_replay_memory) { MTX.unlock(); }
   }
   return std::make_tuple(game.total_reward, game.steps, game.status,
-                         game.extrinsic_reward);
+                         game.extrinsic_reward, missed_cycles);
 }
 
 template <class T>
@@ -168,18 +264,25 @@ std::pair<double,double> get_avg_std(std::vector<T> data) {
 }
 
 
-double Evaluate(HFOEnvironment& hfo, dqn::DQN& dqn, int tid) {
+double Evaluate(HFOEnvironment& hfo, dqn::DQN& dqn, int tid,
+                dqn::TraceWriter* trace = NULL) {
   LOG(INFO) << "[Agent" << tid << "] Evaluating for " << FLAGS_repeat_games
             << " episodes with epsilon = " << FLAGS_evaluate_with_epsilon;
   std::vector<double> scores;
   std::vector<int> steps;
   std::vector<int> successful_trial_steps;
   int goals = 0;
+  int missed_cycles = 0;
+  // The policy is evaluated on the inputs it was trained on
+  const bool stats_frozen = dqn.state_stats_frozen();
+  dqn.set_state_stats_frozen(true);
   for (int i = 0; i < FLAGS_repeat_games; ++i) {
-    auto result = PlayOneEpisode(hfo, dqn, FLAGS_evaluate_with_epsilon, false, tid);
+    auto result = PlayOneEpisode(hfo, dqn, FLAGS_evaluate_with_epsilon, false, tid,
+                                 trace);
     double trial_reward = std::get<0>(result);
     int trial_steps = std::get<1>(result);
     status_t trial_status = std::get<2>(result);
+    missed_cycles += std::get<4>(result);
     scores.push_back(trial_reward);
     steps.push_back(trial_steps);
     if (trial_status == GOAL) {
@@ -187,6 +290,7 @@ double Evaluate(HFOEnvironment& hfo, dqn::DQN& dqn, int tid) {
       successful_trial_steps.push_back(trial_steps);
     }
   }
+  dqn.set_state_stats_frozen(stats_frozen);
   std::pair<double, double> score_dist = get_avg_std(scores);
   std::pair<double, double> steps_dist = get_avg_std(steps);
   std::pair<double, double> succ_steps_dist = get_avg_std(successful_trial_steps);
@@ -199,12 +303,27 @@ double Evaluate(HFOEnvironment& hfo, dqn::DQN& dqn, int tid) {
             << ", steps_std = " << steps_dist.second
             << ", success_steps = " << succ_steps_dist.first
             << ", success_std = " << succ_steps_dist.second
-            << ", goal_perc = " << goal_percent;
+            << ", goal_perc = " << goal_percent
+            << ", missed_cycles = " << missed_cycles;
   return goal_percent;
 }
 
-void KeepPlayingGames(int tid, std::string save_prefix, int port) {
-  LOG(INFO) << "Thread " << tid << ", port=" << port << ", save_prefix=" << save_prefix;
+// Creates the DQN of agent tid and loads its snapshots, weights and
+// replay memory. Also returns the critic's solver parameters.
+dqn::DQN* CreateDQN(int tid, const std::string& save_prefix,
+                    caffe::SolverParameter& critic_solver_param) {
+  if (dqn::NumaEnabled()) {
+    // Bind before anything is allocated so nets and memory are first
+    // touched on this agent's node
+    int node = dqn::NumaNodeForAgent(tid);
+    dqn::BindThreadToNumaNode(node);
+    LOG(INFO) << "[Agent" << tid << "] Running on NUMA " << dqn::DescribeNumaNode(node);
+  }
+  if (dqn::SchedulingEnabled()) {
+    LOG(INFO) << "[Agent" << tid << "] Scheduling: " << dqn::DescribeScheduling(tid);
+  } else {
+    LOG(INFO) << "[Agent" << tid << "] Scheduling: default";
+  }
   if (FLAGS_gpu) {
     caffe::Caffe::set_mode(caffe::Caffe::GPU);
   } else {
@@ -221,19 +340,16 @@ void KeepPlayingGames(int tid, std::string save_prefix, int port) {
   CHECK((FLAGS_critic_snapshot.empty() || FLAGS_critic_weights.empty()) &&
         (FLAGS_actor_snapshot.empty() || FLAGS_actor_weights.empty()))
       << "Give a snapshot or weights but not both.";
-  int num_players = FLAGS_offense_agents + FLAGS_offense_npcs
-      + FLAGS_offense_dummies + FLAGS_defense_agents + FLAGS_defense_npcs
-      + FLAGS_defense_dummies + FLAGS_defense_chasers;
-  int num_features = NumStateFeatures(num_players);
+  int num_features = NumStateFeatures(NumPlayers());
   // Construct the solver
   caffe::SolverParameter actor_solver_param;
-  caffe::SolverParameter critic_solver_param;
   caffe::NetParameter* actor_net_param = actor_solver_param.mutable_net_param();
   std::string actor_net_filename = save_prefix + "_actor.prototxt";
   if (boost::filesystem::is_regular_file(actor_net_filename)) {
     caffe::ReadProtoFromTextFileOrDie(actor_net_filename.c_str(), actor_net_param);
   } else {
-    actor_net_param->CopyFrom(dqn::CreateActorNet(num_features));
+    actor_net_param->CopyFrom(dqn::CreateActorNet(
+        num_features, dqn::FLAGS_frames, dqn::FLAGS_minibatch_size));
     WriteProtoToTextFile(*actor_net_param, actor_net_filename.c_str());
   }
   caffe::NetParameter* critic_net_param = critic_solver_param.mutable_net_param();
@@ -241,7 +357,9 @@ void KeepPlayingGames(int tid, std::string save_prefix, int port) {
   if (boost::filesystem::is_regular_file(critic_net_filename)) {
     caffe::ReadProtoFromTextFileOrDie(critic_net_filename.c_str(), critic_net_param);
   } else {
-    critic_net_param->CopyFrom(dqn::CreateCriticNet(num_features));
+    critic_net_param->CopyFrom(dqn::CreateCriticNet(
+        num_features, 1, dqn::FLAGS_frames, dqn::FLAGS_minibatch_size,
+        dqn::FLAGS_critic_heads, dqn::FLAGS_critic_encoder_layers));
     WriteProtoToTextFile(*critic_net_param, critic_net_filename.c_str());
   }
   actor_solver_param.set_snapshot_prefix((save_prefix + "_actor").c_str());
@@ -279,19 +397,64 @@ void KeepPlayingGames(int tid, std::string save_prefix, int port) {
   } else if (!GetArg(FLAGS_critic_weights, tid).empty()) {
     dqn->LoadCriticWeights(GetArg(FLAGS_critic_weights, 0));
   }
-  if (!last_memory_snapshot.empty()) {
+  if (!FLAGS_memory_shm.empty()) {
+    // Shared memories are never snapshotted, so the dataset is always
+    // the one given and attachers can check the segment holds it
+    dqn->AttachSharedReplayMemory(FLAGS_memory_shm,
+                                  GetArg(FLAGS_memory_snapshot, tid));
+  } else if (!last_memory_snapshot.empty()) {
     dqn->LoadReplayMemory(last_memory_snapshot);
   } else if (!GetArg(FLAGS_memory_snapshot, tid).empty()) {
     dqn->LoadReplayMemory(GetArg(FLAGS_memory_snapshot, tid));
   }
+  if (!FLAGS_records.empty() && FLAGS_memory_shm.empty() &&
+      last_memory_snapshot.empty()) {
+    std::vector<std::string> paths;
+    for (int i = 0; !GetArg(FLAGS_records, i).empty(); ++i) {
+      paths.push_back(GetArg(FLAGS_records, i));
+    }
+    int workers = FLAGS_record_workers > 0 ? FLAGS_record_workers :
+        std::thread::hardware_concurrency();
+    dqn::LoadRecordings(paths, *dqn, workers);
+  }
 
-  HFOEnvironment env;
-  ConnectToServer(env, port);
-  dqn->set_unum(env.getUnum());
+  if (dqn::NumaEnabled()) {
+    dqn->LogMemoryPlacement();
+  }
+  return dqn;
+}
 
-  // Wait for all DQNs to connect and be ready
+// Trains a new actor to imitate the -pretrain_traces
+void PretrainActor(int tid, dqn::DQN& dqn) {
+  std::vector<dqn::Demonstration> demonstrations;
+  for (int i = 0; !GetArg(FLAGS_pretrain_traces, i).empty(); ++i) {
+    std::vector<dqn::Demonstration> trace = dqn::LoadTrace(
+        GetArg(FLAGS_pretrain_traces, i), dqn.state_size(), dqn.frames());
+    demonstrations.insert(demonstrations.end(),
+                          std::make_move_iterator(trace.begin()),
+                          std::make_move_iterator(trace.end()));
+  }
+  dqn::SetThreadRole(tid, dqn::LEARNING);
+  dqn.PretrainActor(demonstrations, FLAGS_pretrain_iter);
+}
+
+// Writes the replay memory made from the -records to a file
+void ConvertRecords(const std::string& save_prefix) {
+  caffe::SolverParameter critic_solver_param;
+  dqn::DQN* dqn = CreateDQN(0, save_prefix, critic_solver_param);
+  std::string filename = save_prefix + ".replaymemory";
+  dqn->SnapshotReplayMemory(filename);
+  LOG(INFO) << "Converted records to " << filename;
+  delete dqn;
+}
+
+// Registers the DQN of agent tid and waits for those of all agents.
+// Agent 0 then shares layers, replay memory or a central critic among
+// them as the flags ask.
+void ShareAmongAgents(int tid, const std::string& save_prefix,
+                      const caffe::SolverParameter& critic_solver_param,
+                      dqn::DQN* dqn) {
   DQNS[tid] = dqn;
-  int target_id = tid == 0 ? 1 : 0;
   bool all_dqns_ready = false;
   while (!all_dqns_ready) {
     little_sleep(std::chrono::microseconds(100));
@@ -320,10 +483,60 @@ void KeepPlayingGames(int tid, std::string save_prefix, int port) {
         dqn->ShareReplayMemory(*teammate);
       }
     }
+    if (FLAGS_central_critic) {
+      caffe::SolverParameter central_solver_param(critic_solver_param);
+      central_solver_param.set_snapshot_prefix((save_prefix + "_central_critic").c_str());
+      CENTRAL = new dqn::CentralCritic(
+          central_solver_param,
+          std::vector<dqn::DQN*>(DQNS, DQNS + FLAGS_offense_agents));
+      CENTRAL->Restore((FLAGS_resume.empty() ? save_prefix : FLAGS_resume) +
+                       "_central_critic");
+    }
+    SHARED = true;
+  }
+  while (!SHARED) {
+    little_sleep(std::chrono::microseconds(100));
+  }
+}
+
+// Trains agent tid on its replay memory alone. The DQNs may share
+// layers or replay memory, so main frees them once all are done.
+void LearnOffline(int tid, std::string save_prefix) {
+  LOG(INFO) << "Thread " << tid << ", offline, save_prefix=" << save_prefix;
+  caffe::SolverParameter critic_solver_param;
+  dqn::DQN* dqn = CreateDQN(tid, save_prefix, critic_solver_param);
+  ShareAmongAgents(tid, save_prefix, critic_solver_param, dqn);
+  dqn::SetThreadRole(tid, dqn::LEARNING);
+  dqn::OfflineTrainer(*dqn, FLAGS_offense_agents).Train(FLAGS_max_iter);
+  dqn->Snapshot();
+}
+
+void KeepPlayingGames(int tid, std::string save_prefix, int port) {
+  LOG(INFO) << "Thread " << tid << ", port=" << port << ", save_prefix=" << save_prefix;
+  caffe::SolverParameter critic_solver_param;
+  dqn::DQN* dqn = CreateDQN(tid, save_prefix, critic_solver_param);
+  if (!FLAGS_pretrain_traces.empty() && !FLAGS_evaluate && dqn->actor_iter() == 0) {
+    // Before connecting, so the server is not kept waiting
+    PretrainActor(tid, *dqn);
+  }
+  if (!FLAGS_pretrain_traces.empty()) {
+    dqn->set_critic_warmup(FLAGS_critic_warmup);
+  }
+  HFOEnvironment env;
+  ConnectToServer(env, port);
+  dqn->set_unum(env.getUnum());
+
+  // Wait for all DQNs to connect and be ready
+  ShareAmongAgents(tid, save_prefix, critic_solver_param, dqn);
+  std::unique_ptr<dqn::TraceWriter> trace;
+  if (!FLAGS_record_traces.empty()) {
+    trace.reset(new dqn::TraceWriter(
+        FLAGS_record_traces + "_agent" + std::to_string(tid) + ".trace.gz"));
   }
 
   if (FLAGS_evaluate) {
-    Evaluate(env, *dqn, tid);
+    dqn::SetThreadRole(tid, dqn::ACTING);
+    Evaluate(env, *dqn, tid, trace.get());
     delete dqn;
     env.act(QUIT);
     env.step();
@@ -332,16 +545,13 @@ void KeepPlayingGames(int tid, std::string save_prefix, int port) {
   if (FLAGS_benchmark) {
     PlayOneEpisode(env, *dqn, FLAGS_evaluate_with_epsilon, true, tid);
     dqn->Benchmark(1000);
-    delete dqn;
-    env.act(QUIT);
-    env.step();
-    return;
-  }
-  if (FLAGS_learn_offline) {
-    while (dqn->max_iter() < FLAGS_max_iter) {
-      dqn->Update();
+    std::vector<int> memory_sizes;
+    for (int i = 0; !GetArg(FLAGS_benchmark_memory, i).empty(); ++i) {
+      memory_sizes.push_back(std::stoi(GetArg(FLAGS_benchmark_memory, i)));
+    }
+    if (!memory_sizes.empty()) {
+      dqn->BenchmarkGather(memory_sizes);
     }
-    dqn->Snapshot();
     delete dqn;
     env.act(QUIT);
     env.step();
@@ -350,19 +560,30 @@ void KeepPlayingGames(int tid, std::string save_prefix, int port) {
   int last_eval_iter = dqn->max_iter();
   double best_score = std::numeric_limits<double>::min();
   for (int episode = 0; dqn->max_iter() < FLAGS_max_iter; ++episode) {
-    double epsilon = CalculateEpsilon(dqn->max_iter());
+    double epsilon = CalculateEpsilon(OnlineIter(*dqn));
+    dqn::SetThreadRole(tid, dqn::ACTING);
     auto result = PlayOneEpisode(env, *dqn, epsilon, true, tid);
     LOG(INFO) << "[Agent" << tid <<"] Episode " << episode
-              << " reward = " << std::get<0>(result);
+              << " reward = " << std::get<0>(result)
+              << ", missed_cycles = " << std::get<4>(result);
     int steps = std::get<1>(result);
     int n_updates = int(steps * FLAGS_update_ratio);
-    if (FLAGS_share_replay_memory) { MTX.lock(); }
-    for (int i=0; i<n_updates; ++i) {
-      dqn->Update();
+    dqn::SetThreadRole(tid, dqn::LEARNING);
+    if (FLAGS_central_critic) {
+      // Agent 0 updates the central critic and every actor
+      for (int i=0; tid == 0 && i<n_updates; ++i) {
+        CENTRAL->Update();
+      }
+    } else {
+      if (FLAGS_share_replay_memory) { MTX.lock(); }
+      for (int i=0; i<n_updates; ++i) {
+        dqn->Update();
+      }
+      if (FLAGS_share_replay_memory) { MTX.unlock(); }
     }
-    if (FLAGS_share_replay_memory) { MTX.unlock(); }
     if (dqn->actor_iter() >= last_eval_iter + FLAGS_evaluate_freq) {
-      double avg_score = Evaluate(env, *dqn, tid);
+      dqn::SetThreadRole(tid, dqn::ACTING);
+      double avg_score = Evaluate(env, *dqn, tid, trace.get());
       if (avg_score > best_score) {
         LOG(INFO) << "[Agent " << tid << "] New High Score: " << avg_score
                   << ", actor_iter = " << dqn->actor_iter()
@@ -370,13 +591,33 @@ void KeepPlayingGames(int tid, std::string save_prefix, int port) {
         best_score = avg_score;
         dqn::RemoveFilesMatchingRegexp(dqn->save_path() + "_HiScore.*");
         std::string fname = dqn->save_path() + "_HiScore" + std::to_string(avg_score);
-        dqn->Snapshot(fname, false, false);
+        // The agent's own critic is unused with a central one, which
+        // resumes from its periodic snapshots instead
+        dqn->Snapshot(fname, false, false, !FLAGS_central_critic);
       }
       last_eval_iter = dqn->actor_iter();
     }
   }
-  dqn->Snapshot();
-  delete dqn;
+  if (FLAGS_central_critic) {
+    // Agent 0 updates every actor, so once all agents are done playing
+    // it snapshots and frees the central critic and every DQN
+    FINISHED++;
+    if (tid == 0) {
+      while (FINISHED < FLAGS_offense_agents) {
+        little_sleep(std::chrono::microseconds(100));
+      }
+      CENTRAL->Snapshot();
+      delete CENTRAL;
+      CENTRAL = NULL;
+      for (int i=0; i<FLAGS_offense_agents; ++i) {
+        delete DQNS[i];
+        DQNS[i] = NULL;
+      }
+    }
+  } else {
+    dqn->Snapshot();
+    delete dqn;
+  }
   env.act(QUIT);
   env.step();
 }
@@ -397,6 +638,15 @@ int main(int argc, char** argv) {
   if (FLAGS_evaluate) {
     google::LogToStderr();
   }
+  if (!FLAGS_memory_shm.empty() && !FLAGS_learn_offline) {
+    LOG(ERROR) << "Shared replay memory is read-only and requires -learn_offline.";
+    exit(1);
+  }
+  if (FLAGS_central_critic && FLAGS_learn_offline) {
+    LOG(ERROR) << "The central critic learns from joint episodes played online "
+               << "and does not support -learn_offline.";
+    exit(1);
+  }
   if (FLAGS_save.empty() && !FLAGS_evaluate) {
     LOG(ERROR) << "Save path (or evaluate) required but not set.";
     LOG(ERROR) << "Usage: " << gflags::ProgramUsage();
@@ -407,9 +657,42 @@ int main(int argc, char** argv) {
   google::SetLogDestination(google::GLOG_WARNING, (save_path.native() + "_WARNING_").c_str());
   google::SetLogDestination(google::GLOG_ERROR, (save_path.native() + "_ERROR_").c_str());
   google::SetLogDestination(google::GLOG_FATAL, (save_path.native() + "_FATAL_").c_str());
+  if (FLAGS_memory_shm.empty() && !FLAGS_evaluate) {
+    // Refuse to start rather than run out of memory days later
+    int state_size = NumStateFeatures(NumPlayers());
+    if (FLAGS_central_critic) {
+      size_t bytes = dqn::CentralCritic::JointTransitionBytes(
+          state_size, FLAGS_offense_agents);
+      dqn::CheckReplayBudget(dqn::ReplayCapacity(bytes) * bytes, 1);
+    } else {
+      int num_memories = FLAGS_share_replay_memory ? 1 : FLAGS_offense_agents;
+      size_t bytes = dqn::TransitionBytes(state_size);
+      dqn::CheckReplayBudget(
+          size_t(num_memories) * dqn::ReplayCapacity(bytes) * bytes, num_memories);
+    }
+  }
   for (int i=0; i<12; ++i) { // Make the global pointers all null
     DQNS[i] = NULL;
   }
+  if (FLAGS_convert_records) {
+    CHECK(!FLAGS_records.empty()) << "-convert_records needs -records.";
+    ConvertRecords(save_path.native());
+    return 0;
+  }
+  if (FLAGS_learn_offline) {
+    std::vector<std::thread> learners;
+    for (int i=0; i<FLAGS_offense_agents; ++i) {
+      std::string save_prefix = save_path.native() + "_agent" + std::to_string(i);
+      learners.emplace_back(LearnOffline, i, save_prefix);
+    }
+    for (std::thread& learner : learners) {
+      learner.join();
+    }
+    for (int i=0; i<FLAGS_offense_agents; ++i) {
+      delete DQNS[i];
+    }
+    return 0;
+  }
   srand(std::hash<std::string>()(save_path.native()));
   int port = rand() % 40000 + 20000;
   std::thread server_thread(
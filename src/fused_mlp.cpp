@@ -0,0 +1,683 @@
+#include "fused_mlp.hpp"
+#include "dqn.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <glog/logging.h>
+#ifdef __AVX512BF16__
+#include <immintrin.h>
+#endif
+
+namespace dqn {
+
+namespace {
+
+constexpr float kNegativeSlope = 0.01; // Of the towers' ReLU layers
+constexpr int kRowBlock = 4;           // Batch rows sharing each weight load
+constexpr int kInputBlock = 64;        // Weight rows per pass over the batch
+constexpr int kOutputBlock = 256;      // Output columns per pass
+constexpr int kLanes = 8;              // Partial sums of dot products
+
+// Weights are read as floats or as the upper halves of floats (bf16)
+inline float ToFloat(float w) { return w; }
+inline float ToFloat(uint16_t w) {
+  const uint32_t bits = uint32_t(w) << 16;
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// Rounds to the nearest bf16, ties to even
+inline uint16_t ToBf16(float f) {
+  uint32_t bits;
+  std::memcpy(&bits, &f, sizeof(bits));
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return bits >> 16;
+}
+
+// Two floats as a pair of bf16, lo in the lower half
+inline uint32_t ToBf16Pair(float lo, float hi) {
+  return uint32_t(ToBf16(hi)) << 16 | ToBf16(lo);
+}
+
+// Rounds n floats in place to the bf16 they would be stored as
+void RoundToBf16(float* __restrict__ x, int n) {
+  for (int i = 0; i < n; ++i) {
+    x[i] = ToFloat(ToBf16(x[i]));
+  }
+}
+
+// y = leaky_relu(x * wt + bias) for batch rows, or without the
+// activation if !relu. Blocks of weights stay in cache while every
+// batch row is run through them.
+template <typename W>
+void ForwardKernel(const float* __restrict__ x, int batch, int in, int out,
+                   const W* __restrict__ wt, const float* __restrict__ bias,
+                   bool relu, float* __restrict__ y) {
+  for (int b = 0; b < batch; ++b) {
+    std::copy(bias, bias + out, y + b * out);
+  }
+  for (int o0 = 0; o0 < out; o0 += kOutputBlock) {
+    const int no = std::min(kOutputBlock, out - o0);
+    for (int i0 = 0; i0 < in; i0 += kInputBlock) {
+      const int i1 = std::min(in, i0 + kInputBlock);
+      int b = 0;
+      for (; b + kRowBlock <= batch; b += kRowBlock) {
+        float* __restrict__ y0 = y + b * out + o0;
+        float* __restrict__ y1 = y0 + out;
+        float* __restrict__ y2 = y1 + out;
+        float* __restrict__ y3 = y2 + out;
+        const float* x0 = x + b * in;
+        for (int i = i0; i < i1; ++i) {
+          const W* __restrict__ w = wt + i * out + o0;
+          const float a0 = x0[i], a1 = x0[in + i];
+          const float a2 = x0[2 * in + i], a3 = x0[3 * in + i];
+          for (int o = 0; o < no; ++o) {
+            const float wo = ToFloat(w[o]);
+            y0[o] += a0 * wo;
+            y1[o] += a1 * wo;
+            y2[o] += a2 * wo;
+            y3[o] += a3 * wo;
+          }
+        }
+      }
+      for (; b < batch; ++b) {
+        float* __restrict__ y0 = y + b * out + o0;
+        for (int i = i0; i < i1; ++i) {
+          const W* __restrict__ w = wt + i * out + o0;
+          const float a0 = x[b * in + i];
+          for (int o = 0; o < no; ++o) {
+            y0[o] += a0 * ToFloat(w[o]);
+          }
+        }
+      }
+    }
+    if (relu) {
+      for (int b = 0; b < batch; ++b) {
+        float* __restrict__ y0 = y + b * out + o0;
+        for (int o = 0; o < no; ++o) {
+          y0[o] = y0[o] > 0 ? y0[o] : y0[o] * kNegativeSlope;
+        }
+      }
+    }
+  }
+}
+
+#ifdef __AVX512BF16__
+// ForwardKernel with vdpbf16ps, without bias if null. wp holds the
+// weights of input pairs as bf16 pairs (in/2 x out) and xp the input
+// pairs of each row (batch x in/2), so each instruction accumulates two
+// inputs into 16 outputs in fp32.
+void ForwardKernelBf16(const uint32_t* __restrict__ xp, int batch, int in_pairs,
+                       int out, const uint32_t* __restrict__ wp,
+                       const float* __restrict__ bias, bool relu,
+                       float* __restrict__ y) {
+  constexpr int kWidth = 16;
+  const int input_block = kInputBlock / 2;
+  for (int b = 0; b < batch; ++b) {
+    if (bias) {
+      std::copy(bias, bias + out, y + b * out);
+    } else {
+      std::fill(y + b * out, y + (b + 1) * out, 0.0f);
+    }
+  }
+  for (int o0 = 0; o0 < out; o0 += kOutputBlock) {
+    const int no = std::min(kOutputBlock, out - o0);
+    for (int p0 = 0; p0 < in_pairs; p0 += input_block) {
+      const int p1 = std::min(in_pairs, p0 + input_block);
+      for (int b = 0; b < batch; b += kRowBlock) {
+        const int rows = std::min(kRowBlock, batch - b);
+        for (int o = 0; o < no; o += kWidth) {
+          const __mmask16 mask = no - o >= kWidth ? 0xffff : (1 << (no - o)) - 1;
+          __m512 acc[kRowBlock];
+          for (int r = 0; r < rows; ++r) {
+            acc[r] = _mm512_maskz_loadu_ps(mask, y + (b + r) * out + o0 + o);
+          }
+          for (int p = p0; p < p1; ++p) {
+            const __m512bh w = (__m512bh) _mm512_maskz_loadu_epi32(
+                mask, wp + size_t(p) * out + o0 + o);
+            for (int r = 0; r < rows; ++r) {
+              const __m512bh x = (__m512bh) _mm512_set1_epi32(
+                  xp[(b + r) * in_pairs + p]);
+              acc[r] = _mm512_dpbf16_ps(acc[r], x, w);
+            }
+          }
+          for (int r = 0; r < rows; ++r) {
+            _mm512_mask_storeu_ps(y + (b + r) * out + o0 + o, mask, acc[r]);
+          }
+        }
+      }
+    }
+    if (relu) {
+      for (int b = 0; b < batch; ++b) {
+        float* __restrict__ y0 = y + b * out + o0;
+        for (int o = 0; o < no; ++o) {
+          y0[o] = y0[o] > 0 ? y0[o] : y0[o] * kNegativeSlope;
+        }
+      }
+    }
+  }
+}
+
+// Packs rows of in bf16-rounded floats into in_pairs pairs of bf16
+void PackBf16Pairs(const float* __restrict__ x, int batch, int in,
+                   uint32_t* __restrict__ xp) {
+  const int in_pairs = (in + 1) / 2;
+  for (int b = 0; b < batch; ++b) {
+    for (int p = 0; p < in_pairs; ++p) {
+      const int i = 2 * p;
+      xp[b * in_pairs + p] =
+          ToBf16Pair(x[b * in + i], i + 1 < in ? x[b * in + i + 1] : 0);
+    }
+  }
+}
+#endif
+
+// Dot products of four rows of d with w, sharing the loads of w
+template <typename W>
+void Dot4(const float* __restrict__ d, int stride, const W* __restrict__ w,
+          int n, float* dots) {
+  float acc[kRowBlock][kLanes] = {};
+  int o = 0;
+  for (; o + kLanes <= n; o += kLanes) {
+    for (int r = 0; r < kRowBlock; ++r) {
+      for (int k = 0; k < kLanes; ++k) {
+        acc[r][k] += d[r * stride + o + k] * ToFloat(w[o + k]);
+      }
+    }
+  }
+  for (int r = 0; r < kRowBlock; ++r) {
+    float dot = 0;
+    for (int k = 0; k < kLanes; ++k) {
+      dot += acc[r][k];
+    }
+    for (int j = o; j < n; ++j) {
+      dot += d[r * stride + j] * ToFloat(w[j]);
+    }
+    dots[r] = dot;
+  }
+}
+
+template <typename W>
+float Dot(const float* __restrict__ d, const W* __restrict__ w, int n) {
+  float acc[kLanes] = {};
+  int o = 0;
+  for (; o + kLanes <= n; o += kLanes) {
+    for (int k = 0; k < kLanes; ++k) {
+      acc[k] += d[o + k] * ToFloat(w[o + k]);
+    }
+  }
+  float dot = 0;
+  for (int k = 0; k < kLanes; ++k) {
+    dot += acc[k];
+  }
+  for (; o < n; ++o) {
+    dot += d[o] * ToFloat(w[o]);
+  }
+  return dot;
+}
+
+// Calls f(l, caffe_layer, out_offset, index of its weights in
+// learnable_params()) for each Caffe layer of each FusedMLP layer l
+template <typename F>
+void ForEachCaffeLayer(caffe::Net<float>& net, const LayerNames& layers, F f) {
+  const auto& learnable = net.learnable_params();
+  for (int l = 0; l < layers.size(); ++l) {
+    int out_offset = 0;
+    for (const std::string& name : layers[l]) {
+      CHECK(net.has_layer(name)) << net.name() << " has no layer " << name;
+      const auto layer = net.layer_by_name(name);
+      CHECK_EQ(std::string(layer->type()), "InnerProduct") << name;
+      CHECK_EQ(layer->blobs().size(), 2) << name << " needs a bias";
+      int param_index = std::distance(
+          learnable.begin(), std::find(learnable.begin(), learnable.end(),
+                                       layer->blobs()[0].get()));
+      CHECK_LT(param_index + 1, learnable.size());
+      CHECK_EQ(learnable[param_index + 1], layer->blobs()[1].get());
+      f(l, *layer, out_offset, param_index);
+      out_offset += layer->blobs()[0]->shape(0);
+    }
+  }
+}
+
+// The first or second Adam moment of a learnable param, or null
+// without history
+caffe::Blob<float>* Moment(caffe::Solver<float>* solver, int param_index,
+                           int moment) {
+  auto sgd = dynamic_cast<caffe::SGDSolver<float>*>(solver);
+  CHECK(sgd) << "Not an Adam solver";
+  const auto& history = sgd->history();
+  const int num_params = solver->net()->learnable_params().size();
+  if (history.size() != 2 * num_params) {
+    return NULL;
+  }
+  return history[moment * num_params + param_index].get();
+}
+
+} // namespace
+
+AdamConfig GetAdamConfig(const caffe::SolverParameter& param, int iter) {
+  CHECK_EQ(param.type(), "Adam") << "Native updates need the Adam solver";
+  CHECK_EQ(param.lr_policy(), "fixed")
+      << "Native updates need a fixed learning rate";
+  CHECK_EQ(param.weight_decay(), 0) << "Native updates have no weight decay";
+  return {param.base_lr(), param.momentum(), param.momentum2(), param.delta(),
+          iter + 1};
+}
+
+void AdamUpdate(int count, const float* __restrict__ grad, float grad_scale,
+                const AdamConfig& adam, float* __restrict__ params,
+                float* __restrict__ m, float* __restrict__ v) {
+  const float rate = adam.lr *
+      std::sqrt(1 - std::pow(adam.beta2, float(adam.t))) /
+      (1 - std::pow(adam.beta1, float(adam.t)));
+  const float beta1 = adam.beta1, beta2 = adam.beta2, eps = adam.eps;
+  for (int i = 0; i < count; ++i) {
+    const float g = grad[i] * grad_scale;
+    m[i] = beta1 * m[i] + (1 - beta1) * g;
+    v[i] = beta2 * v[i] + (1 - beta2) * g * g;
+    params[i] -= rate * m[i] / (std::sqrt(v[i]) + eps);
+  }
+}
+
+bool CanFuseAdamStep(caffe::Solver<float>& solver) {
+  const caffe::SolverParameter& param = solver.param();
+  if (caffe::Caffe::mode() != caffe::Caffe::CPU || param.type() != "Adam" ||
+      param.lr_policy() != "fixed" || param.weight_decay() != 0 ||
+      param.iter_size() != 1) {
+    return false;
+  }
+  const std::vector<float>& lr_mults = solver.net()->params_lr();
+  return std::all_of(lr_mults.begin(), lr_mults.end(),
+                     [](float lr_mult) { return lr_mult == 1; });
+}
+
+void FusedAdamStep(caffe::Solver<float>& solver) {
+  const AdamConfig adam = GetAdamConfig(solver.param(), solver.iter());
+  const std::vector<caffe::Blob<float>*>& params = solver.net()->learnable_params();
+  // AdamSolver keeps the first moments then the second
+  const auto& history = static_cast<caffe::SGDSolver<float>&>(solver).history();
+  const int n = params.size();
+  CHECK_EQ(history.size(), 2 * n) << "Not the history of an AdamSolver";
+  float grad_scale = 1;
+  const float clip_gradients = solver.param().clip_gradients();
+  if (clip_gradients >= 0) {
+    double sumsq = 0;
+    for (caffe::Blob<float>* param : params) {
+      sumsq += Dot(param->cpu_diff(), param->cpu_diff(), param->count());
+    }
+    const float l2norm = std::sqrt(sumsq);
+    if (l2norm > clip_gradients) {
+      grad_scale = clip_gradients / l2norm;
+    }
+  }
+  for (int i = 0; i < n; ++i) {
+    AdamUpdate(params[i]->count(), params[i]->cpu_diff(), grad_scale, adam,
+               params[i]->mutable_cpu_data(), history[i]->mutable_cpu_data(),
+               history[i + n]->mutable_cpu_data());
+  }
+}
+
+LayerNames ActorLayerNames() {
+  return {{"ip1_layer"}, {"ip2_layer"}, {"ip3_layer"}, {"ip4_layer"},
+          {"action_layer", "actionpara_layer"}};
+}
+
+LayerNames CriticLayerNames() {
+  return {{"ip1_layer"}, {"ip2_layer"}, {"ip3_layer"}, {"ip4_layer"},
+          {q_values_layer_name}};
+}
+
+FusedMLP::FusedMLP(caffe::Net<float>& net, const LayerNames& layers,
+                   int max_batch, bool bf16) :
+    layers_(layers.size()), max_batch_(max_batch), bf16_(bf16),
+    bf16_stale_(true), input_(NULL), batch_(0) {
+  ForEachCaffeLayer(net, layers, [&](int l, caffe::Layer<float>& layer,
+                                     int out_offset, int) {
+      const int in = layer.blobs()[0]->shape(1);
+      CHECK(out_offset == 0 || layers_[l].in == in);
+      layers_[l].in = in;
+      layers_[l].out = out_offset + layer.blobs()[0]->shape(0);
+    });
+  for (int l = 0; l < layers_.size(); ++l) {
+    Layer& layer = layers_[l];
+    CHECK(l == 0 || layer.in == layers_[l-1].out)
+        << "Layer " << l << " of " << net.name() << " is not a tower";
+    layer.params.resize(layer.in * layer.out + layer.out);
+    layer.output.resize(max_batch * layer.out);
+    layer.output_diff.resize(max_batch * layer.out);
+  }
+  if (bf16_) {
+    input_bf16_.resize(max_batch * layers_.front().in);
+  }
+  Load(net, layers);
+}
+
+int FusedMLP::num_params() const {
+  int n = 0;
+  for (const Layer& layer : layers_) {
+    n += layer.params.size();
+  }
+  return n;
+}
+
+void FusedMLP::UpdateBf16Weights() {
+  if (!bf16_ || !bf16_stale_) {
+    return;
+  }
+  for (Layer& layer : layers_) {
+    const int in = layer.in, out = layer.out;
+    const float* __restrict__ w = layer.params.data();
+#ifdef __AVX512BF16__
+    // The forward reads the weights of input pairs interleaved, the
+    // backward those of output pairs
+    const int in_pairs = (in + 1) / 2, out_pairs = (out + 1) / 2;
+    layer.weights_pairs.resize(in_pairs * out);
+    layer.weights_pairs_t.resize(out_pairs * in);
+    for (int p = 0; p < in_pairs; ++p) {
+      const float* __restrict__ lo = w + 2 * p * out;
+      uint32_t* __restrict__ wp = layer.weights_pairs.data() + p * out;
+      if (2 * p + 1 < in) {
+        for (int o = 0; o < out; ++o) {
+          wp[o] = ToBf16Pair(lo[o], lo[out + o]);
+        }
+      } else {
+        for (int o = 0; o < out; ++o) {
+          wp[o] = ToBf16Pair(lo[o], 0);
+        }
+      }
+    }
+    // Rows in tiles so their cache lines are reused across the pairs
+    constexpr int kTile = 16;
+    for (int i0 = 0; i0 < in; i0 += kTile) {
+      const int i1 = std::min(in, i0 + kTile);
+      for (int p = 0; p < out_pairs; ++p) {
+        const int o = 2 * p;
+        uint32_t* __restrict__ wpt = layer.weights_pairs_t.data() + p * in;
+        for (int i = i0; i < i1; ++i) {
+          wpt[i] = ToBf16Pair(w[i * out + o], o + 1 < out ? w[i * out + o + 1] : 0);
+        }
+      }
+    }
+#else
+    layer.weights_bf16.resize(in * out);
+    uint16_t* __restrict__ w16 = layer.weights_bf16.data();
+    for (int i = 0; i < in * out; ++i) {
+      w16[i] = ToBf16(w[i]);
+    }
+#endif
+  }
+  bf16_stale_ = false;
+}
+
+const float* FusedMLP::Forward(const float* input, int batch) {
+  CHECK_LE(batch, max_batch_);
+  batch_ = batch;
+  if (bf16_) {
+    UpdateBf16Weights();
+    const int n = batch * input_size();
+    std::copy(input, input + n, input_bf16_.begin());
+    RoundToBf16(input_bf16_.data(), n);
+    input = input_bf16_.data();
+  }
+  input_ = input;
+  for (int l = 0; l < layers_.size(); ++l) {
+    Layer& layer = layers_[l];
+    const float* x = l == 0 ? input : layers_[l-1].output.data();
+    const float* bias = layer.params.data() + layer.in * layer.out;
+    const bool hidden = l + 1 < layers_.size();
+    if (bf16_) {
+#ifdef __AVX512BF16__
+      const int in_pairs = (layer.in + 1) / 2;
+      input_pairs_.resize(max_batch_ * in_pairs);
+      PackBf16Pairs(x, batch, layer.in, input_pairs_.data());
+      ForwardKernelBf16(input_pairs_.data(), batch, in_pairs, layer.out,
+                        layer.weights_pairs.data(), bias, hidden,
+                        layer.output.data());
+#else
+      ForwardKernel(x, batch, layer.in, layer.out, layer.weights_bf16.data(),
+                    bias, hidden, layer.output.data());
+#endif
+      // Hidden activations are stored as bf16, the output kept in fp32
+      if (hidden) {
+        RoundToBf16(layer.output.data(), batch * layer.out);
+      }
+    } else {
+      ForwardKernel(x, batch, layer.in, layer.out, layer.params.data(), bias,
+                    hidden, layer.output.data());
+    }
+  }
+  return layers_.back().output.data();
+}
+
+double FusedMLP::Backward(const float* output_diff, float* input_diff,
+                          bool param_grads) {
+  Layer& top = layers_.back();
+  std::copy(output_diff, output_diff + batch_ * top.out, top.output_diff.data());
+  double sumsq = 0;
+  for (int l = layers_.size() - 1; l >= 0; --l) {
+    sumsq += BackwardLayer(l, l == 0 ? input_diff : layers_[l-1].output_diff.data(),
+                           param_grads, NULL);
+  }
+  return sumsq;
+}
+
+void FusedMLP::BackwardAdam(const float* output_diff, const AdamConfig& adam) {
+  Layer& top = layers_.back();
+  std::copy(output_diff, output_diff + batch_ * top.out, top.output_diff.data());
+  for (int l = layers_.size() - 1; l >= 0; --l) {
+    BackwardLayer(l, l == 0 ? NULL : layers_[l-1].output_diff.data(), true, &adam);
+  }
+  bf16_stale_ = true;
+}
+
+double FusedMLP::BackwardLayer(int l, float* input_diff, bool param_grads,
+                               const AdamConfig* adam) {
+  Layer& layer = layers_[l];
+  const int in = layer.in, out = layer.out, batch = batch_;
+  const float* x = l == 0 ? input_ : layers_[l-1].output.data();
+  float* dz = layer.output_diff.data();
+  float* wt = layer.params.data();
+  const bool relu_below = l > 0;
+  if (!input_diff && !param_grads) {
+    return 0;
+  }
+  if (param_grads && layer.diff.empty()) {
+    layer.diff.resize(layer.params.size());
+  }
+  if (adam && layer.m.empty()) {
+    layer.m.assign(layer.params.size(), 0);
+    layer.v.assign(layer.params.size(), 0);
+  }
+  // The input gradients are those of the weights the forward used
+  const uint16_t* wt_bf16 = NULL;
+  bool kernel_input_diff = false;
+  if (bf16_) {
+    RoundToBf16(dz, batch * out);
+#ifdef __AVX512BF16__
+    // dz x W^T runs like a forward through the transposed weights
+    if (input_diff) {
+      const int out_pairs = (out + 1) / 2;
+      input_pairs_.resize(max_batch_ * out_pairs);
+      PackBf16Pairs(dz, batch, out, input_pairs_.data());
+      ForwardKernelBf16(input_pairs_.data(), batch, out_pairs, in,
+                        layer.weights_pairs_t.data(), NULL, false, input_diff);
+      kernel_input_diff = true;
+    }
+#else
+    wt_bf16 = layer.weights_bf16.data();
+#endif
+  }
+  double sumsq = 0;
+  // One pass over the weight rows computes the input gradients with the
+  // row, then its gradient, then steps it
+  for (int i = 0; i < in; ++i) {
+    const float* w = wt + i * out;
+    if (input_diff && !kernel_input_diff) {
+      int b = 0;
+      float dots[kRowBlock];
+      for (; b + kRowBlock <= batch; b += kRowBlock) {
+        if (wt_bf16) {
+          Dot4(dz + b * out, out, wt_bf16 + i * out, out, dots);
+        } else {
+          Dot4(dz + b * out, out, w, out, dots);
+        }
+        for (int r = 0; r < kRowBlock; ++r) {
+          input_diff[(b + r) * in + i] = dots[r];
+        }
+      }
+      for (; b < batch; ++b) {
+        input_diff[b * in + i] = wt_bf16 ? Dot(dz + b * out, wt_bf16 + i * out, out) :
+            Dot(dz + b * out, w, out);
+      }
+    }
+    if (input_diff && relu_below) {
+      // Leaky ReLU gradient of the layer below, from its output
+      for (int b = 0; b < batch; ++b) {
+        if (x[b * in + i] <= 0) {
+          input_diff[b * in + i] *= kNegativeSlope;
+        }
+      }
+    }
+    if (param_grads) {
+      float* __restrict__ g = layer.diff.data() + i * out;
+      std::fill(g, g + out, 0.0f);
+      for (int b = 0; b < batch; ++b) {
+        const float xb = x[b * in + i];
+        const float* __restrict__ d = dz + b * out;
+        for (int o = 0; o < out; ++o) {
+          g[o] += xb * d[o];
+        }
+      }
+      sumsq += Dot(g, g, out);
+      if (adam) {
+        AdamUpdate(out, g, 1, *adam, wt + i * out, layer.m.data() + i * out,
+                   layer.v.data() + i * out);
+      }
+    }
+  }
+  if (param_grads) {
+    const int offset = in * out;
+    float* __restrict__ g = layer.diff.data() + offset;
+    std::fill(g, g + out, 0.0f);
+    for (int b = 0; b < batch; ++b) {
+      const float* __restrict__ d = dz + b * out;
+      for (int o = 0; o < out; ++o) {
+        g[o] += d[o];
+      }
+    }
+    sumsq += Dot(g, g, out);
+    if (adam) {
+      AdamUpdate(out, g, 1, *adam, wt + offset, layer.m.data() + offset,
+                 layer.v.data() + offset);
+    }
+  }
+  return sumsq;
+}
+
+void FusedMLP::ApplyAdam(const AdamConfig& adam, float grad_scale) {
+  for (Layer& layer : layers_) {
+    CHECK_EQ(layer.diff.size(), layer.params.size()) << "No gradients to apply";
+    if (layer.m.empty()) {
+      layer.m.assign(layer.params.size(), 0);
+      layer.v.assign(layer.params.size(), 0);
+    }
+    AdamUpdate(layer.params.size(), layer.diff.data(), grad_scale, adam,
+               layer.params.data(), layer.m.data(), layer.v.data());
+  }
+  bf16_stale_ = true;
+}
+
+void FusedMLP::SoftUpdate(const FusedMLP& other, float tau) {
+  CHECK_EQ(layers_.size(), other.layers_.size());
+  for (int l = 0; l < layers_.size(); ++l) {
+    float* __restrict__ to = layers_[l].params.data();
+    const float* __restrict__ from = other.layers_[l].params.data();
+    const int n = layers_[l].params.size();
+    CHECK_EQ(n, other.layers_[l].params.size());
+    for (int i = 0; i < n; ++i) {
+      to[i] = tau * from[i] + (1 - tau) * to[i];
+    }
+  }
+  bf16_stale_ = true;
+}
+
+void FusedMLP::Load(caffe::Net<float>& net, const LayerNames& layers,
+                    caffe::Solver<float>* solver) {
+  CHECK_EQ(layers.size(), layers_.size());
+  bf16_stale_ = true;
+  ForEachCaffeLayer(net, layers, [&](int l, caffe::Layer<float>& caffe_layer,
+                                     int out_offset, int param_index) {
+      Layer& layer = layers_[l];
+      const int rows = caffe_layer.blobs()[0]->shape(0);
+      CHECK_EQ(caffe_layer.blobs()[0]->shape(1), layer.in);
+      CHECK_LE(out_offset + rows, layer.out);
+      // Caffe keeps weights as out x in
+      auto load = [&](const float* weights, const float* bias, float* dst) {
+        for (int r = 0; r < rows; ++r) {
+          for (int i = 0; i < layer.in; ++i) {
+            dst[i * layer.out + out_offset + r] = weights[r * layer.in + i];
+          }
+          dst[layer.in * layer.out + out_offset + r] = bias[r];
+        }
+      };
+      load(caffe_layer.blobs()[0]->cpu_data(), caffe_layer.blobs()[1]->cpu_data(),
+           layer.params.data());
+      caffe::Blob<float>* m = solver ? Moment(solver, param_index, 0) : NULL;
+      if (m) {
+        caffe::Blob<float>* m_bias = Moment(solver, param_index + 1, 0);
+        layer.m.resize(layer.params.size());
+        layer.v.resize(layer.params.size());
+        load(m->cpu_data(), m_bias->cpu_data(), layer.m.data());
+        load(Moment(solver, param_index, 1)->cpu_data(),
+             Moment(solver, param_index + 1, 1)->cpu_data(), layer.v.data());
+      }
+    });
+}
+
+void FusedMLP::Store(caffe::Net<float>& net, const LayerNames& layers,
+                     caffe::Solver<float>* solver) const {
+  CHECK_EQ(layers.size(), layers_.size());
+  ForEachCaffeLayer(net, layers, [&](int l, caffe::Layer<float>& caffe_layer,
+                                     int out_offset, int param_index) {
+      const Layer& layer = layers_[l];
+      const int rows = caffe_layer.blobs()[0]->shape(0);
+      auto store = [&](const float* src, float* weights, float* bias) {
+        for (int r = 0; r < rows; ++r) {
+          for (int i = 0; i < layer.in; ++i) {
+            weights[r * layer.in + i] = src[i * layer.out + out_offset + r];
+          }
+          bias[r] = src[layer.in * layer.out + out_offset + r];
+        }
+      };
+      store(layer.params.data(), caffe_layer.blobs()[0]->mutable_cpu_data(),
+            caffe_layer.blobs()[1]->mutable_cpu_data());
+      caffe::Blob<float>* m = solver ? Moment(solver, param_index, 0) : NULL;
+      if (m && !layer.m.empty()) {
+        store(layer.m.data(), m->mutable_cpu_data(),
+              Moment(solver, param_index + 1, 0)->mutable_cpu_data());
+        store(layer.v.data(), Moment(solver, param_index, 1)->mutable_cpu_data(),
+              Moment(solver, param_index + 1, 1)->mutable_cpu_data());
+      }
+    });
+}
+
+std::vector<ParamView> FusedMLP::Params(const LayerNames& layers) {
+  CHECK_EQ(layers.size(), layers_.size());
+  bf16_stale_ = true; // The views may be written
+  std::vector<ParamView> views;
+  for (int l = 0; l < layers_.size(); ++l) {
+    Layer& layer = layers_[l];
+    std::string name;
+    for (const std::string& layer_name : layers[l]) {
+      name += (name.empty() ? "" : "+") + layer_name;
+    }
+    views.push_back({name, layer.params.data(),
+                     layer.diff.empty() ? NULL : layer.diff.data(),
+                     int(layer.params.size())});
+  }
+  return views;
+}
+
+} // namespace dqn
@@ -0,0 +1,135 @@
+#ifndef FUSED_MLP_HPP_
+#define FUSED_MLP_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <caffe/caffe.hpp>
+#include "compute_backend.hpp"
+
+namespace dqn {
+
+// One Adam step as Caffe's AdamSolver makes it
+struct AdamConfig {
+  float lr;
+  float beta1; // momentum
+  float beta2; // momentum2
+  float eps;   // delta
+  int t;       // The solver iteration + 1
+};
+
+// Reads the Adam hyperparameters of param at iteration iter. Dies
+// unless param is an Adam solver with a fixed learning rate and no
+// weight decay, the only updates the native kernels make.
+AdamConfig GetAdamConfig(const caffe::SolverParameter& param, int iter);
+
+// Applies Adam to count params given their gradients times grad_scale,
+// updating the first and second moments m and v
+void AdamUpdate(int count, const float* grad, float grad_scale,
+                const AdamConfig& adam, float* params, float* m, float* v);
+
+// Whether FusedAdamStep can make the updates of solver: Adam on the CPU
+// with a fixed learning rate, no weight decay and no lr_mult
+bool CanFuseAdamStep(caffe::Solver<float>& solver);
+// Makes the update of solver.ApplyUpdate() in two sweeps over the
+// gradients, one for their norm when clipping and one applying Adam in
+// place, instead of Caffe's clip, scale, moment, update and write
+// passes. Leaves the gradients as they were.
+void FusedAdamStep(caffe::Solver<float>& solver);
+
+// Caffe names of the inner product layers making up each layer of a
+// FusedMLP. Layers split over several Caffe layers (the two actor
+// heads) concatenate their outputs.
+using LayerNames = std::vector<std::vector<std::string> >;
+// The layers of the nets made by CreateActorNet and CreateCriticNet
+LayerNames ActorLayerNames();
+LayerNames CriticLayerNames();
+
+/**
+ * A tower of inner product layers with leaky ReLUs between them and a
+ * linear last layer, trained without Caffe. Forward makes one pass per
+ * layer doing the GEMM, bias and activation. Backward makes one pass
+ * per layer computing the weight gradients and the input gradients,
+ * optionally with the Adam step in the same pass. The loops are
+ * blocked for the 1024..128 wide layers of our towers. Weights are
+ * stored transposed (inputs x outputs) so inner loops run over
+ * contiguous outputs and vectorize.
+ *
+ * With bf16 set the GEMMs run on bf16 copies of the weights, inputs,
+ * hidden activations and output gradients, accumulating in fp32 as
+ * bf16 dot product units do, with vdpbf16ps when built for
+ * AVX512-BF16. The parameters, their gradients and the Adam moments
+ * stay fp32.
+ */
+class FusedMLP {
+public:
+  // Shapes the layers like those of net and loads their weights
+  FusedMLP(caffe::Net<float>& net, const LayerNames& layers, int max_batch,
+           bool bf16=false);
+
+  int num_layers() const { return layers_.size(); }
+  int input_size() const { return layers_.front().in; }
+  int output_size() const { return layers_.back().out; }
+  int num_params() const;
+  bool bf16() const { return bf16_; }
+
+  // Runs batch rows of input_size() inputs, returning batch rows of
+  // output_size() outputs. input must stay valid until Backward.
+  const float* Forward(const float* input, int batch);
+  // Backpropagates output_diff through the last Forward, writing the
+  // gradients of the inputs to input_diff unless it is null. Only keeps
+  // the parameter gradients if param_grads is set. Returns their
+  // squared L2 norm.
+  double Backward(const float* output_diff, float* input_diff,
+                  bool param_grads=true);
+  // Same but applies adam to each layer as soon as its gradients are
+  // done. Only valid without gradient clipping.
+  void BackwardAdam(const float* output_diff, const AdamConfig& adam);
+  // Applies adam with the gradients of Backward scaled by grad_scale
+  void ApplyAdam(const AdamConfig& adam, float grad_scale=1);
+
+  // params = tau * other + (1 - tau) * params
+  void SoftUpdate(const FusedMLP& other, float tau);
+
+  // Copies the parameters and, given the net's solver, the Adam
+  // moments from/to the layers of a net shaped like this one
+  void Load(caffe::Net<float>& net, const LayerNames& layers,
+            caffe::Solver<float>* solver=NULL);
+  void Store(caffe::Net<float>& net, const LayerNames& layers,
+             caffe::Solver<float>* solver=NULL) const;
+  // Views of the parameters of each layer, named after its Caffe layers
+  std::vector<ParamView> Params(const LayerNames& layers);
+
+protected:
+  struct Layer {
+    int in, out;
+    // Transposed weights (in x out) then the out biases. The gradients
+    // and moments share the layout.
+    std::vector<float> params, diff, m, v;
+    // The weights of the last Forward in bf16 if bf16_: as params, or
+    // as pairs of inputs and of outputs for the AVX512-BF16 kernels
+    std::vector<uint16_t> weights_bf16;
+    std::vector<uint32_t> weights_pairs, weights_pairs_t;
+    std::vector<float> output; // max_batch x out, after the activation
+    std::vector<float> output_diff; // Same, before the activation
+  };
+  // Rounds the weights to weights_bf16 if they changed since
+  void UpdateBf16Weights();
+  // Backward through layer l. Applies adam in the same pass if given.
+  double BackwardLayer(int l, float* input_diff, bool param_grads,
+                       const AdamConfig* adam);
+
+protected:
+  std::vector<Layer> layers_;
+  const int max_batch_;
+  const bool bf16_;
+  bool bf16_stale_; // The params changed since UpdateBf16Weights
+  std::vector<float> input_bf16_; // The last input rounded, if bf16_
+  std::vector<uint32_t> input_pairs_; // Scratch of ForwardKernelBf16
+  const float* input_; // Of the last Forward
+  int batch_;
+};
+
+} // namespace dqn
+
+#endif /* FUSED_MLP_HPP_ */
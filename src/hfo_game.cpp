@@ -120,14 +120,21 @@ HFOGameState::~HFOGameState() {
 }
 
 void HFOGameState::update(HFOEnvironment& hfo) {
-  status = hfo.step();
-  if (status == SERVER_DOWN) {
+  status_t new_status = hfo.step();
+  if (new_status == SERVER_DOWN) {
     LOG(FATAL) << "Server Down!";
     exit(1);
-  } else if (status != IN_GAME) {
+  }
+  update(new_status, hfo.getState(), hfo.playerOnBall());
+}
+
+void HFOGameState::update(status_t new_status,
+                          const std::vector<float>& current_state,
+                          const Player& new_player_on_ball) {
+  status = new_status;
+  if (status != IN_GAME) {
     episode_over = true;
   }
-  const std::vector<float>& current_state = hfo.getState();
   float ball_proximity = current_state[53];
   float goal_proximity = current_state[15];
   float ball_dist = 1.0 - ball_proximity;
@@ -167,7 +174,7 @@ void HFOGameState::update(HFOEnvironment& hfo) {
     ball_dist_goal_delta = 0;
   }
   old_player_on_ball = player_on_ball;
-  player_on_ball = hfo.playerOnBall();
+  player_on_ball = new_player_on_ball;
   VLOG(1) << "Player On Ball: " << player_on_ball.unum;
   steps++;
 }
@@ -10,8 +10,7 @@ struct Action {
   float arg2;
 };
 
-const
-inline int NumStateFeatures(int num_players) {
+constexpr int NumStateFeatures(int num_players) {
   return 50 + 8 * (num_players);
 }
 
@@ -38,6 +37,9 @@ class HFOGameState {
   HFOGameState(int unum);
   ~HFOGameState();
   void update(hfo::HFOEnvironment& hfo);
+  // Same for a step that was recorded instead of played
+  void update(hfo::status_t status, const std::vector<float>& current_state,
+              const hfo::Player& player_on_ball);
   float reward();
   float move_to_ball_reward();
   float kick_to_goal_reward();
@@ -0,0 +1,272 @@
+#include "hfo_records.hpp"
+#include "demonstrations.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <glog/logging.h>
+
+namespace dqn {
+
+namespace {
+
+// Index of the Kickable flag in the low-level state: the self features
+// of HFO's LOW_LEVEL_FEATURE_SET (see its manual) are pos valid (0), vel
+// valid (1), vel angle (2-3), vel magnitude (4), angle (5-6), stamina
+// (7), frozen (8), colliding with ball, player and post (9-11), then
+// kickable (12).
+constexpr int kKickableFeature = 12;
+
+// Parses the cycle a recording line starts with
+bool ParseCycle(const std::string& line, int& cycle) {
+  if (line.empty() || !isdigit(line[0])) {
+    return false;
+  }
+  cycle = atoi(line.c_str());
+  return true;
+}
+
+// Agent unums end recording names, e.g. base_left-7.log
+int UnumFromFilename(const std::string& filename) {
+  std::string stem = boost::filesystem::path(filename).stem().string();
+  while (boost::algorithm::ends_with(stem, ".log")) {
+    stem = boost::filesystem::path(stem).stem().string();
+  }
+  size_t digits = stem.find_last_not_of("0123456789") + 1;
+  return digits < stem.size() ? atoi(stem.c_str() + digits) : -1;
+}
+
+} // namespace
+
+RecordReader::RecordReader(const std::string& filename) :
+    filename_(filename),
+    file_(filename.c_str(), std::ios_base::in | std::ios_base::binary),
+    line_num_(0) {
+  CHECK(file_) << "Unable to open " << filename;
+  if (boost::algorithm::ends_with(filename, ".gz")) {
+    in_.push(boost::iostreams::gzip_decompressor());
+  }
+  in_.push(file_);
+  ResetStep(-1);
+}
+
+void RecordReader::ResetStep(int cycle) {
+  step_.cycle = cycle;
+  step_.status = hfo::IN_GAME;
+  step_.state.clear();
+  step_.has_action = false;
+  step_.action = {hfo::NOOP, 0, 0};
+  step_.player_on_ball = {hfo::NEUTRAL, -1};
+}
+
+void RecordReader::ParseLine(const std::string& line) {
+  std::istringstream ss(line);
+  std::string token;
+  ss >> token; // The cycle
+  while (ss >> token) {
+    if (token == "StateFeatures") {
+      float feature;
+      step_.state.clear();
+      while (ss >> feature) {
+        step_.state.push_back(feature);
+      }
+      return;
+    } else if (token == "GameStatus") {
+      int status;
+      if (ss >> status) {
+        step_.status = hfo::status_t(status);
+      }
+      return;
+    } else if (token == "PlayerOnBall") {
+      int side, unum;
+      if (ss >> side >> unum) {
+        step_.player_on_ball = {hfo::SideID(side), unum};
+      }
+      return;
+    }
+    // Actions, as "DASH 100 0" or "Dash(100,0)"
+    std::string name = token.substr(0, token.find('('));
+    hfo::action_t action;
+    if (ParseAction(name, action)) {
+      std::string args = token.substr(name.size());
+      std::string rest;
+      std::getline(ss, rest);
+      args += " " + rest;
+      std::replace_if(args.begin(), args.end(), [](char c) {
+          return c == '(' || c == ')' || c == ','; }, ' ');
+      std::istringstream arg_stream(args);
+      step_.action = {action, 0, 0};
+      arg_stream >> step_.action.arg1 >> step_.action.arg2;
+      step_.has_action = true;
+      return;
+    }
+  }
+}
+
+bool RecordReader::Next(RecordedStep& step) {
+  std::string line;
+  while (std::getline(in_, line)) {
+    ++line_num_;
+    int cycle;
+    if (!ParseCycle(line, cycle)) {
+      continue;
+    }
+    if (cycle != step_.cycle) {
+      bool done = !step_.state.empty();
+      if (done) {
+        step = std::move(step_);
+      }
+      ResetStep(cycle);
+      ParseLine(line);
+      if (done) {
+        return true;
+      }
+    } else {
+      ParseLine(line);
+    }
+  }
+  if (step_.state.empty()) {
+    return false;
+  }
+  step = std::move(step_);
+  ResetStep(-1);
+  return true;
+}
+
+int ReadRecordedEpisodes(const std::string& filename, int unum, DQN& dqn,
+                         const std::function<void(std::vector<Transition>&&)>& add) {
+  RecordReader reader(filename);
+  RecordedStep step, next;
+  if (!reader.Next(step)) {
+    LOG(WARNING) << "No states recorded in " << filename;
+    return 0;
+  }
+  if (step.state.size() != dqn.state_size()) {
+    LOG(WARNING) << "Skipping " << filename << ": recorded states have "
+                 << step.state.size() << " features, not " << dqn.state_size();
+    return 0;
+  }
+  hfo::Player on_ball = {hfo::LEFT, -1};
+  auto player_on_ball = [&](const RecordedStep& s) {
+    if (s.player_on_ball.unum >= 0) {
+      on_ball = s.player_on_ball;
+    } else if (s.state[kKickableFeature] > 0) {
+      on_ball = {hfo::LEFT, unum};
+    }
+    return on_ball;
+  };
+  int dropped = 0;
+  // Added once the whole file parsed, so a bad file adds nothing
+  std::vector<std::vector<Transition> > episodes;
+  std::vector<Transition> episode;
+  bool complete = true;
+  std::unique_ptr<HFOGameState> game(new HFOGameState(unum));
+  game->update(hfo::IN_GAME, step.state, player_on_ball(step));
+  StateDataSp state = AllocateState(step.state.begin(), step.state.end());
+  while (reader.Next(next)) {
+    if (next.state.size() != dqn.state_size()) {
+      LOG(WARNING) << "Skipping " << filename << ": recorded states have "
+                   << next.state.size() << " features, not " << dqn.state_size()
+                   << ", at line " << reader.line_num();
+      return 0;
+    }
+    game->update(next.status, next.state, player_on_ball(next));
+    float reward = game->reward();
+    StateDataSp next_state = AllocateState(next.state.begin(), next.state.end());
+    if (!step.has_action) {
+      complete = false;
+    } else if (next.status == hfo::IN_GAME) {
+      episode.emplace_back(state, GetActorOutput(step.action), reward, 0, next_state);
+    } else {
+      episode.emplace_back(state, GetActorOutput(step.action), reward, 0, boost::none);
+    }
+    if (!game->episode_over) {
+      step = std::move(next);
+      state = std::move(next_state);
+      continue;
+    }
+    if (complete && !episode.empty()) {
+      dqn.LabelTransitions(episode);
+      episodes.push_back(std::move(episode));
+    } else {
+      dropped++;
+    }
+    episode.clear();
+    complete = true;
+    // The following step starts the next episode
+    if (!reader.Next(step)) {
+      break;
+    }
+    game.reset(new HFOGameState(unum));
+    on_ball = {hfo::LEFT, -1};
+    game->update(hfo::IN_GAME, step.state, player_on_ball(step));
+    state = AllocateState(step.state.begin(), step.state.end());
+  }
+  // An unfinished last episode is dropped too
+  dropped += !episode.empty();
+  VLOG(1) << filename << ": " << episodes.size() << " episodes, " << dropped
+          << " dropped";
+  for (std::vector<Transition>& e : episodes) {
+    add(std::move(e));
+  }
+  return episodes.size();
+}
+
+void LoadRecordings(const std::vector<std::string>& paths, DQN& dqn,
+                    int workers) {
+  std::vector<std::string> files;
+  for (const std::string& path : paths) {
+    if (boost::filesystem::is_directory(path)) {
+      for (boost::filesystem::recursive_directory_iterator it(path), end;
+           it != end; ++it) {
+        if (boost::filesystem::is_regular_file(it->path())) {
+          files.push_back(it->path().string());
+        }
+      }
+    } else {
+      CHECK(boost::filesystem::is_regular_file(path)) << "Invalid file: " << path;
+      files.push_back(path);
+    }
+  }
+  // Claimed in a fixed order, so loads with one worker are reproducible
+  std::sort(files.begin(), files.end());
+  workers = std::max(1, std::min<int>(workers, files.size()));
+  LOG(INFO) << "Loading " << files.size() << " recordings with "
+            << workers << " workers";
+  std::atomic<int> next_file(0);
+  std::atomic<int> episodes(0);
+  std::mutex memory_mutex;
+  auto work = [&]() {
+    for (int i = next_file++; i < files.size(); i = next_file++) {
+      const int unum = UnumFromFilename(files[i]);
+      if (unum < 0) {
+        LOG(WARNING) << "Skipping " << files[i] << ": its name does not end "
+                     << "with the unum of the agent, e.g. base_left-7.log";
+        continue;
+      }
+      episodes += ReadRecordedEpisodes(
+          files[i], unum, dqn,
+          [&](std::vector<Transition>&& episode) {
+            std::lock_guard<std::mutex> lock(memory_mutex);
+            dqn.AddTransitions(std::move(episode));
+          });
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 0; i < workers; ++i) {
+    threads.emplace_back(work);
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  LOG(INFO) << "Loaded " << episodes << " recorded episodes, replay memory holds "
+            << dqn.memory_size() << " transitions";
+}
+
+} // namespace dqn
@@ -0,0 +1,84 @@
+#ifndef HFO_RECORDS_HPP_
+#define HFO_RECORDS_HPP_
+
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+#include <boost/iostreams/filtering_stream.hpp>
+#include "dqn.hpp"
+
+namespace dqn {
+
+/**
+ * One server cycle of an agent's HFO recording (the files HFO writes
+ * to -record_dir). Recordings are text logs whose lines start with
+ * the cycle. Of those, the lines tagged
+ *
+ *   StateFeatures <features...>
+ *   GameStatus <status_t>
+ *   PlayerOnBall <side> <unum>
+ *   <DASH|TURN|TACKLE|KICK> <arg1> <arg2>   (or DASH(arg1,arg2))
+ *
+ * are read. Everything else in them is skipped.
+ */
+struct RecordedStep {
+  int cycle;
+  hfo::status_t status;
+  std::vector<float> state;
+  bool has_action;
+  Action action;
+  hfo::Player player_on_ball; // unum -1 if not recorded
+};
+
+/**
+ * Streams the steps of one recording, optionally gzipped (.gz), so
+ * archives far larger than memory can be read.
+ */
+class RecordReader {
+public:
+  explicit RecordReader(const std::string& filename);
+
+  // Reads the next step with a state. Returns false at the end.
+  bool Next(RecordedStep& step);
+  int line_num() const { return line_num_; }
+
+protected:
+  // Starts a new, empty step_
+  void ResetStep(int cycle);
+  // Parses a line of step_'s cycle into step_
+  void ParseLine(const std::string& line);
+
+protected:
+  std::string filename_;
+  std::ifstream file_;
+  boost::iostreams::filtering_istream in_;
+  RecordedStep step_;
+  int line_num_;
+};
+
+/**
+ * Turns the recording in filename into labeled episodes of replay
+ * transitions, handing each to add. Rewards are recomputed by
+ * HFOGameState as if the episode had just been played by agent
+ * unum. Recordings without PlayerOnBall lines credit the agent with
+ * the ball while it is kickable. Episodes with a step missing its
+ * action are dropped. Episodes are only handed over once the whole
+ * file parsed: a file with states of another size than dqn's is
+ * skipped with a warning. Returns the number of episodes added.
+ */
+int ReadRecordedEpisodes(const std::string& filename, int unum, DQN& dqn,
+                         const std::function<void(std::vector<Transition>&&)>& add);
+
+/**
+ * Loads every recording in paths (files, or directories searched
+ * recursively) into the replay memory of dqn, parsing workers files
+ * at a time. Recordings of a different state size, or whose name does
+ * not end with an agent unum, are skipped.
+ */
+void LoadRecordings(const std::vector<std::string>& paths, DQN& dqn,
+                    int workers);
+
+} // namespace dqn
+
+#endif /* HFO_RECORDS_HPP_ */
@@ -0,0 +1,150 @@
+#include "huge_pages.hpp"
+#include <sys/mman.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+DEFINE_bool(huge_pages, false, "Back replay memory (and large network blobs) "
+            "with 2 MB huge pages.");
+
+namespace dqn {
+
+namespace {
+
+constexpr size_t kBlockAlignment = 64;
+
+struct Arena {
+  std::mutex mutex;
+  std::vector<char*> chunks;
+  char* next = NULL; // Next free byte of the newest chunk
+  size_t left = 0; // Bytes left in the newest chunk
+  std::unordered_map<size_t, std::vector<void*> > free_blocks;
+  size_t explicit_chunks = 0; // Chunks from MAP_HUGETLB
+  size_t used_bytes = 0;
+};
+
+Arena& GetArena() {
+  static Arena* arena = new Arena; // Never destroyed: blocks outlive statics
+  return *arena;
+}
+
+// Maps one arena chunk, preferring explicit huge pages
+char* MapChunk(bool& explicit_huge_pages) {
+  void* chunk = mmap(NULL, kHugePageSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  explicit_huge_pages = chunk != MAP_FAILED;
+  if (!explicit_huge_pages) {
+    // Over-map so a whole aligned huge page fits, then trim
+    char* raw = static_cast<char*>(mmap(NULL, 2 * kHugePageSize,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    CHECK(raw != MAP_FAILED) << "mmap failed: " << strerror(errno);
+    char* aligned = reinterpret_cast<char*>(
+        (reinterpret_cast<uintptr_t>(raw) + kHugePageSize - 1) &
+        ~(kHugePageSize - 1));
+    if (aligned > raw) {
+      munmap(raw, aligned - raw);
+    }
+    munmap(aligned + kHugePageSize, raw + kHugePageSize - aligned);
+    if (madvise(aligned, kHugePageSize, MADV_HUGEPAGE) != 0) {
+      LOG_FIRST_N(WARNING, 1) << "Transparent huge pages unavailable: "
+                              << strerror(errno);
+    }
+    chunk = aligned;
+  }
+  return static_cast<char*>(chunk);
+}
+
+} // namespace
+
+bool HugePagesEnabled() {
+  return FLAGS_huge_pages;
+}
+
+void* ArenaAllocate(size_t bytes) {
+  bytes = (bytes + kBlockAlignment - 1) / kBlockAlignment * kBlockAlignment;
+  if (bytes > kHugePageSize) {
+    // Too big for a chunk. Give it huge pages of its own.
+    void* block = NULL;
+    CHECK_EQ(posix_memalign(&block, kHugePageSize, bytes), 0);
+    AdviseHugePages(block, bytes);
+    return block;
+  }
+  Arena& arena = GetArena();
+  std::lock_guard<std::mutex> lock(arena.mutex);
+  std::vector<void*>& free_blocks = arena.free_blocks[bytes];
+  arena.used_bytes += bytes;
+  if (!free_blocks.empty()) {
+    void* block = free_blocks.back();
+    free_blocks.pop_back();
+    return block;
+  }
+  if (arena.left < bytes) {
+    bool explicit_huge_pages;
+    arena.next = MapChunk(explicit_huge_pages);
+    arena.left = kHugePageSize;
+    arena.chunks.push_back(arena.next);
+    arena.explicit_chunks += explicit_huge_pages;
+  }
+  void* block = arena.next;
+  arena.next += bytes;
+  arena.left -= bytes;
+  return block;
+}
+
+void ArenaFree(void* block, size_t bytes) {
+  bytes = (bytes + kBlockAlignment - 1) / kBlockAlignment * kBlockAlignment;
+  if (bytes > kHugePageSize) {
+    free(block);
+    return;
+  }
+  Arena& arena = GetArena();
+  std::lock_guard<std::mutex> lock(arena.mutex);
+  arena.free_blocks[bytes].push_back(block);
+  arena.used_bytes -= bytes;
+}
+
+size_t AdviseHugePages(void* addr, size_t bytes) {
+  uintptr_t begin = reinterpret_cast<uintptr_t>(addr);
+  uintptr_t first = (begin + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  uintptr_t last = (begin + bytes) & ~(kHugePageSize - 1);
+  if (last <= first) {
+    return 0;
+  }
+  if (madvise(reinterpret_cast<void*>(first), last - first, MADV_HUGEPAGE) != 0) {
+    LOG_FIRST_N(WARNING, 1) << "Transparent huge pages unavailable: "
+                            << strerror(errno);
+    return 0;
+  }
+  return last - first;
+}
+
+size_t AdviseNetHugePages(caffe::Net<float>& net) {
+  size_t advised = 0;
+  for (const auto& blob : net.blobs()) {
+    advised += AdviseHugePages(blob->mutable_cpu_data(), blob->count() * sizeof(float));
+  }
+  for (const auto& param : net.params()) {
+    advised += AdviseHugePages(param->mutable_cpu_data(), param->count() * sizeof(float));
+    advised += AdviseHugePages(param->mutable_cpu_diff(), param->count() * sizeof(float));
+  }
+  return advised;
+}
+
+std::string DescribeHugePages() {
+  Arena& arena = GetArena();
+  std::lock_guard<std::mutex> lock(arena.mutex);
+  std::ostringstream ss;
+  ss << arena.chunks.size() << " arenas of 2 MB (" << arena.explicit_chunks
+     << " explicit, " << arena.chunks.size() - arena.explicit_chunks
+     << " transparent), " << arena.used_bytes / (1024 * 1024) << " MB in use";
+  return ss.str();
+}
+
+} // namespace dqn
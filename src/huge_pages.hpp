@@ -0,0 +1,72 @@
+#ifndef HUGE_PAGES_HPP_
+#define HUGE_PAGES_HPP_
+
+#include <cstddef>
+#include <new>
+#include <string>
+#include <caffe/caffe.hpp>
+
+namespace dqn {
+
+constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+/**
+ * Random minibatch sampling touches states all over a multi-GB replay
+ * memory and misses the TLB on nearly every access with 4 KB
+ * pages. With -huge_pages, replay states are carved out of 2 MB
+ * arenas backed by explicit huge pages (MAP_HUGETLB) when the system
+ * has some reserved, or by transparent huge pages otherwise.
+ */
+bool HugePagesEnabled();
+
+// Allocates bytes from the huge page arenas. Blocks are aligned to
+// cache lines and freed blocks are reused for allocations of the same size.
+void* ArenaAllocate(size_t bytes);
+void ArenaFree(void* block, size_t bytes);
+
+// Asks for transparent huge pages on the 2 MB aligned part of
+// [addr, addr + bytes). Returns the number of bytes advised.
+size_t AdviseHugePages(void* addr, size_t bytes);
+
+// Advises huge pages for the parameter and activation blobs of net.
+// Caffe allocates blobs itself, so only blobs spanning whole huge
+// pages benefit. Returns the number of bytes advised.
+size_t AdviseNetHugePages(caffe::Net<float>& net);
+
+// Describes arena usage and how the arenas are backed
+std::string DescribeHugePages();
+
+// Allocator for replay states. Uses the huge page arenas if enabled.
+template <typename T>
+struct HugePageAllocator {
+  using value_type = T;
+  HugePageAllocator() = default;
+  template <typename U>
+  HugePageAllocator(const HugePageAllocator<U>&) {}
+  T* allocate(size_t n) {
+    if (HugePagesEnabled()) {
+      return static_cast<T*>(ArenaAllocate(n * sizeof(T)));
+    }
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t n) {
+    if (HugePagesEnabled()) {
+      ArenaFree(p, n * sizeof(T));
+    } else {
+      ::operator delete(p);
+    }
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) {
+  return false;
+}
+
+} // namespace dqn
+
+#endif /* HUGE_PAGES_HPP_ */
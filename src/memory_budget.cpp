@@ -0,0 +1,114 @@
+#include "memory_budget.hpp"
+#include "dqn.hpp"
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+namespace dqn {
+
+DECLARE_int32(memory);
+DEFINE_string(memory_bytes, "", "Byte budget of each replay memory, e.g. 8G "
+              "or 512M. Overrides -memory with the number of transitions "
+              "that fit.");
+
+namespace {
+
+size_t ParseBytes(const std::string& input) {
+  size_t pos;
+  double value = std::stod(input, &pos);
+  std::string suffix = input.substr(pos);
+  if (suffix.empty() || suffix == "B") {
+    return value;
+  } else if (suffix == "K") {
+    return value * (1ul << 10);
+  } else if (suffix == "M") {
+    return value * (1ul << 20);
+  } else if (suffix == "G") {
+    return value * (1ul << 30);
+  }
+  LOG(FATAL) << "Invalid byte count: " << input;
+  return 0;
+}
+
+} // namespace
+
+size_t MallocBytes(size_t bytes) {
+  // glibc: 8 byte header, 16 byte granularity, 32 byte minimum
+  return std::max<size_t>(32, (bytes + 8 + 15) / 16 * 16);
+}
+
+size_t TransitionBytes(int state_size) {
+  // Every transition adds one state. Its next state is the state of
+  // the following transition and histories share earlier states. The
+  // paths filling replay memory keep that sharing and debug builds
+  // check it when transitions are added; a separate next state per
+  // transition would double the state bytes counted here.
+  size_t state_bytes = state_size * sizeof(float);
+  state_bytes = HugePagesEnabled() ?
+      (state_bytes + kStateAlignment - 1) / kStateAlignment * kStateAlignment :
+      MallocBytes(state_bytes);
+  // Pooled shared_ptr control block: vtable, two counts and the pointer
+  const size_t control_block_bytes = MallocBytes(4 * sizeof(void*));
+  return sizeof(Transition) + MallocBytes(sizeof(StateData)) + state_bytes +
+      control_block_bytes;
+}
+
+int ReplayCapacity(size_t transition_bytes) {
+  if (FLAGS_memory_bytes.empty()) {
+    return FLAGS_memory;
+  }
+  size_t capacity = ParseBytes(FLAGS_memory_bytes) / transition_bytes;
+  CHECK_GT(capacity, 0) << "-memory_bytes " << FLAGS_memory_bytes
+                        << " holds no transitions of " << transition_bytes
+                        << " bytes";
+  return std::min<size_t>(capacity, std::numeric_limits<int>::max());
+}
+
+size_t AvailableMemoryBytes() {
+  std::ifstream meminfo("/proc/meminfo");
+  std::string line;
+  while (std::getline(meminfo, line)) {
+    std::istringstream ss(line);
+    std::string key;
+    size_t kb;
+    if (ss >> key >> kb && key == "MemAvailable:") {
+      return kb * 1024;
+    }
+  }
+  return 0;
+}
+
+void CheckReplayBudget(size_t projected_bytes, int num_memories) {
+  size_t available = AvailableMemoryBytes();
+  LOG(INFO) << "Replay memory: " << num_memories << " x "
+            << FormatBytes(projected_bytes / num_memories) << " = "
+            << FormatBytes(projected_bytes) << " projected, "
+            << FormatBytes(available) << " available";
+  if (available == 0 || projected_bytes <= available) {
+    return;
+  }
+  if (FLAGS_memory_bytes.empty()) {
+    LOG(WARNING) << "Replay memory will not fit once full. Consider -memory_bytes.";
+  } else {
+    LOG(ERROR) << "-memory_bytes " << FLAGS_memory_bytes << " for "
+               << num_memories << " replay memories exceeds the "
+               << FormatBytes(available) << " available.";
+    exit(1);
+  }
+}
+
+std::string FormatBytes(size_t bytes) {
+  std::ostringstream ss;
+  ss.precision(3);
+  if (bytes >= (1ul << 30)) {
+    ss << bytes / double(1ul << 30) << " GB";
+  } else {
+    ss << bytes / double(1ul << 20) << " MB";
+  }
+  return ss.str();
+}
+
+} // namespace dqn
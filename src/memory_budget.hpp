@@ -0,0 +1,38 @@
+#ifndef MEMORY_BUDGET_HPP_
+#define MEMORY_BUDGET_HPP_
+
+#include <cstddef>
+#include <string>
+
+namespace dqn {
+
+/**
+ * Replay memories are sized either by a transition count (-memory)
+ * or by a byte budget (-memory_bytes). Bytes per transition grow with
+ * the number of players, so a budget keeps the RAM used fixed across
+ * team configurations.
+ */
+
+// Bytes a heap allocation of the given size takes from malloc
+size_t MallocBytes(size_t bytes);
+
+// Bytes held per transition of a DQN replay memory with states of
+// state_size features
+size_t TransitionBytes(int state_size);
+
+// Number of transitions of transition_bytes each that fit in the
+// budget, or -memory if no budget is given
+int ReplayCapacity(size_t transition_bytes);
+
+// MemAvailable of /proc/meminfo, or 0 if unknown
+size_t AvailableMemoryBytes();
+
+// Logs the projected bytes of all replay memories. Exits if they
+// exceed the available memory and were set by -memory_bytes.
+void CheckReplayBudget(size_t projected_bytes, int num_memories);
+
+std::string FormatBytes(size_t bytes);
+
+} // namespace dqn
+
+#endif /* MEMORY_BUDGET_HPP_ */
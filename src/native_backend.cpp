@@ -0,0 +1,252 @@
+#include "native_backend.hpp"
+#include <algorithm>
+#include <cmath>
+#include <glog/logging.h>
+
+namespace dqn {
+
+namespace {
+
+constexpr int kOutputSize = kActionSize + kActionParamSize;
+constexpr float kInitialLossScale = 1 << 12;
+// bf16 has the exponent range of fp32, so a larger scale only brings
+// overflows and skipped steps
+constexpr float kMaxLossScale = 1 << 16;
+constexpr int kLossScaleWindow = 1000;
+
+} // namespace
+
+NativeBackend::NativeBackend(const BackendNets& nets, int minibatch_size,
+                             bool bf16) :
+    nets_(nets),
+    bf16_(bf16),
+    actor_(new FusedMLP(*nets.actor_solver->net(), ActorLayerNames(),
+                        minibatch_size, bf16)),
+    critic_(new FusedMLP(*nets.critic_solver->net(), CriticLayerNames(),
+                         minibatch_size, bf16)),
+    actor_target_(new FusedMLP(*nets.actor_target, ActorLayerNames(),
+                               minibatch_size, bf16)),
+    critic_target_(new FusedMLP(*nets.critic_target, CriticLayerNames(),
+                                minibatch_size, bf16)),
+    state_input_size_(actor_->input_size()),
+    critic_input_size_(critic_->input_size()),
+    actor_batch_(0),
+    critic_batch_(0),
+    critic_input_(minibatch_size * critic_input_size_),
+    critic_target_input_(minibatch_size * critic_input_size_),
+    critic_input_diff_(minibatch_size * critic_input_size_),
+    critic_output_diff_(minibatch_size * critic_->output_size()),
+    actor_output_diff_(minibatch_size * kOutputSize),
+    critic_sumsq_(0),
+    actor_sumsq_(0),
+    loss_scale_(bf16 ? kInitialLossScale : 1),
+    good_steps_(0) {
+  const std::string unsupported = Unsupported(nets);
+  CHECK(unsupported.empty()) << unsupported;
+  CHECK_EQ(actor_->output_size(), kOutputSize);
+  CHECK_EQ(critic_input_size_, state_input_size_ + kOutputSize);
+  Import();
+#ifndef __AVX512BF16__
+  LOG_IF(WARNING, bf16_) << "No AVX512-BF16 on this build target, the bf16 "
+                         << "GEMMs are emulated and slower than fp32";
+#endif
+  LOG(INFO) << "Native backend training " << actor_->num_params() << " actor and "
+            << critic_->num_params() << " critic parameters"
+            << (bf16_ ? " with bf16 GEMMs" : "");
+}
+
+std::string NativeBackend::Unsupported(const BackendNets& nets) {
+  if (caffe::Caffe::mode() != caffe::Caffe::CPU) {
+    return "The native backend runs on the CPU";
+  }
+  if (!CanFuseAdamStep(*nets.actor_solver) ||
+      !CanFuseAdamStep(*nets.critic_solver)) {
+    return "The native backend needs Adam with a fixed learning rate, no "
+        "weight decay, iter_size 1 and no lr_mult";
+  }
+  // The critic's first layer must see the actor's inputs and outputs,
+  // not encoded states or the joint actions of several agents
+  const std::string first_layer = CriticLayerNames().front().front();
+  const int state_input_size = nets.actor_solver->net()->layer_by_name(
+      first_layer)->blobs()[0]->shape(1);
+  const int critic_input_size = nets.critic_solver->net()->layer_by_name(
+      first_layer)->blobs()[0]->shape(1);
+  if (critic_input_size != state_input_size + kOutputSize) {
+    return "The native backend needs the critic of a single agent with no "
+        "state encoder (-critic_encoder_layers 0)";
+  }
+  return "";
+}
+
+FusedMLP& NativeBackend::Mlp(BackendNet net) {
+  switch (net) {
+    case ACTOR: return *actor_;
+    case CRITIC: return *critic_;
+    case ACTOR_TARGET: return *actor_target_;
+    case CRITIC_TARGET: return *critic_target_;
+  }
+  LOG(FATAL) << "Unknown net " << net;
+  return *actor_;
+}
+
+void NativeBackend::Import() {
+  caffe::Solver<float>& actor_solver = *nets_.actor_solver;
+  caffe::Solver<float>& critic_solver = *nets_.critic_solver;
+  actor_->Load(*actor_solver.net(), ActorLayerNames(), &actor_solver);
+  critic_->Load(*critic_solver.net(), CriticLayerNames(), &critic_solver);
+  actor_target_->Load(*nets_.actor_target, ActorLayerNames());
+  critic_target_->Load(*nets_.critic_target, CriticLayerNames());
+}
+
+void NativeBackend::Export() {
+  caffe::Solver<float>& actor_solver = *nets_.actor_solver;
+  caffe::Solver<float>& critic_solver = *nets_.critic_solver;
+  actor_->Store(*actor_solver.net(), ActorLayerNames(), &actor_solver);
+  critic_->Store(*critic_solver.net(), CriticLayerNames(), &critic_solver);
+  actor_target_->Store(*nets_.actor_target, ActorLayerNames());
+  critic_target_->Store(*nets_.critic_target, CriticLayerNames());
+}
+
+void NativeBackend::PackCriticInput(const float* states, const float* actions,
+                                    const float* action_params, int batch,
+                                    std::vector<float>& input) const {
+  for (int n = 0; n < batch; ++n) {
+    float* row = input.data() + n * critic_input_size_;
+    std::copy(states + n * state_input_size_,
+              states + (n + 1) * state_input_size_, row);
+    std::copy(actions + n * kActionSize, actions + (n + 1) * kActionSize,
+              row + state_input_size_);
+    std::copy(action_params + n * kActionParamSize,
+              action_params + (n + 1) * kActionParamSize,
+              row + state_input_size_ + kActionSize);
+  }
+}
+
+void NativeBackend::ActorForward(BackendNet net, const float* states, int batch,
+                                 float* actions, float* action_params) {
+  // The actor's outputs are rows of actions then params
+  const float* outputs = Mlp(net).Forward(states, batch);
+  for (int n = 0; n < batch; ++n) {
+    const float* output = outputs + n * kOutputSize;
+    std::copy(output, output + kActionSize, actions + n * kActionSize);
+    std::copy(output + kActionSize, output + kOutputSize,
+              action_params + n * kActionParamSize);
+  }
+  if (net == ACTOR) {
+    actor_batch_ = batch;
+  }
+}
+
+const float* NativeBackend::CriticForward(BackendNet net, const float* states,
+                                          const float* actions,
+                                          const float* action_params, int batch) {
+  std::vector<float>& input = net == CRITIC ? critic_input_ : critic_target_input_;
+  PackCriticInput(states, actions, action_params, batch, input);
+  if (net == CRITIC) {
+    critic_batch_ = batch;
+  }
+  return Mlp(net).Forward(input.data(), batch);
+}
+
+void NativeBackend::CriticBackward(const float* q_values_diff, float* action_diff,
+                                   float* action_params_diff, bool param_grads) {
+  const int batch = critic_batch_;
+  const bool input_grads = action_diff || action_params_diff;
+  for (int n = 0; n < batch * critic_->output_size(); ++n) {
+    critic_output_diff_[n] = q_values_diff[n] * loss_scale_;
+  }
+  // Without bf16 the step can check nothing about the gradients
+  if (param_grads && !input_grads && !bf16_ &&
+      nets_.critic_solver->param().clip_gradients() < 0) {
+    critic_sumsq_ = -1;
+    return;
+  }
+  const double sumsq = critic_->Backward(
+      critic_output_diff_.data(), input_grads ? critic_input_diff_.data() : NULL,
+      param_grads);
+  if (param_grads) {
+    critic_sumsq_ = sumsq;
+  }
+  for (int n = 0; input_grads && n < batch; ++n) {
+    float* diff = critic_input_diff_.data() + n * critic_input_size_ +
+        state_input_size_;
+    for (int i = 0; i < kOutputSize; ++i) {
+      diff[i] /= loss_scale_;
+    }
+    if (action_diff) {
+      std::copy(diff, diff + kActionSize, action_diff + n * kActionSize);
+    }
+    if (action_params_diff) {
+      std::copy(diff + kActionSize, diff + kOutputSize,
+                action_params_diff + n * kActionParamSize);
+    }
+  }
+}
+
+void NativeBackend::ActorBackward(const float* action_diff,
+                                  const float* action_params_diff) {
+  for (int n = 0; n < actor_batch_; ++n) {
+    float* diff = actor_output_diff_.data() + n * kOutputSize;
+    std::copy(action_diff + n * kActionSize, action_diff + (n + 1) * kActionSize,
+              diff);
+    std::copy(action_params_diff + n * kActionParamSize,
+              action_params_diff + (n + 1) * kActionParamSize, diff + kActionSize);
+  }
+  if (nets_.actor_solver->param().clip_gradients() < 0) {
+    actor_sumsq_ = -1;
+    return;
+  }
+  actor_sumsq_ = actor_->Backward(actor_output_diff_.data(), NULL);
+}
+
+bool NativeBackend::Step(FusedMLP& net, const std::vector<float>& output_diff,
+                         double sumsq, const caffe::SolverParameter& solver_param,
+                         int iter, float loss_scale) {
+  const AdamConfig adam = GetAdamConfig(solver_param, iter);
+  if (sumsq < 0) {
+    net.BackwardAdam(output_diff.data(), adam);
+    return true;
+  }
+  if (!std::isfinite(sumsq)) {
+    return false;
+  }
+  const float clip_gradients = solver_param.clip_gradients();
+  const float l2norm = std::sqrt(sumsq) / loss_scale;
+  net.ApplyAdam(adam, (clip_gradients >= 0 && l2norm > clip_gradients ?
+                       clip_gradients / l2norm : 1) / loss_scale);
+  return true;
+}
+
+bool NativeBackend::CriticStep(int iter) {
+  if (Step(*critic_, critic_output_diff_, critic_sumsq_,
+           nets_.critic_solver->param(), iter, loss_scale_)) {
+    if (bf16_ && ++good_steps_ == kLossScaleWindow) {
+      loss_scale_ = std::min(loss_scale_ * 2, kMaxLossScale);
+      good_steps_ = 0;
+    }
+    return true;
+  }
+  CHECK(bf16_) << "Critic gradients not finite!";
+  loss_scale_ /= 2;
+  good_steps_ = 0;
+  LOG(WARNING) << "Critic gradients overflowed, step skipped and loss scale "
+               << "lowered to " << loss_scale_;
+  return false;
+}
+
+void NativeBackend::ActorStep(int iter) {
+  CHECK(Step(*actor_, actor_output_diff_, actor_sumsq_,
+             nets_.actor_solver->param(), iter)) << "Actor gradients not finite!";
+}
+
+void NativeBackend::SoftUpdateTargets(float tau) {
+  critic_target_->SoftUpdate(*critic_, tau);
+  actor_target_->SoftUpdate(*actor_, tau);
+}
+
+std::vector<ParamView> NativeBackend::Params(BackendNet net) {
+  return Mlp(net).Params(net == ACTOR || net == ACTOR_TARGET ?
+                         ActorLayerNames() : CriticLayerNames());
+}
+
+} // namespace dqn
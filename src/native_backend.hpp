@@ -0,0 +1,86 @@
+#ifndef NATIVE_BACKEND_HPP_
+#define NATIVE_BACKEND_HPP_
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "compute_backend.hpp"
+#include "fused_mlp.hpp"
+
+namespace dqn {
+
+/**
+ * Mirrors the actor, critic and target nets of a DQN in FusedMLPs and
+ * trains them without Caffe: no blobs, layers or solver passes, and no
+ * critic parameter gradients where only the action gradients are
+ * wanted. The mirrored nets must be those of CreateActorNet and
+ * CreateCriticNet for one agent, trained by Adam on the CPU.
+ *
+ * With bf16 the towers run their GEMMs in bf16 (see FusedMLP) and the
+ * critic's loss is scaled before its backward, halving the scale and
+ * skipping the step when the gradients overflow and doubling it, up to
+ * kMaxLossScale, after kLossScaleWindow steps that did not. Without
+ * AVX512-BF16 the bf16 GEMMs are emulated, slower than fp32.
+ */
+class NativeBackend : public ComputeBackend {
+public:
+  NativeBackend(const BackendNets& nets, int minibatch_size, bool bf16=false);
+  // Why the native backend cannot train nets, or empty if it can
+  static std::string Unsupported(const BackendNets& nets);
+
+  const char* name() const override { return bf16_ ? "native_bf16" : "native"; }
+  float tolerance() const override { return bf16_ ? 5e-2 : 1e-3; }
+  void ActorForward(BackendNet net, const float* states, int batch,
+                    float* actions, float* action_params) override;
+  const float* CriticForward(BackendNet net, const float* states,
+                             const float* actions, const float* action_params,
+                             int batch) override;
+  // Without gradient clipping, the backward that keeps parameter
+  // gradients is deferred to the step so Adam runs in its sweep.
+  void CriticBackward(const float* q_values_diff, float* action_diff,
+                      float* action_params_diff, bool param_grads) override;
+  void ActorBackward(const float* action_diff,
+                     const float* action_params_diff) override;
+  bool CriticStep(int iter) override;
+  void ActorStep(int iter) override;
+  void SoftUpdateTargets(float tau) override;
+  std::vector<ParamView> Params(BackendNet net) override;
+  void Import() override;
+  void Export() override;
+
+protected:
+  FusedMLP& Mlp(BackendNet net);
+  // Packs batch rows of states, actions and params into input
+  void PackCriticInput(const float* states, const float* actions,
+                       const float* action_params, int batch,
+                       std::vector<float>& input) const;
+  // Takes the Adam step of net with output_diff, clipping the
+  // gradients like Caffe's solvers
+  // Gradients are divided by loss_scale. Returns false, skipping the
+  // step, if they are not finite.
+  static bool Step(FusedMLP& net, const std::vector<float>& output_diff,
+                   double sumsq, const caffe::SolverParameter& solver_param,
+                   int iter, float loss_scale=1);
+
+protected:
+  BackendNets nets_;
+  const bool bf16_;
+  std::unique_ptr<FusedMLP> actor_, critic_, actor_target_, critic_target_;
+  const int state_input_size_; // frames * state_size
+  const int critic_input_size_;
+  int actor_batch_;  // Of the last forward of ACTOR
+  int critic_batch_; // Of the last forward of CRITIC
+  std::vector<float> critic_input_;
+  std::vector<float> critic_target_input_;
+  std::vector<float> critic_input_diff_;
+  // Output gradients of the last backward, and the squared norm of the
+  // parameter gradients it computed (-1 if deferred)
+  std::vector<float> critic_output_diff_, actor_output_diff_;
+  double critic_sumsq_, actor_sumsq_;
+  float loss_scale_; // Of the critic's q-value gradients, 1 unless bf16_
+  int good_steps_;   // Since loss_scale_ last changed
+};
+
+} // namespace dqn
+
+#endif /* NATIVE_BACKEND_HPP_ */
@@ -0,0 +1,98 @@
+#include "numa_placement.hpp"
+#include <sstream>
+#include <vector>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#ifdef USE_NUMA
+#include <numa.h>
+#include <numaif.h>
+#endif
+
+DEFINE_bool(numa, false, "Pin each agent to a NUMA node and allocate its "
+            "nets and replay memory there.");
+DEFINE_string(numa_nodes, "", "Comma separated NUMA node of each agent. "
+              "Default: round robin.");
+
+namespace dqn {
+
+bool NumaEnabled() {
+  if (!FLAGS_numa) {
+    return false;
+  }
+#ifdef USE_NUMA
+  return numa_available() >= 0;
+#else
+  LOG_FIRST_N(WARNING, 1) << "-numa ignored: dqn was built without libnuma.";
+  return false;
+#endif
+}
+
+int NumaNodeForAgent(int tid) {
+#ifdef USE_NUMA
+  const int num_nodes = numa_max_node() + 1;
+  std::istringstream ss(FLAGS_numa_nodes);
+  std::string token;
+  for (int i = 0; std::getline(ss, token, ','); ++i) {
+    if (i == tid) {
+      int node = std::stoi(token);
+      CHECK(node >= 0 && node < num_nodes) << "Invalid NUMA node " << node;
+      return node;
+    }
+  }
+  return tid % num_nodes;
+#else
+  return 0;
+#endif
+}
+
+void BindThreadToNumaNode(int node) {
+#ifdef USE_NUMA
+  CHECK_EQ(numa_run_on_node(node), 0) << "Unable to run on NUMA node " << node;
+  numa_set_preferred(node);
+#endif
+}
+
+void InterleaveOnNumaNodes(void* addr, size_t bytes) {
+#ifdef USE_NUMA
+  if (NumaEnabled()) {
+    numa_interleave_memory(addr, bytes, numa_all_nodes_ptr);
+  }
+#endif
+}
+
+int NumaNodeOfAddress(const void* addr) {
+#ifdef USE_NUMA
+  void* page = const_cast<void*>(addr);
+  int status = -1;
+  if (numa_move_pages(0, 1, &page, NULL, &status, 0) == 0 && status >= 0) {
+    return status;
+  }
+#endif
+  return -1;
+}
+
+std::string DescribeNumaNode(int node) {
+  std::ostringstream ss;
+  ss << "node " << node;
+#ifdef USE_NUMA
+  struct bitmask* cpus = numa_allocate_cpumask();
+  if (numa_node_to_cpus(node, cpus) == 0) {
+    ss << " cpus [";
+    bool first = true;
+    for (unsigned i = 0; i < cpus->size; ++i) {
+      if (numa_bitmask_isbitset(cpus, i)) {
+        ss << (first ? "" : ",") << i;
+        first = false;
+      }
+    }
+    ss << "]";
+  }
+  numa_free_cpumask(cpus);
+  long long free_bytes = 0;
+  long long total_bytes = numa_node_size64(node, &free_bytes);
+  ss << " mem " << (free_bytes >> 20) << "/" << (total_bytes >> 20) << " MB free";
+#endif
+  return ss.str();
+}
+
+} // namespace dqn
@@ -0,0 +1,38 @@
+#ifndef NUMA_PLACEMENT_HPP_
+#define NUMA_PLACEMENT_HPP_
+
+#include <cstddef>
+#include <string>
+
+namespace dqn {
+
+/**
+ * NUMA placement of agent threads and their memory. Everything here
+ * is a no-op unless -numa is given and dqn was built with libnuma.
+ */
+
+// True if NUMA placement was requested and is supported.
+bool NumaEnabled();
+
+// Node that agent tid should run on. Taken from -numa_nodes if given,
+// otherwise agents are spread round robin over the nodes.
+int NumaNodeForAgent(int tid);
+
+// Runs the calling thread on the cpus of node and makes node the
+// preferred target of its allocations. Caffe blobs and replay
+// memory allocated afterwards are first touched on that node.
+void BindThreadToNumaNode(int node);
+
+// Spreads the pages of [addr, addr + bytes) over all nodes. Used for
+// memory sampled by agents running on different nodes.
+void InterleaveOnNumaNodes(void* addr, size_t bytes);
+
+// Returns the node holding the page of addr or -1 if unknown.
+int NumaNodeOfAddress(const void* addr);
+
+// Short description of the cpus and memory of node.
+std::string DescribeNumaNode(int node);
+
+} // namespace dqn
+
+#endif /* NUMA_PLACEMENT_HPP_ */
@@ -0,0 +1,154 @@
+#include "offline_trainer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+DEFINE_int32(offline_workers, 0, "Threads preparing minibatches for each "
+             "-learn_offline agent. Default: the agent's share of the cores "
+             "but one for its learner.");
+DEFINE_int32(offline_prefetch, 2, "Minibatches each worker may have ready "
+             "ahead of the learner.");
+DEFINE_bool(offline_epochs, false, "Draw -learn_offline minibatches in shuffled "
+            "epochs over the whole replay memory instead of uniformly.");
+
+namespace dqn {
+
+DECLARE_int32(loss_display_iter);
+
+OfflineTrainer::OfflineTrainer(DQN& dqn, int learners) :
+    dqn_(dqn),
+    epochs_(FLAGS_offline_epochs),
+    stop_(false),
+    epoch_rng_(dqn.SplitRng()),
+    cursor_(0),
+    epoch_(0) {
+  CHECK_GE(dqn_.sampleable_size(), dqn_.minibatch_size())
+      << "Offline learning needs a replay memory of at least one minibatch.";
+  CHECK_GT(learners, 0);
+  int workers = FLAGS_offline_workers;
+  if (workers <= 0) {
+    // Each learner keeps a core for its updates
+    const int cores = std::thread::hardware_concurrency();
+    workers = std::max(1, cores / learners - 1);
+  }
+  CHECK_GT(FLAGS_offline_prefetch, 0);
+  for (int i = 0; i < workers * FLAGS_offline_prefetch; ++i) {
+    batches_.emplace_back(new Minibatch);
+    free_.push_back(batches_.back().get());
+  }
+  if (epochs_) {
+    order_.resize(dqn_.sampleable_size());
+    for (int i = 0; i < order_.size(); ++i) {
+      order_[i] = i;
+    }
+    // Start past the end so the first draw shuffles
+    cursor_ = order_.size();
+  }
+  LOG(INFO) << "Offline training with " << workers << " workers, minibatches of "
+            << dqn_.minibatch_size() << " drawn "
+            << (epochs_ ? "in epochs" : "uniformly") << " from "
+            << dqn_.sampleable_size() << " transitions";
+  for (int i = 0; i < workers; ++i) {
+    workers_.emplace_back(&OfflineTrainer::Work, this, dqn_.SplitRng());
+  }
+}
+
+OfflineTrainer::~OfflineTrainer() {
+  StopWorkers();
+}
+
+void OfflineTrainer::StopWorkers() {
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    stop_ = true;
+  }
+  free_cv_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+  workers_.clear();
+}
+
+std::vector<int> OfflineTrainer::NextTransitions(Rng& rng) {
+  const int n = dqn_.minibatch_size();
+  if (!epochs_) {
+    return dqn_.SampleTransitionsFromMemory(n, rng);
+  }
+  std::lock_guard<std::mutex> lock(epoch_mutex_);
+  if (cursor_ + n > order_.size()) {
+    // The remainder of the last epoch is dropped
+    std::shuffle(order_.begin(), order_.end(), epoch_rng_);
+    cursor_ = 0;
+    epoch_++;
+  }
+  std::vector<int> transitions(order_.begin() + cursor_,
+                               order_.begin() + cursor_ + n);
+  cursor_ += n;
+  // Order within a minibatch does not matter, memory order gathers faster
+  std::sort(transitions.begin(), transitions.end());
+  return transitions;
+}
+
+void OfflineTrainer::Work(Rng rng) {
+  while (true) {
+    Minibatch* batch;
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex_);
+      free_cv_.wait(lock, [this] { return stop_ || !free_.empty(); });
+      if (stop_) {
+        return;
+      }
+      batch = free_.back();
+      free_.pop_back();
+    }
+    dqn_.PrepareMinibatch(NextTransitions(rng), *batch);
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      ready_.push_back(batch);
+    }
+    ready_cv_.notify_one();
+  }
+}
+
+double OfflineTrainer::PopReady(Minibatch*& batch) {
+  auto start = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(queue_mutex_);
+  ready_cv_.wait(lock, [this] { return !ready_.empty(); });
+  batch = ready_.front();
+  ready_.pop_front();
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+void OfflineTrainer::Train(int max_iter) {
+  auto report_start = std::chrono::steady_clock::now();
+  double waited = 0;
+  int updates = 0;
+  while (dqn_.max_iter() < max_iter) {
+    Minibatch* batch;
+    waited += PopReady(batch);
+    dqn_.Update(*batch);
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      free_.push_back(batch);
+    }
+    free_cv_.notify_one();
+    if (++updates % FLAGS_loss_display_iter == 0) {
+      double seconds = std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - report_start).count();
+      std::lock_guard<std::mutex> lock(epoch_mutex_);
+      LOG(INFO) << "Offline: " << updates * dqn_.minibatch_size() / seconds
+                << " samples/s, " << updates / seconds << " updates/s, "
+                << "waited on workers " << int(100 * waited / seconds)
+                << "% of the time" << (epochs_ ? ", epoch " : "")
+                << (epochs_ ? std::to_string(epoch_) : "");
+      report_start = std::chrono::steady_clock::now();
+      waited = 0;
+      updates = 0;
+    }
+  }
+  StopWorkers();
+}
+
+} // namespace dqn
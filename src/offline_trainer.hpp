@@ -0,0 +1,60 @@
+#ifndef OFFLINE_TRAINER_HPP_
+#define OFFLINE_TRAINER_HPP_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "dqn.hpp"
+
+namespace dqn {
+
+/**
+ * Trains a DQN on a fixed replay memory, no HFO server needed. Worker
+ * threads sample minibatches and gather them from replay memory into
+ * a bounded queue while the calling thread runs the nets, so updates
+ * rarely wait on memory. Minibatches are drawn uniformly, as online,
+ * or in shuffled epochs over the whole memory with -offline_epochs.
+ */
+class OfflineTrainer {
+public:
+  // learners is the number of OfflineTrainers running at once, which
+  // share the cores between their workers by default
+  explicit OfflineTrainer(DQN& dqn, int learners=1);
+  ~OfflineTrainer();
+
+  // Updates dqn until either of its solvers reaches max_iter, as
+  // online training stops
+  void Train(int max_iter);
+
+protected:
+  // Prepares minibatches until stopped
+  void Work(Rng rng);
+  // Transitions of the next minibatch
+  std::vector<int> NextTransitions(Rng& rng);
+  // Waits for a prepared minibatch. Returns the seconds spent waiting.
+  double PopReady(Minibatch*& batch);
+  void StopWorkers();
+
+protected:
+  DQN& dqn_;
+  const bool epochs_;
+  std::vector<std::unique_ptr<Minibatch> > batches_;
+  std::vector<std::thread> workers_;
+  std::mutex queue_mutex_; // Guards ready_, free_ and stop_
+  std::condition_variable ready_cv_, free_cv_;
+  std::deque<Minibatch*> ready_; // Prepared, oldest first
+  std::vector<Minibatch*> free_; // Consumed by the learner
+  bool stop_;
+  std::mutex epoch_mutex_; // Guards the fields below
+  Rng epoch_rng_;
+  std::vector<int> order_; // Shuffled transitions of the current epoch
+  size_t cursor_;
+  int epoch_;
+};
+
+} // namespace dqn
+
+#endif /* OFFLINE_TRAINER_HPP_ */
@@ -0,0 +1,108 @@
+#include "random.hpp"
+
+namespace dqn {
+
+namespace {
+
+uint64_t SplitMix64(uint64_t& x) {
+  uint64_t z = (x += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  return z ^ (z >> 31);
+}
+
+} // namespace
+
+void Rng::seed(uint64_t seed) {
+  for (int lane = 0; lane < kLanes; ++lane) {
+    for (int i = 0; i < 4; ++i) {
+      s_[i][lane] = SplitMix64(seed);
+    }
+  }
+}
+
+Rng Rng::Stream(uint64_t seed, int index) {
+  Rng rng(seed);
+  for (int i = 0; i < index; ++i) {
+    rng.Jump();
+  }
+  return rng;
+}
+
+uint64_t Rng::Next(int lane) {
+  uint64_t* s0 = &s_[0][lane];
+  uint64_t* s1 = &s_[1][lane];
+  uint64_t* s2 = &s_[2][lane];
+  uint64_t* s3 = &s_[3][lane];
+  const uint64_t result = Rotl(*s0 + *s3, 23) + *s0;
+  const uint64_t t = *s1 << 17;
+  *s2 ^= *s0;
+  *s3 ^= *s1;
+  *s1 ^= *s2;
+  *s0 ^= *s3;
+  *s2 ^= t;
+  *s3 = Rotl(*s3, 45);
+  return result;
+}
+
+void Rng::NextLanes(uint64_t out[kLanes]) {
+  for (int lane = 0; lane < kLanes; ++lane) {
+    out[lane] = Rotl(s_[0][lane] + s_[3][lane], 23) + s_[0][lane];
+    const uint64_t t = s_[1][lane] << 17;
+    s_[2][lane] ^= s_[0][lane];
+    s_[3][lane] ^= s_[1][lane];
+    s_[1][lane] ^= s_[2][lane];
+    s_[0][lane] ^= s_[3][lane];
+    s_[2][lane] ^= t;
+    s_[3][lane] = Rotl(s_[3][lane], 45);
+  }
+}
+
+void Rng::Jump() {
+  static const uint64_t kJump[] = { 0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+                                    0xa9582618e03fc9aa, 0x39abdc4529b1661c };
+  for (int lane = 0; lane < kLanes; ++lane) {
+    uint64_t jumped[4] = {0, 0, 0, 0};
+    for (uint64_t word : kJump) {
+      for (int b = 0; b < 64; ++b) {
+        if (word & (uint64_t(1) << b)) {
+          for (int i = 0; i < 4; ++i) {
+            jumped[i] ^= s_[i][lane];
+          }
+        }
+        Next(lane);
+      }
+    }
+    for (int i = 0; i < 4; ++i) {
+      s_[i][lane] = jumped[i];
+    }
+  }
+}
+
+Rng Rng::Split() {
+  Rng child = *this;
+  Jump();
+  return child;
+}
+
+void Rng::FillUniformInt(int* out, int count, uint32_t n) {
+  uint64_t block[kLanes];
+  for (int i = 0; i < count; i += kLanes) {
+    NextLanes(block);
+    for (int lane = 0; lane < kLanes && i + lane < count; ++lane) {
+      out[i + lane] = ToRange(block[lane], n);
+    }
+  }
+}
+
+void Rng::FillUniform(float* out, int count, float lo, float hi) {
+  uint64_t block[kLanes];
+  for (int i = 0; i < count; i += kLanes) {
+    NextLanes(block);
+    for (int lane = 0; lane < kLanes && i + lane < count; ++lane) {
+      out[i + lane] = lo + (hi - lo) * ToUnit(block[lane]);
+    }
+  }
+}
+
+} // namespace dqn
@@ -0,0 +1,62 @@
+#ifndef RANDOM_HPP_
+#define RANDOM_HPP_
+
+#include <cstdint>
+
+namespace dqn {
+
+/**
+ * xoshiro256++ generator, much cheaper than std::mt19937 and usable
+ * with the std distributions. It runs kLanes independent lanes; the
+ * Fill methods step all lanes at once in loops the compiler turns
+ * into SIMD code. Streams split off by Jump/Split/Stream are 2^128
+ * steps apart, so threads can each own one and stay reproducible
+ * without sharing state.
+ */
+class Rng {
+public:
+  using result_type = uint64_t;
+  static constexpr int kLanes = 4;
+
+  explicit Rng(uint64_t seed = 0) { this->seed(seed); }
+  void seed(uint64_t seed);
+
+  // The index-th stream of seed
+  static Rng Stream(uint64_t seed, int index);
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return ~result_type(0); }
+  result_type operator()() { return Next(0); }
+
+  // Advances every lane by 2^128 steps
+  void Jump();
+  // Returns a copy of this stream and jumps this one past it
+  Rng Split();
+
+  // Uniform in [0, n). Multiply-shift instead of rejection: the bias
+  // is below n / 2^32, irrelevant for replay memory sizes.
+  uint32_t UniformInt(uint32_t n) { return ToRange((*this)(), n); }
+  // Uniform in [lo, hi)
+  float Uniform(float lo, float hi) { return lo + (hi - lo) * ToUnit((*this)()); }
+
+  // Bulk versions of UniformInt and Uniform
+  void FillUniformInt(int* out, int count, uint32_t n);
+  void FillUniform(float* out, int count, float lo, float hi);
+
+protected:
+  static uint32_t ToRange(uint64_t x, uint32_t n) {
+    return (uint64_t(uint32_t(x >> 32)) * n) >> 32;
+  }
+  static float ToUnit(uint64_t x) { return (x >> 40) * (1.0f / (1u << 24)); }
+  static uint64_t Rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+  uint64_t Next(int lane);
+  // Steps every lane once
+  void NextLanes(uint64_t out[kLanes]);
+
+protected:
+  uint64_t s_[4][kLanes]; // State word, lane
+};
+
+} // namespace dqn
+
+#endif /* RANDOM_HPP_ */
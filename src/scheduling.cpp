@@ -0,0 +1,154 @@
+#include "scheduling.hpp"
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <vector>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+DEFINE_string(act_cpus, "", "Cpus reserved for acting, e.g. 0-1,4. Separate "
+              "the sets of different agents with ':'. A single set is shared. "
+              "With -numa only the cpus of the agent's node are used.");
+DEFINE_string(learn_cpus, "", "Cpus used for learning, same format as "
+              "-act_cpus. Default: all cpus not reserved for acting.");
+DEFINE_int32(act_nice, 0, "Nice value while acting.");
+DEFINE_int32(learn_nice, 0, "Nice value while learning.");
+
+namespace dqn {
+
+namespace {
+
+std::vector<std::string> Split(const std::string& input, char delim) {
+  std::vector<std::string> tokens;
+  std::istringstream ss(input);
+  std::string token;
+  while (std::getline(ss, token, delim)) {
+    tokens.push_back(token);
+  }
+  return tokens;
+}
+
+// Parses a cpu list such as "0-3,8"
+cpu_set_t ParseCpuList(const std::string& list) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (const std::string& range : Split(list, ',')) {
+    std::vector<std::string> bounds = Split(range, '-');
+    CHECK(bounds.size() == 1 || bounds.size() == 2) << "Invalid cpus: " << list;
+    int first = std::stoi(bounds.front());
+    int last = std::stoi(bounds.back());
+    for (int cpu = first; cpu <= last; ++cpu) {
+      CPU_SET(cpu, &cpus);
+    }
+  }
+  return cpus;
+}
+
+// Returns the cpu set of agent tid from a ':' separated list of sets
+std::string AgentCpuList(const std::string& flag, int tid) {
+  std::vector<std::string> sets = Split(flag, ':');
+  if (sets.empty()) {
+    return "";
+  }
+  CHECK(sets.size() == 1 || tid < int(sets.size()))
+      << "\"" << flag << "\" has " << sets.size() << " cpu sets but agent "
+      << tid << " needs its own. Give one set per agent or a single shared set.";
+  return sets.size() == 1 ? sets[0] : sets[tid];
+}
+
+std::string CpuSetToString(const cpu_set_t& cpus) {
+  std::ostringstream ss;
+  bool first = true;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &cpus)) {
+      ss << (first ? "" : ",") << cpu;
+      first = false;
+    }
+  }
+  return ss.str();
+}
+
+// The cpus the calling thread was bound to before its first role,
+// e.g. those of its -numa node
+const cpu_set_t& BoundCpus() {
+  thread_local bool captured = false;
+  thread_local cpu_set_t cpus;
+  if (!captured) {
+    int err = pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+    CHECK_EQ(err, 0) << "Unable to get cpus: " << strerror(err);
+    captured = true;
+  }
+  return cpus;
+}
+
+cpu_set_t RoleCpus(int tid, ThreadRole role) {
+  cpu_set_t cpus;
+  if (role == ACTING && !FLAGS_act_cpus.empty()) {
+    cpus = ParseCpuList(AgentCpuList(FLAGS_act_cpus, tid));
+  } else if (role == LEARNING && !FLAGS_learn_cpus.empty()) {
+    cpus = ParseCpuList(AgentCpuList(FLAGS_learn_cpus, tid));
+  } else {
+    // Everything not reserved for acting by any agent
+    CPU_ZERO(&cpus);
+    for (int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN); ++cpu) {
+      CPU_SET(cpu, &cpus);
+    }
+    for (const std::string& set : Split(FLAGS_act_cpus, ':')) {
+      cpu_set_t reserved = ParseCpuList(set);
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &reserved)) {
+          CPU_CLR(cpu, &cpus);
+        }
+      }
+    }
+  }
+  // Stay within the binding, so a -numa agent keeps its memory local
+  cpu_set_t bound_cpus;
+  CPU_AND(&bound_cpus, &cpus, &BoundCpus());
+  CHECK_GT(CPU_COUNT(&bound_cpus), 0)
+      << "The " << (role == ACTING ? "acting" : "learning") << " cpus ["
+      << CpuSetToString(cpus) << "] of agent " << tid << " lie outside the cpus ["
+      << CpuSetToString(BoundCpus()) << "] it is bound to, e.g. by -numa";
+  return bound_cpus;
+}
+
+} // namespace
+
+bool SchedulingEnabled() {
+  return !FLAGS_act_cpus.empty() || !FLAGS_learn_cpus.empty() ||
+      FLAGS_act_nice != 0 || FLAGS_learn_nice != 0;
+}
+
+void SetThreadRole(int tid, ThreadRole role) {
+  if (!SchedulingEnabled()) {
+    return;
+  }
+  if (!FLAGS_act_cpus.empty() || !FLAGS_learn_cpus.empty()) {
+    cpu_set_t cpus = RoleCpus(tid, role);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+    CHECK_EQ(err, 0) << "Unable to set cpus " << CpuSetToString(cpus)
+                     << ": " << strerror(err);
+  }
+  // Lowering the nice value again needs CAP_SYS_NICE or RLIMIT_NICE.
+  // Without it we stay at the lower priority and only move cpus.
+  int nice = role == ACTING ? FLAGS_act_nice : FLAGS_learn_nice;
+  if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice) != 0) {
+    LOG_FIRST_N(WARNING, 1) << "Unable to set nice " << nice << ": "
+                            << strerror(errno);
+  }
+}
+
+std::string DescribeScheduling(int tid) {
+  std::ostringstream ss;
+  ss << "acting on cpus [" << CpuSetToString(RoleCpus(tid, ACTING))
+     << "] nice " << FLAGS_act_nice << ", learning on cpus ["
+     << CpuSetToString(RoleCpus(tid, LEARNING)) << "] nice " << FLAGS_learn_nice;
+  return ss.str();
+}
+
+} // namespace dqn
@@ -0,0 +1,33 @@
+#ifndef SCHEDULING_HPP_
+#define SCHEDULING_HPP_
+
+#include <string>
+
+namespace dqn {
+
+/**
+ * Each agent thread alternates between acting (playing an episode
+ * against the server clock) and learning (running Update). A
+ * learning agent must not starve a teammate that is acting, so each
+ * role can get its own cpus and nice value via -act_cpus,
+ * -learn_cpus, -act_nice and -learn_nice.
+ *
+ * Role cpus are narrowed to the cpus the thread was bound to before
+ * its first role, such as its -numa node, so both flags can be used
+ * together.
+ */
+enum ThreadRole { ACTING, LEARNING };
+
+// True if any scheduling flag was given
+bool SchedulingEnabled();
+
+// Moves the calling thread of agent tid to the cpus and priority of
+// the given role.
+void SetThreadRole(int tid, ThreadRole role);
+
+// Describes the cpus and priority of both roles of agent tid
+std::string DescribeScheduling(int tid);
+
+} // namespace dqn
+
+#endif /* SCHEDULING_HPP_ */
@@ -0,0 +1,258 @@
+#include "shared_replay_memory.hpp"
+#include "numa_placement.hpp"
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <thread>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <glog/logging.h>
+
+namespace dqn {
+
+constexpr int SharedReplayMemory::kActorOutputSize;
+constexpr uint64_t SharedReplayMemory::kMagic;
+constexpr int SharedReplayMemory::kAttachTimeoutSeconds;
+
+namespace {
+
+// What a segment records about the replay memory file it was loaded from
+struct SnapshotIdentity {
+  std::string path;
+  int64_t bytes;
+  int64_t mtime;
+};
+
+SnapshotIdentity IdentifySnapshot(const std::string& filename) {
+  CHECK(boost::filesystem::is_regular_file(filename))
+      << "Invalid file: " << filename;
+  SnapshotIdentity id;
+  id.path = boost::filesystem::canonical(filename).string();
+  // Keep the end of long paths, where they differ
+  const size_t max_length = sizeof(SharedReplayHeader::snapshot) - 1;
+  if (id.path.size() > max_length) {
+    id.path = id.path.substr(id.path.size() - max_length);
+  }
+  id.bytes = boost::filesystem::file_size(filename);
+  id.mtime = boost::filesystem::last_write_time(filename);
+  return id;
+}
+
+// A loader that has not written its pid yet counts as alive
+bool LoaderAlive(pid_t pid) {
+  return pid == 0 || kill(pid, 0) == 0 || errno == EPERM;
+}
+
+// Unlinks name only if it still refers to the segment with inode ino,
+// not one another process has created since.
+void UnlinkSegment(const std::string& name, ino_t ino) {
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  const bool same = fstat(fd, &st) == 0 && st.st_ino == ino;
+  close(fd);
+  if (same) {
+    SharedReplayMemory::Unlink(name);
+  }
+}
+
+} // namespace
+
+SharedReplayMemory::SharedReplayMemory(const std::string& name,
+                                       const std::string& memory_snapshot,
+                                       int state_size) :
+    name_(name),
+    state_size_(state_size),
+    state_stride_(GetStateOps(state_size).stride),
+    mapped_bytes_(0),
+    mapping_(NULL),
+    header_(NULL),
+    transitions_(NULL),
+    inode_(0) {
+  CHECK(!name_.empty() && name_[0] == '/')
+      << "Shared memory name must start with '/': " << name_;
+  while (true) {
+    int fd = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd >= 0) {
+      CHECK(!memory_snapshot.empty())
+          << "Shared replay memory " << name_ << " does not exist yet and no "
+          << "replay memory was given to load into it.";
+      Create(fd, memory_snapshot);
+      close(fd);
+      break;
+    }
+    CHECK_EQ(errno, EEXIST) << "shm_open(" << name_ << ") failed: "
+                            << strerror(errno);
+    fd = shm_open(name_.c_str(), O_RDONLY, 0);
+    if (fd < 0 && errno == ENOENT) {
+      continue; // Unlinked since, so try to create it again
+    }
+    CHECK_GE(fd, 0) << "shm_open(" << name_ << ") failed: " << strerror(errno);
+    struct stat st;
+    CHECK_EQ(fstat(fd, &st), 0) << "fstat failed: " << strerror(errno);
+    const bool attached = Attach(fd, memory_snapshot);
+    close(fd);
+    if (attached) {
+      break;
+    }
+    LOG(WARNING) << "Removing stale shared replay memory " << name_;
+    UnlinkSegment(name_, st.st_ino);
+  }
+  CHECK_EQ(header_->state_stride, state_stride_);
+}
+
+SharedReplayMemory::~SharedReplayMemory() {
+  Unmap();
+  if (inode_ != 0) {
+    UnlinkSegment(name_, inode_);
+  }
+}
+
+void SharedReplayMemory::Unlink(const std::string& name) {
+  shm_unlink(name.c_str());
+}
+
+void SharedReplayMemory::Unmap() {
+  if (mapping_ != NULL) {
+    munmap(mapping_, mapped_bytes_);
+  }
+  mapping_ = NULL;
+  header_ = NULL;
+  transitions_ = NULL;
+}
+
+int SharedReplayMemory::EpisodeStart(int i, int max_lookback) const {
+  int start = i;
+  while (start > 0 && i - start < max_lookback && !terminal(start - 1)) {
+    --start;
+  }
+  return start;
+}
+
+void SharedReplayMemory::Create(int fd, const std::string& memory_snapshot) {
+  const SnapshotIdentity id = IdentifySnapshot(memory_snapshot);
+  struct stat st;
+  CHECK_EQ(fstat(fd, &st), 0) << "fstat failed: " << strerror(errno);
+  inode_ = st.st_ino;
+  LOG(INFO) << "Loading replay memory from " << memory_snapshot
+            << " into shared memory " << name_;
+  std::ifstream ifile(memory_snapshot.c_str(),
+                      std::ios_base::in | std::ofstream::binary);
+  boost::iostreams::filtering_istream in;
+  in.push(boost::iostreams::gzip_decompressor());
+  in.push(ifile);
+  int num_transitions;
+  in.read((char*)&num_transitions, sizeof(int));
+  const int stride = RoundUpToLine(state_stride_ + kActorOutputSize + 3);
+  mapped_bytes_ = sizeof(SharedReplayHeader) +
+      static_cast<size_t>(num_transitions) * stride * sizeof(float);
+  CHECK_EQ(ftruncate(fd, mapped_bytes_), 0)
+      << "Unable to size " << name_ << ": " << strerror(errno);
+  mapping_ = mmap(NULL, mapped_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  CHECK(mapping_ != MAP_FAILED) << "mmap failed: " << strerror(errno);
+  // Learners on every node sample from this, so spread it before filling
+  InterleaveOnNumaNodes(mapping_, mapped_bytes_);
+  if (HugePagesEnabled()) {
+    AdviseHugePages(mapping_, mapped_bytes_);
+  }
+  header_ = new (mapping_) SharedReplayHeader;
+  header_->ready.store(0);
+  header_->magic = kMagic;
+  header_->state_size = state_size_;
+  header_->state_stride = state_stride_;
+  header_->stride = stride;
+  header_->num_transitions = num_transitions;
+  header_->loader_pid = getpid();
+  header_->snapshot_bytes = id.bytes;
+  header_->snapshot_mtime = id.mtime;
+  std::fill(header_->snapshot, header_->snapshot + sizeof(header_->snapshot), 0);
+  std::copy(id.path.begin(), id.path.end(), header_->snapshot);
+  float* data = reinterpret_cast<float*>(header_ + 1);
+  transitions_ = data;
+  int episodes = 0;
+  bool terminal = true;
+  for (int i = 0; i < num_transitions; ++i) {
+    float* rec = data + static_cast<size_t>(i) * stride;
+    in.read((char*)rec, state_size_ * sizeof(float));
+    in.read((char*)(rec + state_stride_), sizeof(ActorOutput));
+    in.read((char*)(rec + state_stride_ + kActorOutputSize), sizeof(float));
+    in.read((char*)(rec + state_stride_ + kActorOutputSize + 1), sizeof(float));
+    in.read((char*)&terminal, sizeof(bool));
+    rec[state_stride_ + kActorOutputSize + 2] = terminal ? 1 : 0;
+    if (terminal) { episodes++; }
+  }
+  CHECK(in) << "Truncated replay memory " << memory_snapshot;
+  header_->num_episodes = episodes;
+  header_->ready.store(1, std::memory_order_release);
+  // Loaders are learners too. Drop write access like everyone else.
+  CHECK_EQ(mprotect(mapping_, mapped_bytes_, PROT_READ), 0);
+  LOG(INFO) << "Shared replay memory " << name_ << " holds " << num_transitions
+            << " transitions with " << episodes << " episodes ("
+            << mapped_bytes_ / (1024 * 1024) << " MB)";
+}
+
+bool SharedReplayMemory::Attach(int fd, const std::string& memory_snapshot) {
+  // Wait for the loader to size the segment and finish filling it
+  LOG(INFO) << "Waiting for shared replay memory " << name_;
+  const auto deadline = std::chrono::steady_clock::now() +
+      std::chrono::seconds(kAttachTimeoutSeconds);
+  struct stat st;
+  while (true) {
+    CHECK_EQ(fstat(fd, &st), 0) << "fstat failed: " << strerror(errno);
+    if (st.st_size >= sizeof(SharedReplayHeader)) {
+      mapped_bytes_ = st.st_size;
+      mapping_ = mmap(NULL, mapped_bytes_, PROT_READ, MAP_SHARED, fd, 0);
+      CHECK(mapping_ != MAP_FAILED) << "mmap failed: " << strerror(errno);
+      header_ = static_cast<SharedReplayHeader*>(mapping_);
+      if (header_->ready.load(std::memory_order_acquire)) {
+        break;
+      }
+      const pid_t loader = header_->loader_pid;
+      Unmap();
+      if (!LoaderAlive(loader)) {
+        LOG(WARNING) << "The loader of " << name_ << " died";
+        return false;
+      }
+    }
+    CHECK(std::chrono::steady_clock::now() < deadline)
+        << "Timed out waiting for the loader of " << name_ << ". If it is "
+        << "stuck, remove /dev/shm" << name_ << " and restart.";
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  if (header_->magic != kMagic || header_->state_size != state_size_) {
+    LOG(WARNING) << name_ << " holds another format or state size";
+    Unmap();
+    return false;
+  }
+  if (!memory_snapshot.empty()) {
+    const SnapshotIdentity id = IdentifySnapshot(memory_snapshot);
+    const std::string loaded(header_->snapshot,
+                             strnlen(header_->snapshot, sizeof(header_->snapshot)));
+    if (loaded != id.path || header_->snapshot_bytes != id.bytes ||
+        header_->snapshot_mtime != id.mtime) {
+      LOG(WARNING) << name_ << " holds " << loaded << ", not " << id.path;
+      Unmap();
+      return false;
+    }
+  }
+  transitions_ = reinterpret_cast<const float*>(header_ + 1);
+  if (HugePagesEnabled()) {
+    AdviseHugePages(mapping_, mapped_bytes_);
+  }
+  LOG(INFO) << "Attached to shared replay memory " << name_ << " with "
+            << header_->num_transitions << " transitions";
+  return true;
+}
+
+} // namespace dqn
@@ -0,0 +1,112 @@
+#ifndef SHARED_REPLAY_MEMORY_HPP_
+#define SHARED_REPLAY_MEMORY_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include "dqn.hpp"
+
+namespace dqn {
+
+/**
+ * Header at the start of a shared replay memory segment. The loader
+ * fills in the transitions and sets ready last, so readers can poll
+ * it from other processes. The snapshot fields identify the file the
+ * segment was loaded from.
+ */
+struct alignas(kStateAlignment) SharedReplayHeader {
+  uint64_t magic;
+  int32_t state_size;
+  int32_t state_stride; // Floats reserved for the state of a record
+  int32_t stride; // Floats per transition record
+  int32_t loader_pid;
+  int64_t num_transitions;
+  int64_t num_episodes;
+  int64_t snapshot_bytes;
+  int64_t snapshot_mtime;
+  char snapshot[256]; // Canonical path, possibly truncated
+  std::atomic<int32_t> ready;
+};
+
+/**
+ * A read-only replay memory living in a POSIX shared memory
+ * segment. The first process to open a given name loads a
+ * .replaymemory file into the segment. Every later process (or
+ * thread) maps the same pages read-only, so N learners sweeping
+ * hyperparameters on one dataset cost one copy of RAM.
+ *
+ * Each transition is stored as a fixed stride record of floats:
+ * [state | actor_output | reward | on_policy_target | terminal].
+ * States are padded to the stride of their StateLayout and records
+ * to whole cache lines, so every state starts on a cache line.
+ * The next state of a non-terminal transition is the state of the
+ * record that follows it.
+ *
+ * The loader unlinks the segment when it is destroyed; processes that
+ * still have it mapped keep their view. A segment left behind by a
+ * loader that died, or loaded from a different file than the one an
+ * attacher was given, is unlinked and loaded again.
+ */
+class SharedReplayMemory {
+public:
+  // Attaches to the segment called name, creating it from
+  // memory_snapshot if it does not exist yet. An empty memory_snapshot
+  // attaches to whatever the segment holds.
+  SharedReplayMemory(const std::string& name,
+                     const std::string& memory_snapshot,
+                     int state_size);
+  ~SharedReplayMemory();
+
+  int size() const { return header_->num_transitions; }
+  int episodes() const { return header_->num_episodes; }
+  const std::string& name() const { return name_; }
+
+  const float* state(int i) const { return record(i); }
+  const float* actor_output(int i) const { return record(i) + state_stride_; }
+  float reward(int i) const { return record(i)[state_stride_ + kActorOutputSize]; }
+  float on_policy_target(int i) const {
+    return record(i)[state_stride_ + kActorOutputSize + 1];
+  }
+  bool terminal(int i) const {
+    return record(i)[state_stride_ + kActorOutputSize + 2] != 0;
+  }
+  // Index of the first transition in the episode containing i,
+  // looking back at most max_lookback transitions.
+  int EpisodeStart(int i, int max_lookback) const;
+
+  // Removes the named segment. Processes that have it mapped keep
+  // their view until they exit.
+  static void Unlink(const std::string& name);
+
+protected:
+  static constexpr int kActorOutputSize = kActionSize + kActionParamSize;
+  static constexpr uint64_t kMagic = 0x4448514E52504C33; // "DHQNRPL3"
+  // Longest wait for a loader that is alive but not done
+  static constexpr int kAttachTimeoutSeconds = 3600;
+
+  const float* record(int i) const {
+    return transitions_ + static_cast<size_t>(i) * header_->stride;
+  }
+  // Creates the segment and fills it from the replay memory file.
+  void Create(int fd, const std::string& memory_snapshot);
+  // Maps an existing segment once its loader has finished. Returns
+  // false, leaving nothing mapped, if the segment is stale: its loader
+  // died or it was loaded from another file than memory_snapshot.
+  bool Attach(int fd, const std::string& memory_snapshot);
+  void Unmap();
+
+protected:
+  std::string name_;
+  const int state_size_;
+  const int state_stride_;
+  size_t mapped_bytes_;
+  void* mapping_;
+  SharedReplayHeader* header_;
+  const float* transitions_;
+  ino_t inode_; // Of the segment this process created, or 0
+};
+
+} // namespace dqn
+
+#endif /* SHARED_REPLAY_MEMORY_HPP_ */
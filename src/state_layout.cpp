@@ -0,0 +1,41 @@
+#include "state_layout.hpp"
+#include <algorithm>
+
+namespace dqn {
+
+namespace {
+
+void GenericCopyStates(const float* const* states, int count, float* dst,
+                       int state_size) {
+  for (int n = 0; n < count; ++n) {
+    if (n + kPrefetchStates < count) {
+      PrefetchState(states[n + kPrefetchStates], state_size);
+    }
+    std::copy(states[n], states[n] + state_size, dst + n * state_size);
+  }
+}
+
+template <int kNumPlayers>
+StateOps SpecializedOps() {
+  typedef StateLayout<kNumPlayers> Layout;
+  return StateOps{Layout::kFeatures, Layout::kStride, true, &Layout::CopyStates};
+}
+
+} // namespace
+
+StateOps GetStateOps(int state_size) {
+  // Team configurations from 1v0 up to 4v4
+  static const StateOps kSpecialized[] = {
+    SpecializedOps<1>(), SpecializedOps<2>(), SpecializedOps<3>(),
+    SpecializedOps<4>(), SpecializedOps<5>(), SpecializedOps<6>(),
+    SpecializedOps<7>(), SpecializedOps<8>()
+  };
+  for (const StateOps& ops : kSpecialized) {
+    if (ops.state_size == state_size) {
+      return ops;
+    }
+  }
+  return StateOps{state_size, RoundUpToLine(state_size), false, &GenericCopyStates};
+}
+
+} // namespace dqn
@@ -0,0 +1,70 @@
+#ifndef STATE_LAYOUT_HPP_
+#define STATE_LAYOUT_HPP_
+
+#include "hfo_game.hpp"
+
+namespace dqn {
+
+// States in replay storage start on cache line boundaries
+constexpr int kStateAlignment = 64;
+constexpr int kFloatsPerLine = kStateAlignment / sizeof(float);
+
+constexpr int RoundUpToLine(int floats) {
+  return (floats + kFloatsPerLine - 1) / kFloatsPerLine * kFloatsPerLine;
+}
+
+// States ahead of a batch copy whose cache lines are prefetched
+constexpr int kPrefetchStates = 2;
+
+inline void PrefetchState(const float* state, int state_size) {
+  for (int i = 0; i < state_size; i += kFloatsPerLine) {
+    __builtin_prefetch(state + i);
+  }
+}
+
+/**
+ * Compile-time layout of the state of a team configuration with
+ * kNumPlayers players on the field. With the size known, the copy
+ * loop is fully unrolled and vectorized by the compiler.
+ */
+template <int kNumPlayers>
+struct StateLayout {
+  static constexpr int kFeatures = NumStateFeatures(kNumPlayers);
+  static constexpr int kStride = RoundUpToLine(kFeatures);
+
+  static void CopyStates(const float* const* states, int count, float* dst,
+                         int /*state_size*/) {
+    for (int n = 0; n < count; ++n) {
+      if (n + kPrefetchStates < count) {
+        PrefetchState(states[n + kPrefetchStates], kFeatures);
+      }
+      const float* src = states[n];
+      float* row = dst + n * kFeatures;
+      for (int i = 0; i < kFeatures; ++i) {
+        row[i] = src[i];
+      }
+    }
+  }
+};
+
+/**
+ * Runtime handle to the state layout of the active state_size.
+ */
+struct StateOps {
+  int state_size;
+  int stride; // Floats between consecutive states in replay storage
+  bool specialized;
+  // Copies count states to consecutive rows of state_size floats at
+  // dst. Called once per batch, so the indirect call is paid once and
+  // the specialized loop runs inlined within it.
+  void (*copy_states)(const float* const* states, int count, float* dst,
+                      int state_size);
+};
+
+// Returns the specialized layout for state_size if one exists and a
+// generic one otherwise.
+StateOps GetStateOps(int state_size);
+
+} // namespace dqn
+
+#endif /* STATE_LAYOUT_HPP_ */
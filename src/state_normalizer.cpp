@@ -0,0 +1,128 @@
+#include "state_normalizer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <glog/logging.h>
+
+namespace dqn {
+
+constexpr int StateNormalizer::kBatch;
+constexpr float StateNormalizer::kMinStd;
+constexpr float StateNormalizer::kClip;
+
+StateNormalizer::StateNormalizer(int state_size) :
+    state_size_(state_size),
+    frozen_(false),
+    staged_(0),
+    staged_states_(kBatch * state_size),
+    count_(0),
+    mean_(state_size, 0.0),
+    m2_(state_size, 0.0),
+    batch_mean_(state_size),
+    batch_m2_(state_size),
+    shift_(state_size, 0.0f),
+    scale_(state_size, 1.0f) {
+}
+
+void StateNormalizer::Add(const float* state) {
+  if (frozen_) {
+    return;
+  }
+  std::copy(state, state + state_size_,
+            staged_states_.data() + staged_ * state_size_);
+  if (++staged_ == kBatch) {
+    Flush();
+  }
+}
+
+void StateNormalizer::Flush() {
+  if (frozen_ || staged_ == 0) {
+    return;
+  }
+  // Mean and squared deviations of the staged states. The loops run
+  // over features so each row is a vector pass.
+  const int k = staged_;
+  const int size = state_size_;
+  double* batch_mean = batch_mean_.data();
+  double* batch_m2 = batch_m2_.data();
+  std::fill(batch_mean, batch_mean + size, 0.0);
+  std::fill(batch_m2, batch_m2 + size, 0.0);
+  for (int s = 0; s < k; ++s) {
+    const float* x = staged_states_.data() + s * size;
+    for (int i = 0; i < size; ++i) {
+      batch_mean[i] += x[i];
+    }
+  }
+  for (int i = 0; i < size; ++i) {
+    batch_mean[i] /= k;
+  }
+  for (int s = 0; s < k; ++s) {
+    const float* x = staged_states_.data() + s * size;
+    for (int i = 0; i < size; ++i) {
+      const double d = x[i] - batch_mean[i];
+      batch_m2[i] += d * d;
+    }
+  }
+  // Merge them into the running statistics
+  const double n = double(count_) + k;
+  const double batch_weight = k / n;
+  const double cross_weight = double(count_) * k / n;
+  double* mean = mean_.data();
+  double* m2 = m2_.data();
+  for (int i = 0; i < size; ++i) {
+    const double delta = batch_mean[i] - mean[i];
+    mean[i] += delta * batch_weight;
+    m2[i] += batch_m2[i] + delta * delta * cross_weight;
+  }
+  count_ += k;
+  staged_ = 0;
+  UpdateScale();
+}
+
+void StateNormalizer::UpdateScale() {
+  if (count_ == 0) {
+    std::fill(shift_.begin(), shift_.end(), 0.0f);
+    std::fill(scale_.begin(), scale_.end(), 1.0f);
+    return;
+  }
+  for (int i = 0; i < state_size_; ++i) {
+    const double std = std::sqrt(m2_[i] / count_);
+    shift_[i] = mean_[i];
+    scale_[i] = 1.0 / std::max<double>(std, kMinStd);
+  }
+}
+
+void StateNormalizer::Normalize(const float* src, float* dst) const {
+  const float* shift = shift_.data();
+  const float* scale = scale_.data();
+  for (int i = 0; i < state_size_; ++i) {
+    const float x = (src[i] - shift[i]) * scale[i];
+    dst[i] = std::min(std::max(x, -kClip), kClip);
+  }
+}
+
+void StateNormalizer::Save(const std::string& filename) const {
+  std::ofstream out(filename.c_str(), std::ios_base::out | std::ios_base::binary);
+  CHECK(out) << "Unable to write " << filename;
+  out.write((const char*)&state_size_, sizeof(int));
+  out.write((const char*)&count_, sizeof(uint64_t));
+  out.write((const char*)mean_.data(), state_size_ * sizeof(double));
+  out.write((const char*)m2_.data(), state_size_ * sizeof(double));
+  CHECK(out) << "Unable to write " << filename;
+}
+
+void StateNormalizer::Load(const std::string& filename) {
+  std::ifstream in(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+  CHECK(in) << "Unable to read " << filename;
+  int state_size;
+  in.read((char*)&state_size, sizeof(int));
+  CHECK_EQ(state_size, state_size_) << "State statistics of another state size";
+  in.read((char*)&count_, sizeof(uint64_t));
+  in.read((char*)mean_.data(), state_size_ * sizeof(double));
+  in.read((char*)m2_.data(), state_size_ * sizeof(double));
+  CHECK(in) << "Truncated state statistics " << filename;
+  staged_ = 0;
+  UpdateScale();
+}
+
+} // namespace dqn
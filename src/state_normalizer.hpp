@@ -0,0 +1,63 @@
+#ifndef STATE_NORMALIZER_HPP_
+#define STATE_NORMALIZER_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace dqn {
+
+/**
+ * Running per-feature mean and variance of the states entering replay
+ * memory, and the kernel normalizing states into the nets' inputs.
+ *
+ * States are staged and merged kBatch at a time with Chan et al.'s
+ * parallel form of Welford's update, so a merge is a few passes over
+ * contiguous feature arrays that vectorize. Normalized features are
+ * (x - mean) / max(std, kMinStd), clipped to +-kClip. Until the first
+ * merge the normalization is the identity.
+ */
+class StateNormalizer {
+public:
+  static constexpr int kBatch = 256;
+  static constexpr float kMinStd = 1e-2;
+  static constexpr float kClip = 5;
+
+  explicit StateNormalizer(int state_size);
+
+  int state_size() const { return state_size_; }
+  // States merged into the statistics
+  uint64_t count() const { return count_; }
+  // While frozen, Add and Flush leave the statistics unchanged
+  bool frozen() const { return frozen_; }
+  void set_frozen(bool frozen) { frozen_ = frozen; }
+
+  // Stages a state, merging the staged states once kBatch are
+  void Add(const float* state);
+  // Merges the staged states
+  void Flush();
+  // Writes the normalized state_size features of src to dst
+  void Normalize(const float* src, float* dst) const;
+
+  // The merged statistics. Staged states are not saved.
+  void Save(const std::string& filename) const;
+  void Load(const std::string& filename);
+
+protected:
+  // Recomputes shift_ and scale_ from the statistics
+  void UpdateScale();
+
+protected:
+  const int state_size_;
+  bool frozen_;
+  int staged_;
+  std::vector<float> staged_states_; // kBatch rows of state_size_
+  uint64_t count_;
+  std::vector<double> mean_, m2_; // m2_ sums squared deviations
+  std::vector<double> batch_mean_, batch_m2_; // Of the staged states
+  std::vector<float> shift_, scale_; // Applied by Normalize
+};
+
+} // namespace dqn
+
+#endif /* STATE_NORMALIZER_HPP_ */
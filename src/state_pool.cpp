@@ -0,0 +1,114 @@
+#include "state_pool.hpp"
+#include <atomic>
+#include <sstream>
+
+namespace dqn {
+
+namespace {
+
+// Bounds the memory a thread can hold on to after evicting a burst
+constexpr size_t kMaxFreeStates = 1 << 16;
+
+std::atomic<uint64_t> num_allocated(0);
+std::atomic<uint64_t> num_reused(0);
+std::atomic<uint64_t> num_recycled(0);
+std::atomic<uint64_t> num_released(0);
+
+struct FreeLists {
+  std::vector<StateData*> states;
+  std::vector<void*> blocks;
+  size_t block_bytes = 0;
+  ~FreeLists();
+};
+
+// Set once the thread's free lists are destroyed. States dropped
+// after that (e.g. by static destructors) go straight to the heap.
+thread_local bool free_lists_destroyed = false;
+thread_local FreeLists free_lists;
+
+FreeLists::~FreeLists() {
+  free_lists_destroyed = true;
+  for (StateData* state : states) {
+    delete state;
+  }
+  for (void* block : blocks) {
+    ::operator delete(block);
+  }
+}
+
+struct StateRecycler {
+  void operator()(StateData* state) const {
+    if (!free_lists_destroyed && free_lists.states.size() < kMaxFreeStates) {
+      free_lists.states.push_back(state);
+      num_recycled++;
+    } else {
+      delete state;
+      num_released++;
+    }
+  }
+};
+
+} // namespace
+
+namespace internal {
+
+void* PopBlock(size_t bytes) {
+  if (free_lists_destroyed || free_lists.blocks.empty() ||
+      free_lists.block_bytes != bytes) {
+    return NULL;
+  }
+  void* block = free_lists.blocks.back();
+  free_lists.blocks.pop_back();
+  return block;
+}
+
+bool PushBlock(void* block, size_t bytes) {
+  if (free_lists_destroyed || free_lists.blocks.size() >= kMaxFreeStates) {
+    return false;
+  }
+  if (free_lists.block_bytes != bytes) {
+    if (!free_lists.blocks.empty()) {
+      return false;
+    }
+    free_lists.block_bytes = bytes;
+  }
+  free_lists.blocks.push_back(block);
+  return true;
+}
+
+} // namespace internal
+
+StateDataSp AllocateState(int state_size) {
+  StateData* state;
+  if (!free_lists_destroyed && !free_lists.states.empty()) {
+    state = free_lists.states.back();
+    free_lists.states.pop_back();
+    state->resize(state_size);
+    num_reused++;
+  } else {
+    state = new StateData(state_size);
+    num_allocated++;
+  }
+  return StateDataSp(
+      state, StateRecycler(), internal::ControlBlockAllocator<StateData>());
+}
+
+StatePoolStats GetStatePoolStats() {
+  StatePoolStats stats;
+  stats.allocated = num_allocated;
+  stats.reused = num_reused;
+  stats.recycled = num_recycled;
+  stats.released = num_released;
+  return stats;
+}
+
+std::string DescribeStatePool() {
+  StatePoolStats stats = GetStatePoolStats();
+  std::ostringstream ss;
+  ss << "live = " << stats.live() << ", allocated = " << stats.allocated
+     << ", reused = " << stats.reused << ", recycled = " << stats.recycled
+     << ", released = " << stats.released;
+  return ss.str();
+}
+
+} // namespace dqn
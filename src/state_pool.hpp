@@ -0,0 +1,87 @@
+#ifndef STATE_POOL_HPP_
+#define STATE_POOL_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include "huge_pages.hpp"
+
+namespace dqn {
+
+// Replay states. Backed by huge pages with -huge_pages.
+using StateData   = std::vector<float, HugePageAllocator<float> >;
+using StateDataSp = std::shared_ptr<StateData>;
+
+/**
+ * Pool for the state buffers created at every step of every episode.
+ * States are freed long after they are made, when replay memory
+ * evicts them, so plain make_shared fragments the heap over long
+ * runs. Pooled states go back to a free list of the thread dropping
+ * the last reference (usually the agent evicting them) and are handed
+ * out again by the next allocation on that thread. The shared_ptr
+ * control blocks are recycled the same way.
+ */
+StateDataSp AllocateState(int state_size);
+
+template <typename InputIt>
+StateDataSp AllocateState(InputIt begin, InputIt end) {
+  StateDataSp state = AllocateState(std::distance(begin, end));
+  std::copy(begin, end, state->begin());
+  return state;
+}
+
+struct StatePoolStats {
+  uint64_t allocated; // States taken from the heap
+  uint64_t reused;    // States taken from a free list
+  uint64_t recycled;  // States put back on a free list
+  uint64_t released;  // States returned to the heap
+  uint64_t live() const { return allocated + reused - recycled - released; }
+};
+
+StatePoolStats GetStatePoolStats();
+std::string DescribeStatePool();
+
+namespace internal {
+
+// Per-thread free list of blocks of a single size. Returns NULL / false
+// if the list is empty / full or holds blocks of another size.
+void* PopBlock(size_t bytes);
+bool PushBlock(void* block, size_t bytes);
+
+// Allocates shared_ptr control blocks from the thread's free list
+template <typename T>
+struct ControlBlockAllocator {
+  using value_type = T;
+  ControlBlockAllocator() = default;
+  template <typename U>
+  ControlBlockAllocator(const ControlBlockAllocator<U>&) {}
+  T* allocate(size_t n) {
+    void* block = n == 1 ? PopBlock(sizeof(T)) : NULL;
+    return static_cast<T*>(block ? block : ::operator new(n * sizeof(T)));
+  }
+  void deallocate(T* p, size_t n) {
+    if (n != 1 || !PushBlock(p, sizeof(T))) {
+      ::operator delete(p);
+    }
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const ControlBlockAllocator<T>&, const ControlBlockAllocator<U>&) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const ControlBlockAllocator<T>&, const ControlBlockAllocator<U>&) {
+  return false;
+}
+
+} // namespace internal
+
+} // namespace dqn
+
+#endif /* STATE_POOL_HPP_ */